@@ -24,6 +24,11 @@ public:
 
     vec3 min() const { return _min; }
     vec3 max() const { return _max; }
+    float area() const
+    {
+        vec3 d = _max - _min;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
 
     bool hit(const ray &r, float tmin, float tmax) const;
 
@@ -62,3 +67,9 @@ aabb surrounding_box(aabb box0, aabb box1)
              ffmax(box0.max().z(), box1.max().z()));
     return aabb(small, big);
 }
+
+// the box at t between a at 0 and b at 1
+inline aabb lerp(const aabb &a, const aabb &b, float t)
+{
+    return aabb((1 - t) * a.min() + t * b.min(), (1 - t) * a.max() + t * b.max());
+}
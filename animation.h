@@ -0,0 +1,58 @@
+#pragma once
+#include "transform3.h"
+#include "vec3.h"
+#include <vector>
+
+class instance;
+
+// where an instance is at one frame of a sequence. rotations are in units of pi like in "transform"
+struct keyframe
+{
+    float frame;
+    vec3 scale;
+    vec3 rotate;
+    vec3 translate;
+};
+
+// scale, rotation and translation each interpolated linearly from a at t = 0 to b at t = 1, so that rotations turn instead of shearing
+inline keyframe interpolate(const keyframe &a, const keyframe &b, float t)
+{
+    return {(1 - t) * a.frame + t * b.frame, (1 - t) * a.scale + t * b.scale, (1 - t) * a.rotate + t * b.rotate, (1 - t) * a.translate + t * b.translate};
+}
+
+inline transform3 to_transform(const keyframe &key)
+{
+    return transform3(key.scale, key.rotate, key.translate);
+}
+
+// an instance that's moved through its keyframes, which are sorted by frame. between two keyframes it's interpolated,
+// and before the first or after the last it stays where that one has it
+class instance_animation
+{
+public:
+    instance_animation(instance *target, std::vector<keyframe> keys) : target(target), keys(keys) {}
+
+    keyframe key_at(float frame) const
+    {
+        if (frame <= keys.front().frame)
+        {
+            return keys.front();
+        }
+        for (size_t k = 1; k < keys.size(); k++)
+        {
+            if (frame < keys[k].frame)
+            {
+                const keyframe &a = keys[k - 1], &b = keys[k];
+                return interpolate(a, b, (frame - a.frame) / (b.frame - a.frame));
+            }
+        }
+        return keys.back();
+    }
+    transform3 at(float frame) const
+    {
+        return to_transform(key_at(frame));
+    }
+
+    instance *target;
+    std::vector<keyframe> keys;
+};
@@ -0,0 +1,219 @@
+#pragma once
+#include "config.h"
+#include "hdr_output.h"
+#include "hittable.h"
+#include "material.h"
+#include "ray.h"
+#include "types.h"
+#include "vec3.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// light groups past this many are added to the last one
+#define MAX_LIGHT_GROUPS 16
+
+// what one camera sample leaves in the aovs. renderers only hand one to the integrator when aovs are on,
+// and integrators check for null before recording anything, so renders without aovs don't pay for them
+struct aov_sample
+{
+    void reset(unsigned enabled)
+    {
+        this->enabled = enabled;
+        albedo = normal = direct = indirect = vec3(0, 0, 0);
+        depth = 0;
+        surface_found = false;
+        if (wants(AOV_LIGHT_GROUPS))
+        {
+            std::fill(light_groups, light_groups + MAX_LIGHT_GROUPS, vec3(0, 0, 0));
+        }
+    }
+    bool wants(AOVType type) const
+    {
+        return (enabled & (1u << type)) != 0;
+    }
+
+    // called for every surface along the camera path. depth is where the camera ray hit, albedo and normal are from the first surface
+    // that isn't a mirror or smooth glass, so that what's seen in a mirror has the albedo and normal it has in the image
+    void record_surface(const ray &r, const hit_record &rec, const material &mat, int bounce)
+    {
+        if (bounce == 0)
+        {
+            depth = (rec.p - r.origin()).length();
+        }
+        if (surface_found || mat.is_specular())
+        {
+            return;
+        }
+        albedo = mat.albedo(rec);
+        normal = rec.normal.normalized();
+        surface_found = true;
+    }
+    // light from light_group (see World::light_group_of) that reached the camera after scattering `bounces` times
+    void add_light(const vec3 &contribution, int bounces, int light_group)
+    {
+        if (bounces <= 1)
+        {
+            direct += contribution;
+        }
+        else
+        {
+            indirect += contribution;
+        }
+        if (wants(AOV_LIGHT_GROUPS))
+        {
+            light_groups[std::min(light_group, MAX_LIGHT_GROUPS - 1)] += contribution;
+        }
+    }
+
+    unsigned enabled;
+    vec3 albedo;
+    vec3 normal;
+    float depth;
+    vec3 direct;
+    vec3 indirect;
+    vec3 light_groups[MAX_LIGHT_GROUPS];
+    bool surface_found;
+};
+
+// per pixel sums of the aovs that are on, like the framebuffer. only the buffers that were asked for are allocated.
+// they have sample counts of their own, since a resumed render has samples in the framebuffer that the aovs never saw.
+// the variance buffer holds the sum of the colors, and squares the sum of their squares
+class aov_buffers
+{
+public:
+    aov_buffers(unsigned enabled, int width, int height, std::vector<std::string> light_group_names) : enabled(enabled), written(enabled), width(width), height(height)
+    {
+        for (int type = 0; type < AOV_LIGHT_GROUPS; type++)
+        {
+            buffers[type] = (enabled & (1u << type)) ? array_2d<vec3>(width, height) : nullptr;
+        }
+        if (enabled & (1u << AOV_LIGHT_GROUPS))
+        {
+            if (light_group_names.size() > MAX_LIGHT_GROUPS)
+            {
+                std::cout << "WARNING! " << light_group_names.size() << " light groups, the ones past " << MAX_LIGHT_GROUPS << " are added to \"" << light_group_names[MAX_LIGHT_GROUPS - 1] << "\"\n";
+                light_group_names.resize(MAX_LIGHT_GROUPS);
+            }
+            group_names = light_group_names;
+            for (size_t g = 0; g < group_names.size(); g++)
+            {
+                groups.push_back(array_2d<vec3>(width, height));
+            }
+        }
+        squares = (enabled & (1u << AOV_VARIANCE)) ? array_2d<vec3>(width, height) : nullptr;
+        counts = array_2d<int>(width, height);
+    }
+    ~aov_buffers()
+    {
+        for (int type = 0; type < AOV_LIGHT_GROUPS; type++)
+        {
+            delete_2d(buffers[type], height);
+        }
+        for (vec3 **group : groups)
+        {
+            delete_2d(group, height);
+        }
+        delete_2d(squares, height);
+        delete_2d(counts, height);
+    }
+
+    // from the thread that renders pixel (i, j) at the time, or under the framebuffer lock. color is what the sample added to the framebuffer
+    void add(int i, int j, const vec3 &color, const aov_sample &sample)
+    {
+        const vec3 values[AOV_LIGHT_GROUPS] = {sample.albedo, sample.normal, vec3(sample.depth, sample.depth, sample.depth), sample.direct, sample.indirect, color};
+        for (int type = 0; type < AOV_LIGHT_GROUPS; type++)
+        {
+            if (buffers[type] != nullptr)
+            {
+                buffers[type][j][i] += de_nan(values[type]);
+            }
+        }
+        if (squares != nullptr)
+        {
+            squares[j][i] += color * color;
+        }
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            groups[g][j][i] += de_nan(sample.light_groups[g]);
+        }
+        counts[j][i]++;
+    }
+
+    bool has(AOVType type) const
+    {
+        return (enabled & (1u << type)) != 0;
+    }
+    // the mean of aov type in pixel (i, j)
+    vec3 mean(AOVType type, int i, int j) const
+    {
+        return counts[j][i] > 0 ? buffers[type][j][i] / float(counts[j][i]) : vec3(0, 0, 0);
+    }
+    // the variance of the color of one sample in pixel (i, j), estimated from its samples
+    vec3 sample_variance(int i, int j) const
+    {
+        int n = counts[j][i];
+        if (n < 2)
+        {
+            return vec3(0, 0, 0);
+        }
+        vec3 mean = buffers[AOV_VARIANCE][j][i] / float(n);
+        vec3 variance = (squares[j][i] - float(n) * mean * mean) / float(n - 1);
+        return vec3(std::max(variance.x(), 0.0f), std::max(variance.y(), 0.0f), std::max(variance.z(), 0.0f));
+    }
+
+    // each aov that's written as <prefix>_<name>.pfm, light groups as <prefix>_light_<group>.pfm
+    void write(std::string prefix) const
+    {
+        static const char *names[AOV_LIGHT_GROUPS] = {"albedo", "normal", "depth", "direct", "indirect", "variance"};
+        for (int type = 0; type < AOV_LIGHT_GROUPS; type++)
+        {
+            if (buffers[type] == nullptr || (written & (1u << type)) == 0)
+            {
+                continue;
+            }
+            if (type == AOV_VARIANCE)
+            {
+                vec3 **variance = array_2d<vec3>(width, height);
+                for (int j = 0; j < height; j++)
+                {
+                    for (int i = 0; i < width; i++)
+                    {
+                        variance[j][i] = sample_variance(i, j) / float(std::max(counts[j][i], 1));
+                    }
+                }
+                write_one(prefix + "_" + names[type] + ".pfm", variance, nullptr);
+                continue;
+            }
+            write_one(prefix + "_" + names[type] + ".pfm", buffers[type], counts);
+        }
+        if ((written & (1u << AOV_LIGHT_GROUPS)) == 0)
+        {
+            return;
+        }
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            write_one(prefix + "_light_" + group_names[g] + ".pfm", groups[g], counts);
+        }
+    }
+
+    unsigned enabled;
+    // the ones that write saves. the rest are only recorded for the denoiser
+    unsigned written;
+    int width, height;
+    vec3 **buffers[AOV_LIGHT_GROUPS];
+    vec3 **squares;
+    std::vector<vec3 **> groups;
+    std::vector<std::string> group_names;
+    int **counts;
+
+private:
+    void write_one(std::string path, vec3 **buffer, int **counts) const
+    {
+        if (!write_pfm(path, buffer, counts, 1, width, height))
+        {
+            std::cout << "could not write " << path << std::endl;
+        }
+    }
+};
@@ -0,0 +1,111 @@
+// variance benchmark for the microfacet sampling in material.h.
+// estimates the light reflected towards wo by a GGX metal (and transmitted and reflected by rough glass), once with directions from
+// generate(), which samples visible normals, and once with cosine weighted (or for glass, uniform sphere) directions for the same bsdf.
+// the incident light is either uniform, which makes the estimate the directional albedo, or a small bright disk around the mirror direction
+// on top of a dim sky, like a highlight from an area light.
+// both techniques estimate the same integral, so the means have to agree. the variance ratio is how many more samples cosine sampling needs for the same noise.
+//
+// usage: ./bench_bsdf.exe [-n samples]
+
+#include "material.h"
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+struct estimate
+{
+    double mean;
+    double variance;
+};
+
+// incident radiance from direction wi, for the given mirror direction of wo
+float incident(const vec3 &wi, const vec3 &mirror, bool highlight)
+{
+    if (!highlight)
+    {
+        return 1;
+    }
+    // disk of about 8 degrees around the mirror direction
+    return dot(wi, mirror) > 0.99f ? 50.0f : 0.2f;
+}
+
+template <typename Generate, typename Pdf>
+estimate run(const material &mat, const ray &r, const hit_record &rec, const vec3 &mirror, bool highlight, int n, std::mt19937 &rng, Generate generate, Pdf pdf)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, ONE_MINUS_EPSILON);
+    double sum = 0, sum_sq = 0;
+    for (int i = 0; i < n; i++)
+    {
+        vec3 wi = generate(uniform(rng), uniform(rng));
+        double value = 0;
+        float p = wi.squared_length() > 0 ? pdf(wi) : 0;
+        if (p > 0)
+        {
+            vec3 f = mat.eval(r, rec, wi);
+            value = luminance(f) * fabs(dot(unit_vector(wi), rec.normal)) * incident(unit_vector(wi), mirror, highlight) / p;
+        }
+        sum += value;
+        sum_sq += value * value;
+    }
+    double mean = sum / n;
+    return {mean, sum_sq / n - mean * mean};
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 200000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+        {
+            n = atoi(argv[++i]);
+        }
+    }
+    std::mt19937 rng(1);
+
+    hit_record rec;
+    rec.p = vec3(0, 0, 0);
+    rec.normal = vec3(0, 0, 1);
+    rec.u = rec.v = 0;
+
+    const float roughnesses[] = {0.05f, 0.1f, 0.2f, 0.4f, 0.7f};
+    const float angles[] = {0.0f, 45.0f, 75.0f};
+    for (int kind = 0; kind < 2; kind++)
+    {
+        std::cout << (kind == 0 ? "GGX metal, vndf vs cosine hemisphere" : "rough glass (ior 1.5), vndf vs uniform sphere") << ", " << n << " samples each\n";
+        std::cout << std::setw(10) << "roughness" << std::setw(8) << "angle" << std::setw(11) << "light"
+                  << std::setw(11) << "mean vndf" << std::setw(11) << "mean ref" << std::setw(13) << "var vndf" << std::setw(13) << "var ref" << std::setw(10) << "ratio" << '\n';
+        for (float roughness : roughnesses)
+        {
+            material mat = kind == 0 ? (material)metal(vec3(0.95f, 0.64f, 0.54f), roughness) : (material)dielectric(1.5f, roughness);
+            for (float angle : angles)
+            {
+                float theta = angle * M_PI / 180;
+                vec3 wo = vec3(sin(theta), 0, cos(theta));
+                vec3 mirror = vec3(-wo.x(), -wo.y(), wo.z());
+                ray r(wo, -wo);
+                for (int highlight = 0; highlight < 2; highlight++)
+                {
+                    estimate vndf = run(mat, r, rec, mirror, highlight, n, rng,
+                                        [&](float u, float v) { return mat.generate(r, rec, u, v); },
+                                        [&](const vec3 &wi) { return mat.value(r, rec, wi); });
+                    estimate reference = kind == 0 ? run(mat, r, rec, mirror, highlight, n, rng,
+                                                         [&](float u, float v) { return random_cosine_direction(u, v); },
+                                                         [&](const vec3 &wi) { return ffmax(0.0f, (float)(unit_vector(wi).z() / M_PI)); })
+                                                   : run(mat, r, rec, mirror, highlight, n, rng,
+                                                         [&](float u, float v) { return random_on_unit_sphere(u, v); },
+                                                         [&](const vec3 &wi) { return (float)(1 / (4 * M_PI)); });
+                    std::cout << std::fixed << std::setprecision(2) << std::setw(10) << roughness << std::setw(8) << std::setprecision(0) << angle
+                              << std::setw(11) << (highlight ? "highlight" : "uniform") << std::setprecision(4)
+                              << std::setw(11) << vndf.mean << std::setw(11) << reference.mean
+                              << std::scientific << std::setprecision(2) << std::setw(13) << vndf.variance << std::setw(13) << reference.variance
+                              << std::setw(10) << (vndf.variance > 0 ? reference.variance / vndf.variance : 0) << '\n';
+                }
+            }
+        }
+        std::cout << '\n';
+    }
+    return 0;
+}
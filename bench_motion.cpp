@@ -0,0 +1,117 @@
+// benchmark for the bounds of motion blurred instances in bvh.h.
+// a grid of small spheres moves in random directions while the shutter is open, and the same rays, each at a random time in the shutter,
+// are traced through a bvh whose nodes interpolate their bounds to the ray's time and through one whose nodes hold the boxes around
+// the whole motion ("swept_motion_bounds"). both have to find the same hits. prints how long tracing took and the traversal cost
+// (see World::tree_cost) of both, for motions that get longer compared to the spacing of the spheres.
+//
+// usage: ./bench_motion.exe [-n spheres_per_side] [-r rays]
+
+#include "animation.h"
+#include "bvh.h"
+#include "material.h"
+#include "primitive.h"
+#include "random.h"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+struct result
+{
+    double milliseconds;
+    float cost;
+    long hits;
+    double distance_sum;
+};
+
+result trace(std::vector<hittable *> objects, const std::vector<ray> &rays)
+{
+    bvh_node *bvh = new bvh_node(objects.data(), objects.size(), 0, 1);
+    result out;
+    out.cost = bvh->refit() / bvh->area();
+    out.hits = 0;
+    out.distance_sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const ray &r : rays)
+    {
+        hit_record rec;
+        if (bvh->hit(r, 0.001f, FLT_MAX, rec))
+        {
+            out.hits++;
+            out.distance_sum += rec.t;
+        }
+    }
+    out.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    free_bvh(bvh);
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    int side = 16;
+    int ray_count = 200000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            side = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            ray_count = atoi(argv[++i]);
+        }
+    }
+
+    // spheres of radius 0.3 one apart, so a ray through the grid passes a few dozen of them
+    hittable *ball = new sphere(vec3(0, 0, 0), 0.3f, new lambertian(vec3(0.5, 0.5, 0.5)));
+    std::vector<instance *> instances;
+    std::vector<vec3> centers, directions;
+    for (int x = 0; x < side; x++)
+    {
+        for (int y = 0; y < side; y++)
+        {
+            for (int z = 0; z < side; z++)
+            {
+                centers.push_back(vec3(x, y, z));
+                directions.push_back(random_in_unit_sphere().normalized());
+                instances.push_back(new instance(ball, transform3::from_translate(centers.back())));
+            }
+        }
+    }
+    std::vector<hittable *> objects(instances.begin(), instances.end());
+
+    // from a box around the grid towards points inside it
+    std::vector<ray> rays;
+    float middle = (side - 1) / 2.0f;
+    for (int k = 0; k < ray_count; k++)
+    {
+        vec3 origin = vec3(middle, middle, middle) + 2 * side * random_in_unit_sphere().normalized();
+        vec3 target(random_double() * side, random_double() * side, random_double() * side);
+        rays.push_back(ray(origin, target - origin, random_double()));
+    }
+
+    std::cout << side * side * side << " moving spheres, " << ray_count << " rays\n"
+              << std::setw(8) << "motion" << std::setw(14) << "interpolated" << std::setw(10) << "swept" << std::setw(14) << "cost (i/s)" << '\n';
+    for (float length : {0.0f, 0.5f, 1.0f, 2.0f, 4.0f, 8.0f})
+    {
+        result results[2];
+        for (int swept = 0; swept < 2; swept++)
+        {
+            for (size_t k = 0; k < instances.size(); k++)
+            {
+                keyframe start = {0, vec3(1, 1, 1), vec3(0, 0, 0), centers[k]};
+                keyframe end = {1, vec3(1, 1, 1), vec3(0, 0, 0), centers[k] + length * directions[k]};
+                instances[k]->set_motion(start, end, swept == 1);
+            }
+            results[swept] = trace(objects, rays);
+        }
+        if (results[0].hits != results[1].hits || fabs(results[0].distance_sum - results[1].distance_sum) > 1e-3 * results[0].distance_sum)
+        {
+            std::cout << "WARNING! the two bvhs found different hits, " << results[0].hits << " and " << results[1].hits << '\n';
+        }
+        std::cout << std::fixed << std::setprecision(1) << std::setw(8) << length << std::setw(11) << results[0].milliseconds << " ms"
+                  << std::setw(7) << results[1].milliseconds << " ms" << std::setprecision(2) << std::setw(8) << results[0].cost << "/" << results[1].cost << '\n';
+    }
+}
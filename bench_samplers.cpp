@@ -0,0 +1,203 @@
+// convergence benchmark for the samplers in sampler.h.
+// renders each scene at a low resolution with every sampler at doubling sample counts,
+// and prints the RMSE against a high sample count reference rendered with the independent sampler.
+// each RMSE is averaged over several differently seeded renders, so that a single firefly doesn't decide the ranking.
+// a second table has the RMSE of the tonemapped image after a 3x3 blur, which is closer to how noisy a low spp preview looks:
+// fireflies are compressed like they are on screen, and blue noise error mostly sits in the high frequencies that the blur (and the eye) removes.
+//
+// usage: ./bench_samplers.exe [-w width] [-r reference_samples] [-s max_samples] [-t trials] [scene.json ...]
+// integrator settings (integrator_type, max_bounces, light_samples, threads, ...) are read from config.json.
+
+#include "camera.h"
+#include "config.h"
+#include "integrator.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "scene_parser.h"
+#include "thirdparty/json.hpp"
+#include "world.h"
+
+using json = nlohmann::json;
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+void render(Integrator *integrator, camera cam, Sampler *prototype, int width, int height, int samples, int threads, std::vector<vec3> &out)
+{
+    out.assign(width * height, vec3(0, 0, 0));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]() {
+            Sampler *sampler = prototype->clone(t);
+            long count = 0;
+            // rows are interleaved between threads
+            for (int j = t; j < height; j += threads)
+            {
+                for (int i = 0; i < width; i++)
+                {
+                    vec3 col = vec3(0, 0, 0);
+                    for (int s = 0; s < samples; s++)
+                    {
+                        ray r = generate_camera_ray(cam, width, height, sampler, i, j, s);
+                        col += de_nan(integrator->color(r, 0, &count, nullptr, sampler));
+                    }
+                    out[j * width + i] = col / float(samples);
+                }
+            }
+            delete sampler;
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+float rmse(const std::vector<vec3> &a, const std::vector<vec3> &b)
+{
+    double total = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        total += (a[i] - b[i]).squared_length();
+    }
+    return sqrt(total / (3.0 * a.size()));
+}
+
+// rmse of the difference between the reinhard tonemapped images, after a [1 2 1] x [1 2 1] blur clamped at the edges
+float blurred_rmse(const std::vector<vec3> &a, const std::vector<vec3> &b, int width, int height)
+{
+    const float weights[3] = {0.25f, 0.5f, 0.25f};
+    double total = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            vec3 error = vec3(0, 0, 0);
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int i = clamp(y + dy, 0, height - 1) * width + clamp(x + dx, 0, width - 1);
+                    error += weights[dx + 1] * weights[dy + 1] * (a[i] / (vec3(1, 1, 1) + a[i]) - b[i] / (vec3(1, 1, 1) + b[i]));
+                }
+            }
+            total += error.squared_length();
+        }
+    }
+    return sqrt(total / (3.0 * width * height));
+}
+
+void print_table(const char *title, const char *const *names, int n, const std::vector<std::vector<float>> &rows)
+{
+    std::cout << title << '\n'
+              << std::setw(6) << "spp";
+    for (int k = 0; k < n; k++)
+    {
+        std::cout << std::setw(14) << names[k];
+    }
+    std::cout << '\n';
+    for (size_t row = 0; row < rows.size(); row++)
+    {
+        std::cout << std::setw(6) << (1 << row);
+        for (int k = 0; k < n; k++)
+        {
+            std::cout << std::setw(14) << rows[row][k];
+        }
+        std::cout << '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 64;
+    int reference_samples = 1024;
+    int max_samples = 64;
+    int trials = 4;
+    std::vector<std::string> scenes;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            reference_samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            max_samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            trials = atoi(argv[++i]);
+        }
+        else
+        {
+            scenes.push_back(argv[i]);
+        }
+    }
+    if (scenes.empty())
+    {
+        scenes = {
+            "scenes/cornell_box.json",
+            "scenes/cornell_box_small_lights.json",
+            "scenes/light_test.json",
+            "scenes/three_orbs.json"};
+    }
+
+    std::ifstream config_file("config.json");
+    json jconfig;
+    config_file >> jconfig;
+    Config config = Config(jconfig);
+
+    const int n = 5;
+    const SamplerType types[n] = {INDEPENDENT, STRATIFIED, HALTON, SOBOL, BLUE_NOISE};
+    const char *names[n] = {"independent", "stratified", "halton", "sobol", "blue noise"};
+
+    for (auto &scene_path : scenes)
+    {
+        json scene;
+        std::ifstream scene_file(scene_path);
+        scene_file >> scene;
+        World *world = build_scene(scene);
+        world->config = config;
+        camera cam = setup_camera(scene["camera"], 1.0f);
+        Integrator *integrator = new NEEIterative(config.max_bounces, world);
+
+        std::vector<vec3> reference, image;
+        Sampler *reference_sampler = make_sampler(INDEPENDENT, reference_samples, 0xdeadbeef);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        render(integrator, cam, reference_sampler, width, width, reference_samples, config.threads, reference);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed_seconds = t2 - t1;
+
+        std::cout << "\n"
+                  << scene_path << ", " << width << "x" << width << ", reference at " << reference_samples << " spp took " << elapsed_seconds.count() << "s\n";
+        std::vector<std::vector<float>> errors, blurred_errors;
+        for (int spp = 1; spp <= max_samples; spp *= 2)
+        {
+            errors.emplace_back(n, 0.0f);
+            blurred_errors.emplace_back(n, 0.0f);
+            for (int k = 0; k < n; k++)
+            {
+                for (int trial = 0; trial < trials; trial++)
+                {
+                    Sampler *sampler = make_sampler(types[k], spp, trial);
+                    render(integrator, cam, sampler, width, width, spp, config.threads, image);
+                    errors.back()[k] += rmse(image, reference) / trials;
+                    blurred_errors.back()[k] += blurred_rmse(image, reference, width, width) / trials;
+                    delete sampler;
+                }
+            }
+        }
+        print_table("rmse", names, n, errors);
+        print_table("tonemapped rmse after a 3x3 blur", names, n, blurred_errors);
+    }
+}
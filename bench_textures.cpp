@@ -0,0 +1,146 @@
+// convergence benchmark for image texture filtering.
+// renders a floor with a fine checkered image texture that recedes towards the horizon, where hundreds of texels fall into one pixel,
+// with nearest, bilinear and trilinear (mip mapped) lookups at doubling sample counts.
+// prints the RMSE against a high sample count reference rendered with nearest lookups, which is the exact average of the texture over each pixel.
+// filtering trades noise for blur, and the footprint shrinks with the sample count (see generate_camera_ray), so the blur fades as the noise would.
+//
+// usage: ./bench_textures.exe [-w width] [-r reference_samples] [-s max_samples] [-t texture_size]
+// integrator settings are read from config.json, like bench_samplers.
+
+#include "camera.h"
+#include "config.h"
+#include "image.h"
+#include "integrator.h"
+#include "primitive.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "world.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+void render(Integrator *integrator, camera &cam, Sampler *sampler, int width, int height, int samples, std::vector<vec3> &out)
+{
+    out.assign(width * height, vec3(0, 0, 0));
+    long count = 0;
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            vec3 col = vec3(0, 0, 0);
+            for (int s = 0; s < samples; s++)
+            {
+                ray r = generate_camera_ray(cam, width, height, sampler, i, j, s);
+                col += de_nan(integrator->color(r, 0, &count, nullptr, sampler));
+            }
+            out[j * width + i] = col / float(samples);
+        }
+    }
+}
+
+float rmse(const std::vector<vec3> &a, const std::vector<vec3> &b)
+{
+    double total = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        total += (a[i] - b[i]).squared_length();
+    }
+    return sqrt(total / (3.0 * a.size()));
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 96;
+    int reference_samples = 1024;
+    int max_samples = 64;
+    int texture_size = 1024;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            reference_samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            max_samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            texture_size = atoi(argv[++i]);
+        }
+    }
+    int height = width * 2 / 3;
+
+    std::ifstream config_file("config.json");
+    json jconfig;
+    config_file >> jconfig;
+    Config config = Config(jconfig);
+
+    // checkers 4 texels wide, with a thin stripe through every other one so that there's detail at every scale
+    std::vector<unsigned char> pixels(4 * texture_size * texture_size);
+    for (int y = 0; y < texture_size; y++)
+    {
+        for (int x = 0; x < texture_size; x++)
+        {
+            bool odd = ((x / 4) + (y / 4)) & 1;
+            bool stripe = (x % 8) == 1;
+            unsigned char *p = &pixels[4 * (y * texture_size + x)];
+            p[0] = stripe ? 230 : (odd ? 220 : 20);
+            p[1] = stripe ? 40 : (odd ? 210 : 30);
+            p[2] = stripe ? 30 : (odd ? 190 : 60);
+            p[3] = 255;
+        }
+    }
+    image_texture *image = from_4byte_vector(pixels, texture_size, texture_size);
+
+    hittable **list = new hittable *[1];
+    list[0] = new rect(1000, 1000, new lambertian(image), XZ);
+    World *world = new World(new bvh_node(list, 1, 0, 1), new constant_texture(vec3(1, 1, 1)), {});
+    world->config = config;
+    camera cam(vec3(0, 120, -520), vec3(0, 0, 200), vec3(0, 1, 0), 40, float(width) / height, 0, 10, 0, 1);
+    Integrator *integrator = new NEEIterative(config.max_bounces, world);
+
+    const int n = 3;
+    const texture_filter filters[n] = {FILTER_NEAREST, FILTER_BILINEAR, FILTER_TRILINEAR};
+    const char *names[n] = {"nearest", "bilinear", "trilinear"};
+
+    std::vector<vec3> reference, result;
+    image->filter = FILTER_NEAREST;
+    Sampler *reference_sampler = make_sampler(INDEPENDENT, reference_samples, 0xdeadbeef);
+    render(integrator, cam, reference_sampler, width, height, reference_samples, reference);
+    delete reference_sampler;
+
+    std::cout << texture_size << "x" << texture_size << " texture, " << width << "x" << height << ", reference at " << reference_samples << " spp, "
+              << image->memory_bytes() / 1024 << " KiB with mips\n"
+              << std::setw(6) << "spp";
+    for (int k = 0; k < n; k++)
+    {
+        std::cout << std::setw(12) << names[k];
+    }
+    std::cout << std::setw(16) << "ms (n/b/t)" << '\n';
+    for (int spp = 1; spp <= max_samples; spp *= 2)
+    {
+        std::cout << std::setw(6) << spp;
+        std::vector<double> times;
+        for (int k = 0; k < n; k++)
+        {
+            image->filter = filters[k];
+            Sampler *sampler = make_sampler(INDEPENDENT, spp, spp);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            render(integrator, cam, sampler, width, height, spp, result);
+            auto t2 = std::chrono::high_resolution_clock::now();
+            times.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+            std::cout << std::setw(12) << std::setprecision(5) << std::fixed << rmse(result, reference);
+            delete sampler;
+        }
+        std::cout << std::setprecision(0) << "     " << times[0] << "/" << times[1] << "/" << times[2] << '\n';
+    }
+}
@@ -10,7 +10,15 @@ public:
     bvh_node(hittable **l, int n, float time0, float time1);
 
     virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+    virtual float transmittance(const ray &r, float t_min, float t_max) const;
     virtual bool bounding_box(float t0, float t1, aabb &box) const;
+    virtual bool motion_bounds(aabb &start, aabb &end) const;
+    float refit();
+    // surface area, averaged over the shutter when the node moves
+    float area() const
+    {
+        return (box.area() + end_box.area()) / 2;
+    }
 
     void find_lights(std::vector<hittable *> *lights)
     {
@@ -19,18 +27,103 @@ public:
 
     hittable *left;
     hittable *right;
+    // when something under the node moves, box is its bounds at shutter open and end_box the ones at shutter close, and rays are tested
+    // against the bounds interpolated to their time. otherwise they're the same and box is all that's used
     aabb box;
+    aabb end_box;
+    bool moving = false;
+
+private:
+    void fit();
+    bool box_hit(const ray &r, float t_min, float t_max) const
+    {
+        return moving ? lerp(box, end_box, r.time()).hit(r, t_min, t_max) : box.hit(r, t_min, t_max);
+    }
 };
 
 bool bvh_node::bounding_box(float t0, float t1, aabb &b) const
 {
-    b = box;
+    b = moving ? surrounding_box(lerp(box, end_box, t0), lerp(box, end_box, t1)) : box;
     return true;
 }
 
+bool bvh_node::motion_bounds(aabb &start, aabb &end) const
+{
+    start = box;
+    end = end_box;
+    return moving;
+}
+
+// box and end_box around the children's
+void bvh_node::fit()
+{
+    aabb start_left, end_left, start_right, end_right;
+    bool moving_left = left->motion_bounds(start_left, end_left);
+    bool moving_right = right->motion_bounds(start_right, end_right);
+    box = surrounding_box(start_left, start_right);
+    end_box = surrounding_box(end_left, end_right);
+    moving = moving_left || moving_right;
+}
+
+// recomputes the boxes from the bottom up after what's below moved, keeping the tree's shape. returns the summed surface area
+// of this node and the nodes under it, which over the root's area is what a ray that hits the root pays for traversal
+float bvh_node::refit()
+{
+    float below = 0;
+    for (hittable *child : {left, right})
+    {
+        bvh_node *node = dynamic_cast<bvh_node *>(child);
+        if (node != nullptr)
+        {
+            below += node->refit();
+        }
+        // leaves with a single child point both sides at it
+        if (right == left)
+        {
+            break;
+        }
+    }
+    fit();
+    return below + area();
+}
+
+// deletes node and the nodes under it, but not the hittables in its leaves
+void free_bvh(bvh_node *node)
+{
+    for (hittable *child : {node->left, node->right})
+    {
+        bvh_node *inner = dynamic_cast<bvh_node *>(child);
+        if (inner != nullptr)
+        {
+            free_bvh(inner);
+        }
+        if (node->right == node->left)
+        {
+            break;
+        }
+    }
+    delete node;
+}
+
+// product of both children, skipping the second one once nothing gets through
+float bvh_node::transmittance(const ray &r, float t_min, float t_max) const
+{
+    if (!box_hit(r, t_min, t_max))
+    {
+        return 1.0f;
+    }
+    float left_transmittance = left->transmittance(r, t_min, t_max);
+    // leaves with a single child point both sides at it
+    if (left_transmittance <= 0 || right == left)
+    {
+        return left_transmittance;
+    }
+    return left_transmittance * right->transmittance(r, t_min, t_max);
+}
+
 bool bvh_node::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
 {
-    if (box.hit(r, t_min, t_max))
+    if (box_hit(r, t_min, t_max))
     {
         hit_record left_rec, right_rec;
         bool hit_left = left->hit(r, t_min, t_max, left_rec);
@@ -171,5 +264,5 @@ bvh_node::bvh_node(hittable **l, int n, float time0, float time1)
         std::cerr << "no bounding box in bvh_node constructor\n";
     }
 
-    box = surrounding_box(box_left, box_right);
+    fit();
 }
@@ -36,16 +36,37 @@ public:
     }
 
     ray get_ray(float s, float t)
+    {
+        return get_ray(s, t, random_double(), random_double(), random_double());
+    }
+
+    // (lens_u, lens_v) picks the point on the lens and time_u the time within the shutter interval
+    ray get_ray(float s, float t, float lens_u, float lens_v, float time_u)
     {
         // circular sensor?
-        vec3 rd = lens_radius * random_in_unit_disk();
+        vec3 rd = lens_radius * random_in_unit_disk(lens_u, lens_v);
         vec3 offset = u * rd.x() + v * rd.y();
-        float time = time0 + random_double() * (time1 - time0);
+        float time = time0 + time_u * (time1 - time0);
         return ray(origin + offset,
                    lower_left_corner + s * horizontal + t * vertical - origin - offset,
                    time);
     }
 
+    // get_ray plus the rays through the same lens point that land ds and dt further along the film, usually one pixel over
+    ray get_ray_differential(float s, float t, float ds, float dt, float lens_u, float lens_v, float time_u)
+    {
+        vec3 rd = lens_radius * random_in_unit_disk(lens_u, lens_v);
+        vec3 offset = u * rd.x() + v * rd.y();
+        float time = time0 + time_u * (time1 - time0);
+        vec3 film = lower_left_corner + s * horizontal + t * vertical - origin - offset;
+        ray r = ray(origin + offset, film, time);
+        r.has_differentials = true;
+        r.rx_origin = r.ry_origin = r.origin();
+        r.rx_direction = film + ds * horizontal;
+        r.ry_direction = film + dt * vertical;
+        return r;
+    }
+
     bool project(vec3 point, float &x, float &y)
     {
         // project a point through the camera and get the x and y values
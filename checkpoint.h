@@ -0,0 +1,107 @@
+#pragma once
+#include "vec3.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// the state of a render in progress: the sum of every pixel's samples and how many samples that is.
+// renders only stop for a checkpoint between passes (progressive) or tiles (tiled), so every pixel has exactly the samples 0 to count - 1,
+// and resuming renders the sample indices that are still missing, the same ones an uninterrupted render would have.
+// the workers of a distributed render save their share in this format too, see distributed.h
+//
+// file layout, native endian:
+//   header (64 bytes): "CKPT", version, width, height, sampler type, seed, generation, then padding
+//   sums: width * height * 3 float32s, rows in framebuffer order, x fastest
+//   counts: width * height uint32s, in the same order
+
+#define CHECKPOINT_MAGIC 0x54504b43 // "CKPT"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t sampler_type;
+    uint32_t seed;
+    // how many times the render was resumed, so that samplers that aren't a pure function of the sample index get new random numbers
+    uint32_t generation;
+    uint32_t padding[9];
+};
+
+class checkpoint
+{
+public:
+    checkpoint() : width(0), height(0), sampler_type(0), seed(0), generation(0) {}
+    checkpoint(int width, int height) : width(width), height(height), sampler_type(0), seed(0), generation(0), sums(3 * (size_t)width * height), counts((size_t)width * height) {}
+
+    vec3 sum(int x, int y) const
+    {
+        const float *s = &sums[3 * ((size_t)y * width + x)];
+        return vec3(s[0], s[1], s[2]);
+    }
+    void set(int x, int y, const vec3 &sum, uint32_t count)
+    {
+        float *s = &sums[3 * ((size_t)y * width + x)];
+        s[0] = sum.x();
+        s[1] = sum.y();
+        s[2] = sum.z();
+        counts[(size_t)y * width + x] = count;
+    }
+    uint32_t count(int x, int y) const
+    {
+        return counts[(size_t)y * width + x];
+    }
+
+    // written aside and renamed over the old one, so being killed while writing leaves the previous checkpoint intact
+    bool write(std::string path) const
+    {
+        checkpoint_header header = {};
+        header.magic = CHECKPOINT_MAGIC;
+        header.version = CHECKPOINT_VERSION;
+        header.width = width;
+        header.height = height;
+        header.sampler_type = sampler_type;
+        header.seed = seed;
+        header.generation = generation;
+        std::string temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary);
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)sums.data(), sums.size() * sizeof(float));
+        file.write((const char *)counts.data(), counts.size() * sizeof(uint32_t));
+        file.close();
+        if (!file || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+    bool read(std::string path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        checkpoint_header header;
+        if (!file.read((char *)&header, sizeof(header)) || header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION)
+        {
+            return false;
+        }
+        width = header.width;
+        height = header.height;
+        sampler_type = header.sampler_type;
+        seed = header.seed;
+        generation = header.generation;
+        sums.resize(3 * (size_t)width * height);
+        counts.resize((size_t)width * height);
+        return file.read((char *)sums.data(), sums.size() * sizeof(float)) && file.read((char *)counts.data(), counts.size() * sizeof(uint32_t));
+    }
+
+    int width, height;
+    uint32_t sampler_type;
+    uint32_t seed;
+    uint32_t generation;
+    std::vector<float> sums;
+    std::vector<uint32_t> counts;
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include "vec3.h"
 #include "camera.h"
+#include "sampler.h"
 #include "thirdparty/json.hpp"
 
 using json = nlohmann::json;
@@ -71,11 +72,90 @@ IntegratorType get_integrator_type_for(std::string type)
     return mapping[type];
 }
 
+// extra per pixel buffers recorded in the same pass as the image
+enum AOVType
+{
+    AOV_ALBEDO,
+    AOV_NORMAL,
+    AOV_DEPTH,
+    // light that reached the camera after at most one bounce, and the rest
+    AOV_DIRECT,
+    AOV_INDIRECT,
+    // of the color of single samples, divided by their count, so that it's the variance of the pixel's mean
+    AOV_VARIANCE,
+    AOV_LIGHT_GROUPS,
+    AOV_COUNT
+};
+
+// AOV_COUNT for names that aren't an aov
+AOVType get_aov_type_for(std::string type)
+{
+    static std::map<std::string, AOVType> mapping = {
+        {"albedo", AOV_ALBEDO},
+        {"normal", AOV_NORMAL},
+        {"depth", AOV_DEPTH},
+        {"direct", AOV_DIRECT},
+        {"indirect", AOV_INDIRECT},
+        {"variance", AOV_VARIANCE},
+        {"light groups", AOV_LIGHT_GROUPS}};
+    return mapping.count(type) > 0 ? mapping[type] : AOV_COUNT;
+}
+
+// pixel reconstruction filters, see film.h
+enum FilterType
+{
+    BOX_FILTER,
+    GAUSSIAN_FILTER,
+    MITCHELL_FILTER,
+    BLACKMAN_HARRIS_FILTER
+};
+
+FilterType get_filter_type_for(std::string type)
+{
+    static std::map<std::string, FilterType> mapping = {
+        {"box", BOX_FILTER},
+        {"gaussian", GAUSSIAN_FILTER},
+        {"mitchell", MITCHELL_FILTER},
+        {"blackman-harris", BLACKMAN_HARRIS_FILTER}};
+    if (mapping.count(type) == 0)
+    {
+        std::cout << "WARNING! unknown pixel filter \"" << type << "\", using box\n";
+    }
+    return mapping.count(type) > 0 ? mapping[type] : BOX_FILTER;
+}
+
+// in pixels, for when "pixel_filter_radius" isn't set
+float get_default_radius_for(FilterType type)
+{
+    static std::map<FilterType, float> mapping = {
+        {BOX_FILTER, 0.5f},
+        {GAUSSIAN_FILTER, 1.5f},
+        {MITCHELL_FILTER, 2.0f},
+        {BLACKMAN_HARRIS_FILTER, 2.0f}};
+    return mapping[type];
+}
+
+enum DenoiserType
+{
+    NO_DENOISER,
+    ATROUS
+};
+
+DenoiserType get_denoiser_type_for(std::string type)
+{
+    static std::map<std::string, DenoiserType> mapping = {
+        {"none", NO_DENOISER},
+        {"a-trous", ATROUS}};
+    return mapping[type];
+}
+
 struct Config
 {
     s_film film;
     std::string ppm_output_path;
     std::string png_output_path;
+    std::string pfm_output_path;
+    std::string exr_output_path;
     std::string traced_paths_output_path;
     std::string traced_paths_2d_output_path;
     std::string scene_path;
@@ -87,12 +167,42 @@ struct Config
     RenderType render_type;
     bool only_direct_illumination;
     IntegratorType integrator_type;
+    SamplerType sampler_type;
     int max_bounces;
     int samples;
     int light_samples;
     uint16_t threads;
     float normal_offset;
     bool russian_roulette;
+    bool path_guiding;
+    int guiding_training_samples;
+    float guiding_bsdf_fraction;
+    float guiding_spatial_threshold;
+    int ris_candidates;
+    bool ris_reuse;
+    int ris_reuse_neighbours;
+    float ris_reuse_radius;
+    int texture_cache_mb;
+    int texture_tile_size;
+    bool scene_cache;
+    std::string checkpoint_path;
+    float checkpoint_interval;
+    int distributed_chunk_samples;
+    // a bit for each AOVType that's recorded
+    unsigned aovs;
+    std::string aov_output_path;
+    FilterType pixel_filter;
+    float pixel_filter_radius;
+    bool pixel_filter_splatting;
+    float interactive_fps;
+    DenoiserType denoiser;
+    int denoiser_iterations;
+    float denoiser_strength;
+    int frame;
+    int frames;
+    float bvh_rebuild_threshold;
+    float shutter;
+    bool swept_motion_bounds;
     Config(){};
 
     Config(json jconfig)
@@ -100,7 +210,11 @@ struct Config
         film = s_film(jconfig["film"]);
 
         ppm_output_path = jconfig.value("ppm_output_path", "out.ppm");
+        // encoded by the renderer on a background thread, at every progress update and at the end. empty leaves it out
         png_output_path = jconfig.value("png_output_path", "out.png");
+        // linear float copies of the final image, before exposure and tonemapping. empty leaves them out
+        pfm_output_path = jconfig.value("pfm_output_path", "");
+        exr_output_path = jconfig.value("exr_output_path", "");
         traced_paths_output_path = jconfig["traced_paths_output_path"].get<std::string>();
         traced_paths_2d_output_path = jconfig["traced_paths_2d_output_path"].get<std::string>();
         scene_path = jconfig.value("scene", "scenes/scene.json");
@@ -112,12 +226,74 @@ struct Config
 
         render_type = get_render_type_for(jconfig.value("render_type", "progressive"));
         integrator_type = get_integrator_type_for(jconfig.value("integrator_type", "recursive path tracing"));
+        sampler_type = get_sampler_type_for(jconfig.value("sampler", "independent"));
         max_bounces = jconfig.value("max_bounces", 10);
         samples = jconfig.value("samples", 20);
         threads = (uint16_t)jconfig.value("threads", 1);
         normal_offset = jconfig.value("normal_offset", 0.0001);
         light_samples = jconfig.value("light_samples", 1);
         russian_roulette = jconfig.value("russian_roulette", true);
+        path_guiding = jconfig.value("path_guiding", false);
+        // spent on training iterations of 1, 2, 4, ... spp before the render itself
+        guiding_training_samples = jconfig.value("guiding_training_samples", 31);
+        guiding_bsdf_fraction = jconfig.value("guiding_bsdf_fraction", 0.5f);
+        // a spatial cell splits once it saw more than this times sqrt(spp of the iteration) path vertices
+        guiding_spatial_threshold = jconfig.value("guiding_spatial_threshold", 12000.0f);
+        // when above 0, each light sample draws this many unshadowed candidates and traces a shadow ray for only one of them
+        ris_candidates = jconfig.value("ris_candidates", 0);
+        // reuse the light candidates of first hits across samples of the same pixel and from neighbouring pixels (ReSTIR). biased, about 1% darker, see NEEIterative::reuse_reservoir
+        ris_reuse = jconfig.value("ris_reuse", false);
+        ris_reuse_neighbours = jconfig.value("ris_reuse_neighbours", 3);
+        // in pixels
+        ris_reuse_radius = jconfig.value("ris_reuse_radius", 16.0f);
+        // when above 0, png textures are converted to tiled files once and paged in through a cache of this many MiB
+        texture_cache_mb = jconfig.value("texture_cache_mb", 0);
+        texture_tile_size = jconfig.value("texture_tile_size", 32);
+        // keeps a compiled copy of the scene next to its json, which later renders of the same scene load instead of building it again
+        scene_cache = jconfig.value("scene_cache", false);
+        // progressive and tiled renders save their float framebuffer and sample counts here every checkpoint_interval seconds and when they
+        // finish, and continue from it with --resume. empty turns checkpoints off
+        checkpoint_path = jconfig.value("checkpoint_path", "");
+        checkpoint_interval = jconfig.value("checkpoint_interval", 60.0f);
+        // workers of a distributed render (main.exe --worker <dir>) claim this many sample indices at a time
+        distributed_chunk_samples = jconfig.value("distributed_chunk_samples", 4);
+        // any of "albedo", "normal", "depth", "direct", "indirect", "variance" and "light groups". each is written as <aov_output_path>_<name>.pfm at the end,
+        // light groups as one file per group
+        aovs = 0;
+        for (std::string name : jconfig.value("aovs", std::vector<std::string>()))
+        {
+            AOVType type = get_aov_type_for(name);
+            if (type == AOV_COUNT)
+            {
+                std::cout << "WARNING! unknown aov \"" << name << "\" ignored\n";
+                continue;
+            }
+            aovs |= 1u << type;
+        }
+        aov_output_path = jconfig.value("aov_output_path", "output/aov");
+        // how samples are weighted into pixels. the default box of half a pixel gives each pixel only its own samples
+        pixel_filter = get_filter_type_for(jconfig.value("pixel_filter", "box"));
+        pixel_filter_radius = jconfig.value("pixel_filter_radius", get_default_radius_for(pixel_filter));
+        // splat every sample into all pixels the filter reaches, instead of importance sampling the filter around each pixel
+        pixel_filter_splatting = jconfig.value("pixel_filter_splatting", false);
+        // how often main.exe --interactive writes a preview while the image is still changing
+        interactive_fps = jconfig.value("interactive_fps", 10.0f);
+        // filters the final image, guided by albedo, normal, depth and variance aovs that are recorded for it. see denoiser.h
+        denoiser = get_denoiser_type_for(jconfig.value("denoiser", "none"));
+        // the filter's radius doubles with every iteration, 5 reach 62 pixels away
+        denoiser_iterations = jconfig.value("denoiser_iterations", 5);
+        // higher blurs across bigger differences in brightness, relative to the noise of the two pixels
+        denoiser_strength = jconfig.value("denoiser_strength", 1.0f);
+        // keyframed instances are where they are at this frame. with frames above 1 that many frames are rendered from it on as a sequence,
+        // each written to the output paths with _<frame number> added
+        frame = jconfig.value("frame", 0);
+        frames = jconfig.value("frames", 1);
+        // the bvh is refit around instances that moved between frames, and rebuilt once that made it this many times as costly as when it was built
+        bvh_rebuild_threshold = jconfig.value("bvh_rebuild_threshold", 1.5f);
+        // how many frames the shutter stays open for. keyframed instances are motion blurred over that much of their animation
+        shutter = jconfig.value("shutter", 0.0f);
+        // bound moving instances by the box around their whole motion instead of interpolating bounds to each ray's time, to compare against
+        swept_motion_bounds = jconfig.value("swept_motion_bounds", false);
 
         long min_camera_rays = samples * film.total_pixels;
 
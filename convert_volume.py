@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# converts a dense grid of float32 densities into the sparse brick format read by sparse_volume.h,
+# or writes a procedural cloud to try it with.
+import argparse
+import math
+import random
+import struct
+from array import array
+
+BRICK_SIZE = 8
+PAGE_SIZE = 4096
+
+parser = argparse.ArgumentParser()
+parser.add_argument("output", type=str, help="path of the .svol file to write")
+parser.add_argument("-i", "--input", type=str, help="raw little endian float32 grid, x fastest")
+parser.add_argument("-s", "--size", type=int, nargs=3, metavar=("NX", "NY", "NZ"), help="resolution of the input grid")
+parser.add_argument("--demo", type=int, default=0, metavar="N", help="write a procedural N^3 cloud instead of converting a grid")
+parser.add_argument("--threshold", type=float, default=0.0, help="bricks whose densities are all at or below this are left out")
+
+
+def demo_cloud(n, seed=7):
+    # a cluster of soft puffs, mostly empty space around it
+    rng = random.Random(seed)
+    puffs = []
+    for _ in range(24):
+        center = (rng.uniform(0.25, 0.75), rng.uniform(0.35, 0.6), rng.uniform(0.25, 0.75))
+        puffs.append((center, rng.uniform(0.04, 0.1)))
+    values = array("f", bytes(4 * n * n * n))
+    for z in range(n):
+        pz = (z + 0.5) / n
+        for y in range(n):
+            py = (y + 0.5) / n
+            for x in range(n):
+                px = (x + 0.5) / n
+                d = 0.0
+                for (cx, cy, cz), r in puffs:
+                    dist2 = (px - cx) ** 2 + (py - cy) ** 2 + (pz - cz) ** 2
+                    if dist2 < 9 * r * r:
+                        d += math.exp(-dist2 / (2 * r * r))
+                values[(z * n + y) * n + x] = max(0.0, d - 0.1)
+    return values
+
+
+def write_sparse_volume(path, nx, ny, nz, values, threshold=0.0):
+    bricks_x = (nx + BRICK_SIZE - 1) // BRICK_SIZE
+    bricks_y = (ny + BRICK_SIZE - 1) // BRICK_SIZE
+    bricks_z = (nz + BRICK_SIZE - 1) // BRICK_SIZE
+    index = array("i", [-1] * (bricks_x * bricks_y * bricks_z))
+    ranges = array("f")
+    data = array("f")
+    for bz in range(bricks_z):
+        for by in range(bricks_y):
+            for bx in range(bricks_x):
+                brick = array("f", bytes(4 * BRICK_SIZE ** 3))
+                for z in range(BRICK_SIZE):
+                    for y in range(BRICK_SIZE):
+                        for x in range(BRICK_SIZE):
+                            gx, gy, gz = bx * BRICK_SIZE + x, by * BRICK_SIZE + y, bz * BRICK_SIZE + z
+                            if gx < nx and gy < ny and gz < nz:
+                                brick[(z * BRICK_SIZE + y) * BRICK_SIZE + x] = values[(gz * ny + gy) * nx + gx]
+                if max(brick) > threshold:
+                    index[(bz * bricks_y + by) * bricks_x + bx] = len(ranges) // 2
+                    ranges.extend([min(brick), max(brick)])
+                    data.extend(brick)
+    brick_count = len(ranges) // 2
+    header_size = 64
+    data_offset = header_size + 4 * len(index) + 4 * len(ranges)
+    data_offset = (data_offset + PAGE_SIZE - 1) // PAGE_SIZE * PAGE_SIZE
+    with open(path, "wb") as f:
+        f.write(struct.pack("<4s9I24x", b"SVOL", 1, nx, ny, nz, bricks_x, bricks_y, bricks_z, brick_count, data_offset))
+        f.write(index.tobytes())
+        f.write(ranges.tobytes())
+        f.write(bytes(data_offset - f.tell()))
+        f.write(data.tobytes())
+    print("wrote {} of {} bricks to {}".format(brick_count, len(index), path))
+
+
+def main(args):
+    if args.demo > 0:
+        nx = ny = nz = args.demo
+        values = demo_cloud(args.demo)
+    else:
+        if args.input is None or args.size is None:
+            parser.error("either --demo or both --input and --size are needed")
+        nx, ny, nz = args.size
+        values = array("f")
+        with open(args.input, "rb") as f:
+            values.frombytes(f.read(4 * nx * ny * nz))
+    write_sparse_volume(args.output, nx, ny, nz, values, args.threshold)
+
+
+if __name__ == "__main__":
+    main(parser.parse_args())
@@ -0,0 +1,242 @@
+#pragma once
+#include "aov.h"
+#include "hdr_output.h"
+#include "types.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// edge avoiding a-trous wavelet filter (Dammertz et al. 2010) for the final image, with the brightness weight scaled by the noise
+// of the two pixels like in SVGF (Schied et al. 2017). using both pixels' noise instead of only the center's keeps bright noisy pixels from
+// losing their energy to darker neighbours that don't take it in return. every iteration is a 5x5 b-spline kernel with its taps spread twice as far as the last,
+// and a tap is weighted down when its normal, depth or albedo differ from the center's, or its brightness differs by more than the noise explains.
+// the lighting is filtered with the albedo divided out and multiplied back after, so textures don't get blurred.
+// images are planar float arrays, a row after another, and each tap is applied to a whole row at once without branches, which vectorizes
+
+// how fast weights fall off with the distance between normals (squared), depths (relative, per pixel of offset) and albedos (squared)
+#define DENOISER_SIGMA_NORMAL 0.1f
+#define DENOISER_SIGMA_DEPTH 0.05f
+#define DENOISER_SIGMA_ALBEDO 0.02f
+// albedos below this aren't divided out, so the background and black surfaces keep their color
+#define DENOISER_MIN_ALBEDO 0.01f
+
+class atrous_denoiser
+{
+public:
+    atrous_denoiser(int width, int height, int iterations, float strength, int threads)
+        : width(width), height(height), iterations(iterations), strength(strength), threads(std::max(threads, 1))
+    {
+        size_t pixels = (size_t)width * height;
+        for (auto plane : {&normal_x, &normal_y, &normal_z, &depth, &albedo_r, &albedo_g, &albedo_b})
+        {
+            plane->resize(pixels);
+        }
+        for (int k = 0; k < 2; k++)
+        {
+            for (auto plane : {&red[k], &green[k], &blue[k], &variance[k]})
+            {
+                plane->resize(pixels);
+            }
+        }
+    }
+
+    // a new buffer with the denoised mean of every pixel, or nullptr when the aovs are missing a pixel.
+    // framebuffer, counts and samples are like in write_pfm, and the aovs need albedo, normal, depth and variance
+    vec3 **denoise(vec3 **framebuffer, int **counts, int samples, const aov_buffers &aovs)
+    {
+        if (!aovs.has(AOV_ALBEDO) || !aovs.has(AOV_NORMAL) || !aovs.has(AOV_DEPTH) || !aovs.has(AOV_VARIANCE))
+        {
+            std::cout << "WARNING! the denoiser needs albedo, normal, depth and variance aovs, not denoising\n";
+            return nullptr;
+        }
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                if (aovs.counts[j][i] == 0)
+                {
+                    std::cout << "WARNING! pixel " << i << ", " << j << " has no aov samples, not denoising\n";
+                    return nullptr;
+                }
+            }
+        }
+        parallel_rows([&](int j) { load_row(j, framebuffer, counts, samples, aovs); });
+        // the noise estimate of one pixel is noisy itself, so it starts out blurred a little
+        parallel_rows([&](int j) { blur_variance_row(j); });
+        int current = 0;
+        for (int k = 0; k < iterations; k++)
+        {
+            parallel_rows([&](int j) { filter_row(j, 1 << k, current, 1 - current); });
+            current = 1 - current;
+        }
+        vec3 **result = array_2d<vec3>(width, height);
+        parallel_rows([&](int j) {
+            for (int i = 0; i < width; i++)
+            {
+                size_t p = index(i, j);
+                result[j][i] = vec3(red[current][p] * albedo_r[p], green[current][p] * albedo_g[p], blue[current][p] * albedo_b[p]);
+            }
+        });
+        return result;
+    }
+
+private:
+    size_t index(int i, int j) const
+    {
+        return (size_t)j * width + i;
+    }
+
+    template <typename F>
+    void parallel_rows(F row)
+    {
+        std::vector<std::thread> workers;
+        for (int thread_id = 0; thread_id < threads; thread_id++)
+        {
+            workers.emplace_back([&, thread_id]() {
+                for (int j = thread_id; j < height; j += threads)
+                {
+                    row(j);
+                }
+            });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // guides, lighting without albedo, and the variance of its brightness into buffer 1.
+    // channels are assumed to be fully correlated for the brightness variance, which is the usual case with white-ish light
+    void load_row(int j, vec3 **framebuffer, int **counts, int samples, const aov_buffers &aovs)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            size_t p = index(i, j);
+            vec3 n = aovs.mean(AOV_NORMAL, i, j);
+            vec3 a = aovs.mean(AOV_ALBEDO, i, j);
+            normal_x[p] = n.x();
+            normal_y[p] = n.y();
+            normal_z[p] = n.z();
+            depth[p] = aovs.mean(AOV_DEPTH, i, j).x();
+            albedo_r[p] = a.x() > DENOISER_MIN_ALBEDO ? a.x() : 1.0f;
+            albedo_g[p] = a.y() > DENOISER_MIN_ALBEDO ? a.y() : 1.0f;
+            albedo_b[p] = a.z() > DENOISER_MIN_ALBEDO ? a.z() : 1.0f;
+
+            vec3 c = pixel_mean(framebuffer, counts, samples, i, j);
+            red[1][p] = c.x() / albedo_r[p];
+            green[1][p] = c.y() / albedo_g[p];
+            blue[1][p] = c.z() / albedo_b[p];
+            // per sample variance over the samples of the mean in the framebuffer, which can be more than the aovs saw after a resume
+            int n_samples = counts != nullptr && counts[j][i] > 0 ? counts[j][i] : samples;
+            vec3 v = aovs.sample_variance(i, j) / float(n_samples);
+            float deviation = 0.2126f * sqrtf(v.x()) / albedo_r[p] + 0.7152f * sqrtf(v.y()) / albedo_g[p] + 0.0722f * sqrtf(v.z()) / albedo_b[p];
+            variance[1][p] = deviation * deviation;
+        }
+    }
+
+    // 3x3 gaussian of buffer 1's variance into buffer 0, with the lighting copied along
+    void blur_variance_row(int j)
+    {
+        static const float kernel[3] = {0.25f, 0.5f, 0.25f};
+        for (int i = 0; i < width; i++)
+        {
+            size_t p = index(i, j);
+            float sum = 0, weight = 0;
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                int y = j + dy;
+                if (y < 0 || y >= height)
+                {
+                    continue;
+                }
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int x = i + dx;
+                    if (x < 0 || x >= width)
+                    {
+                        continue;
+                    }
+                    float w = kernel[dx + 1] * kernel[dy + 1];
+                    sum += w * variance[1][index(x, y)];
+                    weight += w;
+                }
+            }
+            variance[0][p] = sum / weight;
+            red[0][p] = red[1][p];
+            green[0][p] = green[1][p];
+            blue[0][p] = blue[1][p];
+        }
+    }
+
+    // one a-trous iteration for row j with taps step pixels apart, from buffer `from` into `to`.
+    // the variance is filtered with the squared weights, so that it stays the variance of the filtered lighting
+    void filter_row(int j, int step, int from, int to)
+    {
+        static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+        std::vector<float> sum_r(width, 0.0f), sum_g(width, 0.0f), sum_b(width, 0.0f), sum_variance(width, 0.0f), sum_weight(width, 0.0f);
+        std::vector<float> center_luminance(width);
+        const float *r = red[from].data(), *g = green[from].data(), *b = blue[from].data(), *v = variance[from].data();
+        const size_t row = index(0, j);
+        for (int i = 0; i < width; i++)
+        {
+            center_luminance[i] = 0.2126f * r[row + i] + 0.7152f * g[row + i] + 0.0722f * b[row + i];
+        }
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            int y = j + dy * step;
+            if (y < 0 || y >= height)
+            {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                int offset = dx * step;
+                // the pixels of this row that have the tap inside the image
+                int first = std::max(0, -offset), last = std::min(width, width - offset);
+                float spatial = kernel[dx + 2] * kernel[dy + 2];
+                float distance = sqrtf(float(dx * dx + dy * dy)) * step;
+                float depth_scale = 1.0f / (DENOISER_SIGMA_DEPTH * std::max(distance, 1.0f));
+                const size_t tap_row = index(0, y) + offset;
+                for (int i = first; i < last; i++)
+                {
+                    size_t p = row + i, q = tap_row + i;
+                    float tap_luminance = 0.2126f * r[q] + 0.7152f * g[q] + 0.0722f * b[q];
+                    float nx = normal_x[p] - normal_x[q], ny = normal_y[p] - normal_y[q], nz = normal_z[p] - normal_z[q];
+                    float ar = albedo_r[p] - albedo_r[q], ag = albedo_g[p] - albedo_g[q], ab = albedo_b[p] - albedo_b[q];
+                    float exponent = fabsf(center_luminance[i] - tap_luminance) / (strength * sqrtf(v[p] + v[q]) + 1e-6f) +
+                                     (nx * nx + ny * ny + nz * nz) * (1.0f / DENOISER_SIGMA_NORMAL) +
+                                     fabsf(depth[p] - depth[q]) * depth_scale / (depth[p] + 1e-3f) +
+                                     (ar * ar + ag * ag + ab * ab) * (1.0f / DENOISER_SIGMA_ALBEDO);
+                    float w = spatial * expf(-exponent);
+                    sum_r[i] += w * r[q];
+                    sum_g[i] += w * g[q];
+                    sum_b[i] += w * b[q];
+                    sum_variance[i] += w * w * v[q];
+                    sum_weight[i] += w;
+                }
+            }
+        }
+        // the center tap always has a weight of 9/64, so the sums are never 0
+        for (int i = 0; i < width; i++)
+        {
+            size_t p = row + i;
+            red[to][p] = sum_r[i] / sum_weight[i];
+            green[to][p] = sum_g[i] / sum_weight[i];
+            blue[to][p] = sum_b[i] / sum_weight[i];
+            variance[to][p] = sum_variance[i] / (sum_weight[i] * sum_weight[i]);
+        }
+    }
+
+    int width, height;
+    int iterations;
+    float strength;
+    int threads;
+    std::vector<float> normal_x, normal_y, normal_z, depth;
+    // what's divided out of the lighting, the albedo or 1
+    std::vector<float> albedo_r, albedo_g, albedo_b;
+    // two of each, filtered back and forth
+    std::vector<float> red[2], green[2], blue[2], variance[2];
+};
@@ -0,0 +1,161 @@
+#pragma once
+#include "checkpoint.h"
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#endif
+
+// one frame rendered by several processes, on this machine or on any machine that sees the same job directory.
+// the sample indices of the frame are split into chunks, and workers (main.exe --worker <dir>) take the next chunk that nobody
+// has yet by creating its claim file, which only one process can do. each worker saves its float sums and sample counts as a
+// checkpoint, and main.exe --merge <dir> adds those up. the counter based samplers give every process the same samples for a
+// sample index, so the merged image is the one a single process would have rendered, up to the order the floats were added in
+//
+// the job directory holds:
+//   worker_<n>.claim   taken by the n-th worker to join
+//   worker_<n>.ckpt    what that worker rendered so far, in the checkpoint format. counts aren't prefixes of the sample indices here
+//   chunk_<k>.claim    sample indices [k * chunk_samples, (k + 1) * chunk_samples) belong to whoever created this
+
+// creates path if it isn't there, in a way that only one of several processes trying at once succeeds.
+// errno is EEXIST when another one got there first
+inline bool create_exclusive(std::string path)
+{
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    ::close(fd);
+#else
+    int fd = _open(path.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY, _S_IREAD | _S_IWRITE);
+    if (fd < 0)
+    {
+        return false;
+    }
+    _close(fd);
+#endif
+    return true;
+}
+
+inline bool file_exists(std::string path)
+{
+    return std::ifstream(path).good();
+}
+
+// a worker's side of the job. not thread safe, the renderer claims chunks for all of its threads under one lock
+class distributed_job
+{
+public:
+    distributed_job(std::string directory, int samples, int chunk_samples) : directory(directory), samples(samples), chunk_samples(std::max(chunk_samples, 1)), worker_id(-1), next_chunk(0), claimed_samples(0) {}
+
+    // takes the lowest worker number that's free
+    bool join()
+    {
+        for (int id = 0;; id++)
+        {
+            if (create_exclusive(worker_claim_path(id)))
+            {
+                worker_id = id;
+                return true;
+            }
+            if (errno != EEXIST)
+            {
+                std::cout << "could not join the job in " << directory << ", does the directory exist?\n";
+                return false;
+            }
+        }
+    }
+
+    // the next chunk of sample indices that no worker has claimed, as [first, last)
+    bool claim_chunk(int &first, int &last)
+    {
+        for (; (long)next_chunk * chunk_samples < samples; next_chunk++)
+        {
+            if (create_exclusive(directory + "/chunk_" + std::to_string(next_chunk) + ".claim"))
+            {
+                first = next_chunk * chunk_samples;
+                last = std::min(first + chunk_samples, samples);
+                claimed_samples += last - first;
+                next_chunk++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string worker_claim_path(int id) const
+    {
+        return directory + "/worker_" + std::to_string(id) + ".claim";
+    }
+    std::string output_path(int id) const
+    {
+        return directory + "/worker_" + std::to_string(id) + ".ckpt";
+    }
+
+    std::string directory;
+    int samples;
+    int chunk_samples;
+    int worker_id;
+    int next_chunk;
+    // sample indices this worker took on, per pixel
+    int claimed_samples;
+};
+
+// adds up the outputs of every worker that joined the job in directory, in doubles so that many workers don't lose precision.
+// pixels that a killed worker didn't finish have fewer samples, which is fine since the image divides by each pixel's count
+bool merge_worker_outputs(std::string directory, checkpoint &merged)
+{
+    distributed_job job(directory, 0, 1);
+    std::vector<double> sums;
+    int workers = 0;
+    for (int id = 0; file_exists(job.worker_claim_path(id)); id++)
+    {
+        checkpoint part;
+        if (!part.read(job.output_path(id)))
+        {
+            std::cout << "worker " << id << " didn't leave anything in " << job.output_path(id) << ", skipping it\n";
+            continue;
+        }
+        if (workers == 0)
+        {
+            merged = checkpoint(part.width, part.height);
+            merged.sampler_type = part.sampler_type;
+            merged.seed = part.seed;
+            sums.assign(merged.sums.size(), 0.0);
+        }
+        else if (part.width != merged.width || part.height != merged.height)
+        {
+            std::cout << "worker " << id << " rendered at " << part.width << "x" << part.height << ", not " << merged.width << "x" << merged.height << ", skipping it\n";
+            continue;
+        }
+        // workers are generations of their own, so a render resumed from the merged checkpoint is the next one after all of them
+        merged.generation = std::max(merged.generation, part.generation);
+        for (size_t i = 0; i < sums.size(); i++)
+        {
+            sums[i] += part.sums[i];
+        }
+        for (size_t i = 0; i < merged.counts.size(); i++)
+        {
+            merged.counts[i] += part.counts[i];
+        }
+        workers++;
+    }
+    for (size_t i = 0; i < sums.size(); i++)
+    {
+        merged.sums[i] = (float)sums[i];
+    }
+    std::cout << "merged the output of " << workers << " workers\n";
+    return workers > 0;
+}
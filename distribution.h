@@ -0,0 +1,115 @@
+#pragma once
+#include "helpers.h"
+#include <algorithm>
+#include <vector>
+
+// piecewise-constant distribution over [0, 1), tabulated from n function values
+class distribution_1d
+{
+public:
+    distribution_1d() : func_int(0) {}
+    distribution_1d(const float *f, int n) : func(f, f + n), cdf(n + 1)
+    {
+        cdf[0] = 0;
+        for (int i = 1; i < n + 1; i++)
+        {
+            cdf[i] = cdf[i - 1] + func[i - 1] / n;
+        }
+        func_int = cdf[n];
+        if (func_int == 0)
+        {
+            // all zero, fall back to sampling uniformly
+            for (int i = 1; i < n + 1; i++)
+            {
+                cdf[i] = float(i) / n;
+            }
+        }
+        else
+        {
+            for (int i = 1; i < n + 1; i++)
+            {
+                cdf[i] /= func_int;
+            }
+        }
+    }
+    int count() const { return (int)func.size(); }
+
+    // returns x in [0, 1) distributed according to func, along with its density and the bucket it fell in.
+    float sample_continuous(float u, float &pdf, int &offset) const
+    {
+        // find the last cdf entry that is <= u
+        offset = (int)(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1;
+        offset = clamp(offset, 0, count() - 1);
+        float du = u - cdf[offset];
+        if (cdf[offset + 1] - cdf[offset] > 0)
+        {
+            du /= cdf[offset + 1] - cdf[offset];
+        }
+        pdf = bucket_pdf(offset);
+        return (offset + du) / count();
+    }
+
+    int sample_discrete(float u, float &probability) const
+    {
+        int offset;
+        float pdf;
+        sample_continuous(u, pdf, offset);
+        probability = pdf / count();
+        return offset;
+    }
+
+    float pdf(float x) const
+    {
+        return bucket_pdf(clamp(int(x * count()), 0, count() - 1));
+    }
+
+    float bucket_pdf(int offset) const
+    {
+        return func_int > 0 ? func[offset] / func_int : 1.0f;
+    }
+
+    std::vector<float> func;
+    std::vector<float> cdf;
+    float func_int;
+};
+
+// piecewise-constant distribution over [0, 1)^2.
+// f is laid out row-major with nv rows of nu values, so that f[v * nu + u] is the value at (u, v)
+class distribution_2d
+{
+public:
+    distribution_2d(const float *f, int nu, int nv)
+    {
+        conditional.reserve(nv);
+        std::vector<float> marginal_func(nv);
+        for (int v = 0; v < nv; v++)
+        {
+            conditional.emplace_back(&f[v * nu], nu);
+            marginal_func[v] = conditional.back().func_int;
+        }
+        marginal = distribution_1d(marginal_func.data(), nv);
+    }
+
+    void sample(float u0, float u1, float &u, float &v, float &pdf) const
+    {
+        float pdfs[2];
+        int row, column;
+        v = marginal.sample_continuous(u1, pdfs[1], row);
+        u = conditional[row].sample_continuous(u0, pdfs[0], column);
+        pdf = pdfs[0] * pdfs[1];
+    }
+
+    float pdf(float u, float v) const
+    {
+        int iu = clamp(int(u * conditional[0].count()), 0, conditional[0].count() - 1);
+        int iv = clamp(int(v * marginal.count()), 0, marginal.count() - 1);
+        if (marginal.func_int == 0)
+        {
+            return 1.0f;
+        }
+        return conditional[iv].func[iu] / marginal.func_int;
+    }
+
+    std::vector<distribution_1d> conditional;
+    distribution_1d marginal;
+};
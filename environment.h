@@ -0,0 +1,76 @@
+#pragma once
+#include "distribution.h"
+#include "image.h"
+#include "random.h"
+#include "vec3.h"
+
+// lat-long mapping used for the world background. z is the polar axis.
+inline void direction_to_uv(const vec3 &direction, float &u, float &v)
+{
+    vec3 unit_direction = unit_vector(direction);
+    // get phi and theta values for that direction, then convert to UV values for an environment map.
+    u = (M_PI + atan2(unit_direction.y(), unit_direction.x())) / TAU;
+    v = acos(clamp(unit_direction.z(), -1.0f, 1.0f)) / M_PI;
+}
+
+inline vec3 uv_to_direction(float u, float v, float &sin_theta)
+{
+    float phi = u * TAU - M_PI;
+    float theta = v * M_PI;
+    sin_theta = sin(theta);
+    return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos(theta));
+}
+
+// importance sampling for an image backed world background.
+// texels are weighted by luminance times sin(theta), to account for the lat-long mapping compressing texels near the poles.
+class environment_map
+{
+public:
+    environment_map(image_texture *image) : image(image)
+    {
+        std::vector<float> func(image->width * image->height);
+        for (int y = 0; y < image->height; y++)
+        {
+            float sin_theta = sin(M_PI * (y + 0.5f) / image->height);
+            for (int x = 0; x < image->width; x++)
+            {
+                vec3 c = image->texel(x, y);
+                float luminance = 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+                func[y * image->width + x] = luminance * sin_theta;
+            }
+        }
+        distribution = new distribution_2d(func.data(), image->width, image->height);
+    }
+
+    // returns a unit direction towards the background for the 2d sample (u0, u1), with pdf in solid angle
+    vec3 sample(float u0, float u1, float &pdf) const
+    {
+        float u, v, map_pdf, sin_theta;
+        distribution->sample(u0, u1, u, v, map_pdf);
+        vec3 direction = uv_to_direction(u, v, sin_theta);
+        if (sin_theta <= 0)
+        {
+            pdf = 0;
+        }
+        else
+        {
+            pdf = map_pdf / (2 * M_PI * M_PI * sin_theta);
+        }
+        return direction;
+    }
+
+    float pdf(const vec3 &direction) const
+    {
+        float u, v, sin_theta;
+        direction_to_uv(direction, u, v);
+        uv_to_direction(u, v, sin_theta);
+        if (sin_theta <= 0)
+        {
+            return 0;
+        }
+        return distribution->pdf(u, v) / (2 * M_PI * M_PI * sin_theta);
+    }
+
+    image_texture *image;
+    distribution_2d *distribution;
+};
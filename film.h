@@ -0,0 +1,262 @@
+#pragma once
+#include "config.h"
+#include "distribution.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+// pixel reconstruction filters, and splats for samples that reach the film somewhere other than the pixel they were taken for.
+// filters are separable, f(x, y) = f(x) * f(y), and tabulated once so that neither sampling nor splatting evaluates them.
+// by default samples are importance sampled from the filter around their pixel (filter importance sampling) and still added to only
+// that pixel, with a weight of 1 for filters that are never negative, so checkpoints, aovs and the denoiser see the same framebuffer as before.
+// with "pixel_filter_splatting", samples are spread over their pixel instead and splatted into every pixel the filter reaches
+
+// entries of a filter's table, over [-radius, radius]
+#define FILTER_TABLE_SIZE 64
+// splats are collected per thread in square tiles of this many pixels on a side
+#define SPLAT_TILE_SIZE 16
+
+// where a camera sample lands on the film, in pixels from the corner of pixel (0, 0), and the weight its color gets
+struct film_sample
+{
+    float x, y;
+    float weight;
+};
+
+class pixel_filter
+{
+public:
+    pixel_filter(FilterType type, float radius, int width, int height) : type(type), width(width), height(height)
+    {
+        // a radius of 0.5 is a pixel, and splats reach at most 9 pixels in each direction
+        this->radius = clamp(radius, 0.5f, 4.0f);
+        float bucket = 2 * this->radius / FILTER_TABLE_SIZE;
+        float integral = 0, absolute_integral = 0;
+        table.resize(FILTER_TABLE_SIZE);
+        std::vector<float> absolute(FILTER_TABLE_SIZE);
+        for (int k = 0; k < FILTER_TABLE_SIZE; k++)
+        {
+            table[k] = evaluate(-this->radius + (k + 0.5f) * bucket);
+            absolute[k] = fabsf(table[k]);
+            integral += table[k] * bucket;
+            absolute_integral += absolute[k] * bucket;
+        }
+        // so that the filter integrates to 1 in 2d
+        for (float &value : table)
+        {
+            value /= integral;
+        }
+        sampling = distribution_1d(absolute.data(), FILTER_TABLE_SIZE);
+        sample_weight = absolute_integral / integral;
+        // splats near the edges of the image only get the part of the filter that's inside it, which these make up for
+        coverage_x = coverage(width);
+        coverage_y = coverage(height);
+    }
+
+    // the filter before it's normalized, at x pixels from the center
+    float evaluate(float x) const
+    {
+        x = fabsf(x);
+        if (x > radius)
+        {
+            return 0;
+        }
+        switch (type)
+        {
+        case GAUSSIAN_FILTER:
+        {
+            // 3 standard deviations wide, shifted down to reach 0 at the radius
+            float sigma = radius / 3;
+            return std::max(0.0f, expf(-x * x / (2 * sigma * sigma)) - expf(-radius * radius / (2 * sigma * sigma)));
+        }
+        case MITCHELL_FILTER:
+        {
+            // Mitchell-Netravali with B = C = 1/3, stretched from [-2, 2] to the radius. it's negative between 1 and 2
+            const float B = 1.0f / 3, C = 1.0f / 3;
+            float t = 2 * x / radius;
+            if (t < 1)
+            {
+                return ((12 - 9 * B - 6 * C) * t * t * t + (-18 + 12 * B + 6 * C) * t * t + (6 - 2 * B)) / 6;
+            }
+            return ((-B - 6 * C) * t * t * t + (6 * B + 30 * C) * t * t + (-12 * B - 48 * C) * t + (8 * B + 24 * C)) / 6;
+        }
+        case BLACKMAN_HARRIS_FILTER:
+        {
+            float t = 2 * M_PI * (x + radius) / (2 * radius);
+            return 0.35875f - 0.48829f * cosf(t) + 0.14128f * cosf(2 * t) - 0.01168f * cosf(3 * t);
+        }
+        default:
+            return 1;
+        }
+    }
+
+    // the normalized filter at x pixels from the center, from the table
+    float lookup(float x) const
+    {
+        int k = (int)floorf((x + radius) / (2 * radius) * FILTER_TABLE_SIZE);
+        return k >= 0 && k < FILTER_TABLE_SIZE ? table[k] : 0;
+    }
+
+    // a position for a sample of pixel (i, j) that's distributed like the absolute value of the filter around the pixel's center.
+    // the weight is the filter over that density, which is the same for every sample except for its sign
+    film_sample sample(int i, int j, float u, float v) const
+    {
+        film_sample position;
+        float dx = sample_offset(u, position.weight);
+        float sign_y;
+        float dy = sample_offset(v, sign_y);
+        position.x = i + 0.5f + dx;
+        position.y = j + 0.5f + dy;
+        position.weight *= sign_y * sample_weight * sample_weight;
+        return position;
+    }
+
+    FilterType type;
+    float radius;
+    int width, height;
+    // the normalized filter at the centers of FILTER_TABLE_SIZE buckets across [-radius, radius]
+    std::vector<float> table;
+    distribution_1d sampling;
+    // the integral of the filter's absolute value, over the integral of the filter
+    float sample_weight;
+    // the part of the filter around each column and row that's inside the image
+    std::vector<float> coverage_x, coverage_y;
+
+private:
+    float sample_offset(float u, float &sign) const
+    {
+        float pdf;
+        int bucket;
+        float x = sampling.sample_continuous(u, pdf, bucket);
+        sign = table[bucket] < 0 ? -1.0f : 1.0f;
+        return (2 * x - 1) * radius;
+    }
+
+    std::vector<float> coverage(int pixels) const
+    {
+        std::vector<float> result(pixels);
+        float bucket = 2 * radius / FILTER_TABLE_SIZE;
+        for (int p = 0; p < pixels; p++)
+        {
+            float inside = 0;
+            for (int k = 0; k < FILTER_TABLE_SIZE; k++)
+            {
+                float x = p + 0.5f - radius + (k + 0.5f) * bucket;
+                if (x >= 0 && x < pixels)
+                {
+                    inside += table[k] * bucket;
+                }
+            }
+            result[p] = inside;
+        }
+        return result;
+    }
+};
+
+// contributions splatted onto the film at any position, spread over the pixels around it with the filter.
+// each thread collects its splats in tiles of its own, which it adds to the framebuffer with flush between passes, tiles or rows,
+// so that splatting takes no lock. splats are added to the framebuffer's sums like samples, and so are divided by the pixel's
+// sample count in the end, which is what both camera samples and light paths that reach the camera need
+class splat_buffer
+{
+public:
+    splat_buffer(const pixel_filter *filter, int width, int height, int threads) : filter(filter), width(width), height(height)
+    {
+        tiles_x = (width + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+        int tile_count = tiles_x * ((height + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE);
+        per_thread.resize(threads);
+        for (auto &tiles : per_thread)
+        {
+            tiles.tiles.resize(tile_count);
+            tiles.is_dirty.resize(tile_count, false);
+        }
+    }
+
+    // from thread thread_id, with (x, y) in pixels like film_sample
+    void splat(int thread_id, float x, float y, const vec3 &contribution)
+    {
+        float weights_x[SPLAT_PIXELS], weights_y[SPLAT_PIXELS];
+        int first_x, first_y;
+        int count_x = pixel_weights(x, width, filter->coverage_x, first_x, weights_x);
+        int count_y = pixel_weights(y, height, filter->coverage_y, first_y, weights_y);
+        thread_tiles &tiles = per_thread[thread_id];
+        for (int b = 0; b < count_y; b++)
+        {
+            int py = first_y + b;
+            for (int a = 0; a < count_x; a++)
+            {
+                int px = first_x + a;
+                int t = (py / SPLAT_TILE_SIZE) * tiles_x + px / SPLAT_TILE_SIZE;
+                if (!tiles.is_dirty[t])
+                {
+                    if (tiles.tiles[t].empty())
+                    {
+                        tiles.tiles[t].resize(SPLAT_TILE_SIZE * SPLAT_TILE_SIZE, vec3(0, 0, 0));
+                    }
+                    tiles.is_dirty[t] = true;
+                    tiles.dirty.push_back(t);
+                }
+                tiles.tiles[t][(py % SPLAT_TILE_SIZE) * SPLAT_TILE_SIZE + px % SPLAT_TILE_SIZE] += weights_x[a] * weights_y[b] * contribution;
+            }
+        }
+    }
+
+    // adds what thread thread_id splatted since its last flush to framebuffer, holding lock while it does
+    void flush(int thread_id, vec3 **framebuffer, std::mutex &lock)
+    {
+        thread_tiles &tiles = per_thread[thread_id];
+        if (tiles.dirty.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        for (int t : tiles.dirty)
+        {
+            int x0 = (t % tiles_x) * SPLAT_TILE_SIZE, y0 = (t / tiles_x) * SPLAT_TILE_SIZE;
+            std::vector<vec3> &tile = tiles.tiles[t];
+            for (int y = y0; y < std::min(y0 + SPLAT_TILE_SIZE, height); y++)
+            {
+                for (int x = x0; x < std::min(x0 + SPLAT_TILE_SIZE, width); x++)
+                {
+                    vec3 &value = tile[(y - y0) * SPLAT_TILE_SIZE + x - x0];
+                    framebuffer[y][x] += value;
+                    value = vec3(0, 0, 0);
+                }
+            }
+            tiles.is_dirty[t] = false;
+        }
+        tiles.dirty.clear();
+    }
+
+private:
+    // enough for a radius of 4
+    static const int SPLAT_PIXELS = 10;
+
+    // the pixels along one axis whose centers are within the radius of position, and their filter weights
+    int pixel_weights(float position, int pixels, const std::vector<float> &coverage, int &first, float *weights) const
+    {
+        first = std::max(0, (int)ceilf(position - 0.5f - filter->radius));
+        int last = std::min(pixels - 1, (int)floorf(position - 0.5f + filter->radius));
+        int count = 0;
+        for (int p = first; p <= last && count < SPLAT_PIXELS; p++)
+        {
+            weights[count++] = filter->lookup(position - (p + 0.5f)) / coverage[p];
+        }
+        return count;
+    }
+
+    struct thread_tiles
+    {
+        // allocated when they're first splatted into, and kept for later
+        std::vector<std::vector<vec3>> tiles;
+        std::vector<bool> is_dirty;
+        std::vector<int> dirty;
+    };
+
+    const pixel_filter *filter;
+    int width, height;
+    int tiles_x;
+    std::vector<thread_tiles> per_thread;
+};
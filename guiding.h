@@ -0,0 +1,469 @@
+#pragma once
+#include "aabb.h"
+#include "helpers.h"
+#include "random.h"
+#include "sampler.h"
+#include "vec3.h"
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+// path guiding with an SD-tree, after Müller et al. 2017, "Practical Path Guiding for Efficient Light-Transport Simulation".
+// a binary tree over space, alternating x, y, z splits, holds a quadtree over directions in every leaf.
+// the quadtrees learn the incident radiance at that region of space from the paths of the previous training iteration,
+// and the integrator samples directions from them in a one-sample MIS mix with the bsdf.
+
+inline void atomic_add(std::atomic<float> &target, float value)
+{
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// cylindrical mapping between unit directions and [0, 1)^2. it preserves area, so a density over the square is 4pi times the density over the sphere.
+inline void direction_to_square(const vec3 &direction, float &x, float &y)
+{
+    float cos_theta = clamp(direction.z(), -1.0f, 1.0f);
+    float phi = atan2(direction.y(), direction.x());
+    x = clamp((cos_theta + 1) * 0.5f, 0.0f, ONE_MINUS_EPSILON);
+    y = clamp((float)((phi + M_PI) / TAU), 0.0f, ONE_MINUS_EPSILON);
+}
+
+inline vec3 square_to_direction(float x, float y)
+{
+    float cos_theta = 2 * x - 1;
+    float sin_theta = sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+    float phi = TAU * y - M_PI;
+    return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+// children are numbered x + 2 * y, with x and y being which half of the node the child covers
+struct quad_node
+{
+    quad_node()
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            sum[i].store(0, std::memory_order_relaxed);
+            children[i] = 0;
+        }
+    }
+    quad_node(const quad_node &other)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            sum[i].store(other.sum[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            children[i] = other.children[i];
+        }
+    }
+    quad_node &operator=(const quad_node &other)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            sum[i].store(other.sum[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            children[i] = other.children[i];
+        }
+        return *this;
+    }
+    float total() const
+    {
+        return sum[0].load(std::memory_order_relaxed) + sum[1].load(std::memory_order_relaxed) + sum[2].load(std::memory_order_relaxed) + sum[3].load(std::memory_order_relaxed);
+    }
+    bool is_leaf(int i) const { return children[i] == 0; }
+
+    std::atomic<float> sum[4];
+    // index into dtree::nodes, 0 for a leaf since the root can't be anyone's child
+    uint32_t children[4];
+};
+
+// directional quadtree. record() is safe to call from many threads at once, as long as nothing changes the structure meanwhile.
+class dtree
+{
+public:
+    dtree() : nodes(1), sample_count(0) {}
+    dtree(const dtree &other) : nodes(other.nodes), sample_count(other.sample_count.load()) {}
+    dtree &operator=(const dtree &other)
+    {
+        nodes = other.nodes;
+        sample_count.store(other.sample_count.load());
+        return *this;
+    }
+
+    float total() const { return nodes[0].total(); }
+
+    // adds `value` (incident radiance over the pdf it was sampled with) to every node containing direction
+    void record(const vec3 &direction, float value)
+    {
+        sample_count.fetch_add(1, std::memory_order_relaxed);
+        if (!(value > 0) || std::isinf(value))
+        {
+            return;
+        }
+        float x, y;
+        direction_to_square(direction, x, y);
+        uint32_t node = 0;
+        while (true)
+        {
+            int child = child_index(x, y);
+            atomic_add(nodes[node].sum[child], value);
+            if (nodes[node].is_leaf(child))
+            {
+                break;
+            }
+            node = nodes[node].children[child];
+        }
+    }
+
+    // solid angle pdf of sampling direction
+    float pdf(const vec3 &direction) const
+    {
+        float total = this->total();
+        if (total <= 0)
+        {
+            return 1 / (2 * TAU);
+        }
+        float x, y;
+        direction_to_square(direction, x, y);
+        float density = 1;
+        uint32_t node = 0;
+        while (true)
+        {
+            int child = child_index(x, y);
+            float node_total = nodes[node].total();
+            if (node_total <= 0)
+            {
+                break;
+            }
+            density *= 4 * nodes[node].sum[child].load(std::memory_order_relaxed) / node_total;
+            if (nodes[node].is_leaf(child))
+            {
+                break;
+            }
+            node = nodes[node].children[child];
+        }
+        return density / (2 * TAU);
+    }
+
+    // picks a child proportional to its energy by first choosing the left or right half with u, then the lower or upper half with v.
+    // both are rescaled after every choice so that they stay uniform for the next level.
+    vec3 sample(float u, float v) const
+    {
+        float x = 0, y = 0, size = 1;
+        uint32_t node = 0;
+        while (true)
+        {
+            const quad_node &n = nodes[node];
+            float s[4];
+            for (int i = 0; i < 4; i++)
+            {
+                s[i] = n.sum[i].load(std::memory_order_relaxed);
+            }
+            float total = s[0] + s[1] + s[2] + s[3];
+            int cx = 0, cy = 0;
+            if (total > 0)
+            {
+                float left = s[0] + s[2];
+                float fraction = left / total;
+                if (u < fraction)
+                {
+                    u /= fraction;
+                }
+                else
+                {
+                    cx = 1;
+                    u = (u - fraction) / (1 - fraction);
+                }
+                float lower = s[cx], upper = s[cx + 2];
+                fraction = lower / (lower + upper);
+                if (v < fraction)
+                {
+                    v /= fraction;
+                }
+                else
+                {
+                    cy = 1;
+                    v = (v - fraction) / (1 - fraction);
+                }
+            }
+            else
+            {
+                cx = u >= 0.5f;
+                cy = v >= 0.5f;
+                u = u * 2 - cx;
+                v = v * 2 - cy;
+            }
+            u = std::min(u, ONE_MINUS_EPSILON);
+            v = std::min(v, ONE_MINUS_EPSILON);
+            size *= 0.5f;
+            x += cx * size;
+            y += cy * size;
+            int child = cx + 2 * cy;
+            if (total <= 0 || n.is_leaf(child))
+            {
+                break;
+            }
+            node = n.children[child];
+        }
+        return square_to_direction(x + u * size, y + v * size);
+    }
+
+    // returns a tree with the structure for the next iteration and no energy.
+    // cells holding more than `threshold` of the total energy are subdivided, down to max_depth,
+    // and the rest are merged back into their parent.
+    dtree refined(float threshold, int max_depth) const
+    {
+        dtree result;
+        result.nodes.clear();
+        result.nodes.emplace_back();
+        float total = this->total();
+        if (total <= 0)
+        {
+            return result;
+        }
+        struct entry
+        {
+            // node in this tree that the new node mirrors, or -1 if it's past the leaves of this tree
+            int source;
+            uint32_t target;
+            int depth;
+            float energy[4];
+        };
+        std::vector<entry> stack;
+        entry root = {0, 0, 1, {}};
+        for (int i = 0; i < 4; i++)
+        {
+            root.energy[i] = nodes[0].sum[i].load(std::memory_order_relaxed);
+        }
+        stack.push_back(root);
+        while (!stack.empty())
+        {
+            entry e = stack.back();
+            stack.pop_back();
+            for (int i = 0; i < 4; i++)
+            {
+                if (e.depth >= max_depth || e.energy[i] <= total * threshold)
+                {
+                    continue;
+                }
+                entry child;
+                child.depth = e.depth + 1;
+                if (e.source >= 0 && !nodes[e.source].is_leaf(i))
+                {
+                    child.source = nodes[e.source].children[i];
+                    for (int j = 0; j < 4; j++)
+                    {
+                        child.energy[j] = nodes[child.source].sum[j].load(std::memory_order_relaxed);
+                    }
+                }
+                else
+                {
+                    // new cell, assume the energy is spread evenly until the next iteration says otherwise
+                    child.source = -1;
+                    for (int j = 0; j < 4; j++)
+                    {
+                        child.energy[j] = e.energy[i] / 4;
+                    }
+                }
+                child.target = result.nodes.size();
+                result.nodes[e.target].children[i] = child.target;
+                result.nodes.emplace_back();
+                stack.push_back(child);
+            }
+        }
+        return result;
+    }
+
+    static int child_index(float &x, float &y)
+    {
+        int cx = x >= 0.5f, cy = y >= 0.5f;
+        x = x * 2 - cx;
+        y = y * 2 - cy;
+        return cx + 2 * cy;
+    }
+
+    std::vector<quad_node> nodes;
+    // number of path vertices recorded, whether or not they carried any radiance
+    std::atomic<uint32_t> sample_count;
+};
+
+// the sampling tree is read only during an iteration, while the building tree collects radiance for the next one
+struct dtree_pair
+{
+    dtree sampling;
+    dtree building;
+};
+
+struct spatial_node
+{
+    int axis;
+    // index into stree::nodes, both 0 for a leaf
+    uint32_t children[2];
+    // index into stree::leaves, for leaves
+    uint32_t leaf;
+    bool is_leaf() const { return children[0] == 0; }
+};
+
+// spatial binary tree over the (cubified) scene bounds.
+class stree
+{
+public:
+    stree() {}
+    stree(aabb bounds)
+    {
+        // cube shaped, so that the cells stay close to cubes as they split along x, y and z in turn
+        vec3 size = bounds.max() - bounds.min();
+        float extent = std::max(size.x(), std::max(size.y(), size.z())) * 1.001f;
+        origin = bounds.min() - vec3(extent, extent, extent) * 0.0005f;
+        inverse_extent = 1 / extent;
+        spatial_node root = {0, {0, 0}, 0};
+        nodes.push_back(root);
+        leaves.emplace_back();
+    }
+
+    dtree_pair *lookup(const vec3 &p)
+    {
+        vec3 x = (p - origin) * inverse_extent;
+        float c[3] = {clamp(x.x(), 0.0f, ONE_MINUS_EPSILON), clamp(x.y(), 0.0f, ONE_MINUS_EPSILON), clamp(x.z(), 0.0f, ONE_MINUS_EPSILON)};
+        uint32_t node = 0;
+        while (!nodes[node].is_leaf())
+        {
+            int axis = nodes[node].axis;
+            int child = c[axis] >= 0.5f;
+            c[axis] = c[axis] * 2 - child;
+            node = nodes[node].children[child];
+        }
+        return &leaves[nodes[node].leaf];
+    }
+
+    // splits every leaf that saw more than `threshold` path vertices, recursively, halving the sample count each time.
+    // both halves start out with a copy of the parent's directional trees.
+    void refine(uint32_t threshold)
+    {
+        std::vector<uint32_t> stack;
+        stack.push_back(0);
+        while (!stack.empty())
+        {
+            uint32_t node = stack.back();
+            stack.pop_back();
+            if (!nodes[node].is_leaf())
+            {
+                stack.push_back(nodes[node].children[0]);
+                stack.push_back(nodes[node].children[1]);
+                continue;
+            }
+            uint32_t leaf = nodes[node].leaf;
+            uint32_t count = leaves[leaf].building.sample_count.load();
+            if (count <= threshold)
+            {
+                continue;
+            }
+            leaves[leaf].building.sample_count.store(count / 2);
+            leaves.push_back(leaves[leaf]);
+            uint32_t child_axis = (nodes[node].axis + 1) % 3;
+            spatial_node left = {(int)child_axis, {0, 0}, leaf};
+            spatial_node right = {(int)child_axis, {0, 0}, (uint32_t)leaves.size() - 1};
+            nodes[node].children[0] = nodes.size();
+            nodes.push_back(left);
+            nodes[node].children[1] = nodes.size();
+            nodes.push_back(right);
+            stack.push_back(nodes[node].children[0]);
+            stack.push_back(nodes[node].children[1]);
+        }
+    }
+
+    std::vector<spatial_node> nodes;
+    std::vector<dtree_pair> leaves;
+    vec3 origin;
+    float inverse_extent;
+};
+
+// a vertex of the current path, collecting the radiance that arrives along the direction it scattered in.
+// once the path is done, that radiance is recorded into the building tree of the vertex's spatial leaf.
+struct guide_vertex
+{
+    dtree_pair *tree;
+    vec3 direction;
+    // beta of the path after scattering at this vertex
+    vec3 throughput;
+    vec3 radiance;
+    // pdf the direction was sampled with
+    float pdf;
+
+    // contribution is in the units of the path's sum, which includes the throughput up to and including this vertex
+    void add(const vec3 &contribution)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            if (throughput[c] > 0)
+            {
+                radiance[c] += contribution[c] / throughput[c];
+            }
+        }
+    }
+    void record() const
+    {
+        float value = (radiance.x() + radiance.y() + radiance.z()) / (3 * pdf);
+        tree->building.record(direction, std::isfinite(value) ? value : 0);
+    }
+};
+
+// owns the SD-tree and the training schedule. iteration k is rendered with 2^k samples per pixel.
+class path_guide
+{
+public:
+    path_guide(aabb bounds, float bsdf_fraction, float spatial_threshold) : tree(bounds), bsdf_fraction(bsdf_fraction), spatial_threshold(spatial_threshold), iteration(0), training(true) {}
+
+    // called between iterations, while no thread is rendering.
+    // the radiance collected this iteration becomes the sampling distribution for the next one.
+    void end_iteration(int samples_per_pixel)
+    {
+        // Müller et al. split when a leaf saw more than c * sqrt(2^k) vertices, and use c = 12000
+        tree.refine((uint32_t)(spatial_threshold * sqrt((float)samples_per_pixel)));
+        for (auto &leaf : tree.leaves)
+        {
+            leaf.sampling = leaf.building;
+            leaf.building = leaf.building.refined(0.01f, 20);
+        }
+        iteration++;
+    }
+
+    // the building trees aren't needed once training is over
+    void finish_training()
+    {
+        for (auto &leaf : tree.leaves)
+        {
+            leaf.building = dtree();
+        }
+        training = false;
+    }
+
+    size_t memory_footprint() const
+    {
+        size_t bytes = tree.nodes.size() * sizeof(spatial_node) + tree.leaves.size() * sizeof(dtree_pair);
+        for (auto &leaf : tree.leaves)
+        {
+            bytes += (leaf.sampling.nodes.size() + leaf.building.nodes.size()) * sizeof(quad_node);
+        }
+        return bytes;
+    }
+
+    void print_stats() const
+    {
+        size_t directional_nodes = 0;
+        for (auto &leaf : tree.leaves)
+        {
+            directional_nodes += leaf.sampling.nodes.size();
+        }
+        std::cout << "path guiding iteration " << iteration << ": " << tree.leaves.size() << " spatial leaves, "
+                  << directional_nodes << " directional nodes, "
+                  << memory_footprint() / 1024.0f << " KiB" << std::endl;
+    }
+
+    stree tree;
+    float bsdf_fraction;
+    float spatial_threshold;
+    int iteration;
+    // paths only record radiance into the tree while training
+    bool training;
+};
@@ -0,0 +1,158 @@
+#pragma once
+#include "image.h"
+#include "types.h"
+#include "vec3.h"
+#include <cstdio>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// linear float copies of the framebuffer, before exposure and tonemapping, so those can be changed afterwards (main.exe --tonemap)
+// and so that compositing gets the real radiance. every pixel is the mean of its samples.
+//   pfm: 32 bit float rgb, the portable float map that most image tools read
+//   exr: uncompressed scanline OpenEXR with half float B, G and R channels, half the size of the pfm
+// both are written a row at a time, and like the checkpoints assume a little endian machine
+
+// the mean of pixel (i, j). counts can be null when every pixel has the same number of samples
+inline vec3 pixel_mean(vec3 **buffer, int **counts, int samples, int i, int j)
+{
+    int n = counts != nullptr && counts[j][i] > 0 ? counts[j][i] : samples;
+    return buffer[j][i] / float(n);
+}
+
+// rows bottom to top, which is the framebuffer's order
+bool write_pfm(std::string path, vec3 **buffer, int **counts, int samples, int width, int height)
+{
+    std::ofstream file(path, std::ios::binary);
+    // a negative scale means little endian
+    file << "PF\n"
+         << width << " " << height << "\n-1.0\n";
+    std::vector<float> row(3 * width);
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            vec3 c = pixel_mean(buffer, counts, samples, i, j);
+            row[3 * i + 0] = c.x();
+            row[3 * i + 1] = c.y();
+            row[3 * i + 2] = c.z();
+        }
+        file.write((const char *)row.data(), row.size() * sizeof(float));
+    }
+    return (bool)file;
+}
+
+// fills buffer with a new width * height framebuffer
+bool read_pfm(std::string path, vec3 **&buffer, int &width, int &height)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string magic;
+    float scale;
+    if (!(file >> magic >> width >> height >> scale) || magic != "PF" || scale >= 0 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    // exactly one whitespace character after the scale
+    file.get();
+    buffer = array_2d<vec3>(width, height);
+    std::vector<float> row(3 * width);
+    for (int j = 0; j < height; j++)
+    {
+        if (!file.read((char *)row.data(), row.size() * sizeof(float)))
+        {
+            return false;
+        }
+        for (int i = 0; i < width; i++)
+        {
+            buffer[j][i] = vec3(row[3 * i + 0], row[3 * i + 1], row[3 * i + 2]);
+        }
+    }
+    return true;
+}
+
+// appends the bytes of value to out
+template <typename T>
+void append_bytes(std::vector<char> &out, const T &value)
+{
+    out.insert(out.end(), (const char *)&value, (const char *)&value + sizeof(T));
+}
+
+void append_exr_attribute(std::vector<char> &header, std::string name, std::string type, const std::vector<char> &value)
+{
+    header.insert(header.end(), name.begin(), name.end());
+    header.push_back(0);
+    header.insert(header.end(), type.begin(), type.end());
+    header.push_back(0);
+    append_bytes(header, (int32_t)value.size());
+    header.insert(header.end(), value.begin(), value.end());
+}
+
+// scanlines top to bottom, one per chunk, channels in alphabetical order as the format requires
+bool write_exr(std::string path, vec3 **buffer, int **counts, int samples, int width, int height)
+{
+    std::vector<char> header;
+    append_bytes(header, (uint32_t)20000630);
+    // version 2, single part scanline
+    append_bytes(header, (uint32_t)2);
+
+    std::vector<char> value;
+    for (const char *channel : {"B", "G", "R"})
+    {
+        value.push_back(channel[0]);
+        value.push_back(0);
+        // half, not linear perceptually, 3 reserved bytes, x and y sampling
+        append_bytes(value, (int32_t)1);
+        append_bytes(value, (uint32_t)0);
+        append_bytes(value, (int32_t)1);
+        append_bytes(value, (int32_t)1);
+    }
+    value.push_back(0);
+    append_exr_attribute(header, "channels", "chlist", value);
+    append_exr_attribute(header, "compression", "compression", {0});
+    value.clear();
+    for (int32_t v : {0, 0, width - 1, height - 1})
+    {
+        append_bytes(value, v);
+    }
+    append_exr_attribute(header, "dataWindow", "box2i", value);
+    append_exr_attribute(header, "displayWindow", "box2i", value);
+    append_exr_attribute(header, "lineOrder", "lineOrder", {0});
+    value.clear();
+    append_bytes(value, 1.0f);
+    append_exr_attribute(header, "pixelAspectRatio", "float", value);
+    append_exr_attribute(header, "screenWindowWidth", "float", value);
+    value.clear();
+    append_bytes(value, 0.0f);
+    append_bytes(value, 0.0f);
+    append_exr_attribute(header, "screenWindowCenter", "v2f", value);
+    header.push_back(0);
+
+    // every scanline chunk is its y, its size and then the row of each channel
+    int32_t row_bytes = 3 * width * sizeof(uint16_t);
+    uint64_t offset = header.size() + height * sizeof(uint64_t);
+    for (int y = 0; y < height; y++)
+    {
+        append_bytes(header, offset + (uint64_t)y * (8 + row_bytes));
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(header.data(), header.size());
+    std::vector<char> chunk(8 + row_bytes);
+    uint16_t *halfs = (uint16_t *)(chunk.data() + 8);
+    for (int32_t y = 0; y < height; y++)
+    {
+        memcpy(chunk.data(), &y, 4);
+        memcpy(chunk.data() + 4, &row_bytes, 4);
+        int j = height - 1 - y;
+        for (int i = 0; i < width; i++)
+        {
+            vec3 c = pixel_mean(buffer, counts, samples, i, j);
+            halfs[i] = float_to_half(c.z());
+            halfs[width + i] = float_to_half(c.y());
+            halfs[2 * width + i] = float_to_half(c.x());
+        }
+        file.write(chunk.data(), chunk.size());
+    }
+    return (bool)file;
+}
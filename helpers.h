@@ -16,6 +16,11 @@ inline int min(int a, int b)
     return a < b ? a : b;
 }
 
+inline float luminance(const vec3 &c)
+{
+    return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
 vec3 reflect(const vec3 &v, const vec3 &n)
 {
     return v - 2 * dot(v, n) * n;
@@ -119,6 +124,8 @@ public:
     vec3 w() const { return axis[2]; }
     vec3 local(float a, float b, float c) const { return a * u() + b * v() + c * w(); }
     vec3 local(const vec3 &a) const { return a.x() * u() + a.y() * v() + a.z() * w(); }
+    // the inverse of local
+    vec3 to_local(const vec3 &a) const { return vec3(dot(a, u()), dot(a, v()), dot(a, w())); }
     void build_from_w(const vec3 &);
     vec3 axis[3];
 };
@@ -15,15 +15,109 @@ struct hit_record
     hittable *primitive;
     float u;
     float v;
-    material *mat_ptr;
+    // how p moves with u and v. zero for primitives without a uv parametrization
+    vec3 dpdu;
+    vec3 dpdv;
+    // width of the pixel footprint in uv space, which picks the mip level of image textures. 0 for a point lookup
+    float uv_width = 0;
+    // index in scene_materials()
+    int material_id;
+    // of the ray that hit, which moving instances need to find where they were
+    float time = 0;
+};
+
+// intersects the differential rays of r with the tangent plane at rec to find how p moves across the pixel (dpdx, dpdy),
+// and solves for the matching change in uv, which sets rec.uv_width. false if r has no differentials or they miss the plane
+inline bool compute_differentials(const ray &r, hit_record &rec, vec3 &dpdx, vec3 &dpdy)
+{
+    rec.uv_width = 0;
+    if (!r.has_differentials)
+    {
+        return false;
+    }
+    vec3 n = rec.normal;
+    float d = dot(n, rec.p);
+    float denom_x = dot(n, r.rx_direction);
+    float denom_y = dot(n, r.ry_direction);
+    if (denom_x == 0 || denom_y == 0)
+    {
+        return false;
+    }
+    float tx = (d - dot(n, r.rx_origin)) / denom_x;
+    float ty = (d - dot(n, r.ry_origin)) / denom_y;
+    if (!std::isfinite(tx) || !std::isfinite(ty))
+    {
+        return false;
+    }
+    dpdx = r.rx_origin + tx * r.rx_direction - rec.p;
+    dpdy = r.ry_origin + ty * r.ry_direction - rec.p;
+    // least squares fit of dpdx = dpdu * dudx + dpdv * dvdx, and the same for y
+    float a00 = dot(rec.dpdu, rec.dpdu), a01 = dot(rec.dpdu, rec.dpdv), a11 = dot(rec.dpdv, rec.dpdv);
+    float det = a00 * a11 - a01 * a01;
+    if (det > 0)
+    {
+        float inv_det = 1 / det;
+        float bx0 = dot(rec.dpdu, dpdx), bx1 = dot(rec.dpdv, dpdx);
+        float by0 = dot(rec.dpdu, dpdy), by1 = dot(rec.dpdv, dpdy);
+        float dudx = (a11 * bx0 - a01 * bx1) * inv_det, dvdx = (a00 * bx1 - a01 * bx0) * inv_det;
+        float dudy = (a11 * by0 - a01 * by1) * inv_det, dvdy = (a00 * by1 - a01 * by0) * inv_det;
+        float width = 2 * ffmax(ffmax(fabs(dudx), fabs(dudy)), ffmax(fabs(dvdx), fabs(dvdy)));
+        rec.uv_width = std::isfinite(width) ? width : 0;
+    }
+    return true;
+}
+
+// a point sampled on the surface of a light, as seen from the origin it was sampled from
+struct light_sample
+{
+    vec3 p;
+    vec3 normal;
+    float distance;
+    // solid angle pdf with respect to the origin
+    float pdf;
+    float u;
+    float v;
+    int material_id;
 };
 
 class hittable
 {
 public:
+    virtual ~hittable() {}
     virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const = 0;
     virtual bool bounding_box(float t0, float t1, aabb &box) const = 0;
     // virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
     virtual float pdf_value(const vec3 &o, const vec3 &v) const { return 0.0; }
     virtual vec3 random(const vec3 &o) const { return vec3(1, 0, 0); }
+    // samples a point on this primitive as seen from o at time using the 2d sample (u, v), returning everything NEE needs in one go.
+    virtual bool sample(const vec3 &o, float time, float u, float v, light_sample &sample) const { return false; }
+    // same density as pdf_value, but for a ray from o that already produced rec, so no intersection needs to be recomputed.
+    virtual float pdf_from_hit(const vec3 &o, const hit_record &rec) const { return 0.0; }
+    // the parametric range [t0, t1] of r that lies inside this shape, clipped to [t_min, t_max]. only meaningful for closed shapes.
+    // the default finds both crossings with two hit queries, shapes that can find them in one go override it
+    virtual bool hit_interval(const ray &r, float t_min, float t_max, float &t0, float &t1) const
+    {
+        hit_record rec1, rec2;
+        if (!hit(r, -FLT_MAX, FLT_MAX, rec1) || !hit(r, rec1.t + 0.0001f, FLT_MAX, rec2))
+        {
+            return false;
+        }
+        t0 = ffmax(rec1.t, t_min);
+        t1 = ffmin(rec2.t, t_max);
+        return t0 < t1;
+    }
+    // fraction of light that makes it along r between t_min and t_max. surfaces block it entirely, participating media let some through
+    virtual float transmittance(const ray &r, float t_min, float t_max) const
+    {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec) ? 0.0f : 1.0f;
+    }
+    // the bounds at shutter open and close, which bounds at the times in between are interpolated from. false when they're the same,
+    // which they are for anything that doesn't move
+    virtual bool motion_bounds(aabb &start, aabb &end) const
+    {
+        bounding_box(0, 1, start);
+        end = start;
+        return false;
+    }
 };
@@ -13,6 +13,15 @@ public:
     }
     virtual bool hit(
         const ray &r, float tmin, float tmax, hit_record &rec) const;
+    virtual float transmittance(const ray &r, float t_min, float t_max) const
+    {
+        float result = 1.0f;
+        for (int i = 0; i < list_size && result > 0; i++)
+        {
+            result *= list[i]->transmittance(r, t_min, t_max);
+        }
+        return result;
+    }
     virtual bool bounding_box(float t0, float t1, aabb &box) const;
     hittable **list;
     int list_size;
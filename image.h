@@ -1,36 +1,363 @@
 #pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-#include "types.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "helpers.h"
 #include "vec3.h"
 #include "texture.h"
 
+// how image textures on surfaces are looked up. the background is always nearest, to match the piecewise constant pdf it's importance sampled with
+enum texture_filter
+{
+    FILTER_NEAREST,
+    FILTER_BILINEAR,
+    // bilinear in the two mip levels closest to the pixel footprint, blended
+    FILTER_TRILINEAR
+};
+
+texture_filter get_texture_filter_for(std::string type)
+{
+    static std::map<std::string, texture_filter> mapping = {
+        {"nearest", FILTER_NEAREST},
+        {"bilinear", FILTER_BILINEAR},
+        {"trilinear", FILTER_TRILINEAR}};
+    return mapping.count(type) > 0 ? mapping[type] : FILTER_TRILINEAR;
+}
+
+// how texels are stored. both keep rgba interleaved in one buffer, so a lookup touches one cache line instead of a vec3 and a separate alpha.
+// 8 bit texels are 4 bytes instead of 16, and decode through a lookup table. half floats are 8 bytes and keep the range of hdr images
+enum texel_format
+{
+    TEXEL_RGBA8,
+    TEXEL_RGBA16F
+};
+
+inline size_t texel_bytes(texel_format format)
+{
+    return format == TEXEL_RGBA8 ? 4 : 8;
+}
+
+inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0)
+    {
+        // zero or subnormal, mantissa * 2^-24
+        float f = mantissa / 16777216.0f;
+        return sign ? -f : f;
+    }
+    uint32_t bits;
+    if (exponent == 31)
+    {
+        // inf or nan
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// rounds to nearest, overflowing to inf
+inline uint16_t float_to_half(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(f));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff);
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent == 0xff)
+    {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    exponent = exponent - 127 + 15;
+    if (exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return sign;
+        }
+        // subnormal, with the implicit leading bit shifted in
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t h = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)
+        {
+            h++;
+        }
+        return sign | h;
+    }
+    uint32_t h = sign | (exponent << 10) | (mantissa >> 13);
+    // a carry out of the mantissa correctly bumps the exponent
+    if (mantissa & 0x1000)
+    {
+        h++;
+    }
+    return h;
+}
+
+inline float srgb_to_linear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float linear_to_srgb(float c)
+{
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * pow(c, 1 / 2.4f) - 0.055f;
+}
+
+// decode tables for 8 bit channels. alpha always decodes linearly.
+// function local statics are initialized once even when textures are loaded on several threads
+inline const float *linear_decode_table()
+{
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; i++)
+        {
+            t[i] = i / 255.0;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+inline const float *srgb_decode_table()
+{
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; i++)
+        {
+            t[i] = srgb_to_linear(i / 255.0f);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+// one level of the mip pyramid, in one contiguous block so that neighbouring texels share cache lines
+struct mip_level
+{
+    int width, height;
+    texel_format format;
+    // only the pointer for the format is set. the texels are in storage, unless something else owns them, like a mapped scene cache
+    const uint8_t *rgba8 = nullptr;
+    const uint16_t *rgba16f = nullptr;
+    std::shared_ptr<std::vector<uint8_t>> storage;
+    // the table rgba8 color channels decode through
+    const float *decode;
+
+    inline int index(int x, int y) const
+    {
+        // wrap around, like the uv coordinates
+        x %= width;
+        y %= height;
+        x += x < 0 ? width : 0;
+        y += y < 0 ? height : 0;
+        return y * width + x;
+    }
+    // texel i in row major order, without wrapping
+    inline vec3 fetch(int i) const
+    {
+        if (format == TEXEL_RGBA8)
+        {
+            const uint8_t *t = &rgba8[4 * i];
+            return vec3(decode[t[0]], decode[t[1]], decode[t[2]]);
+        }
+        const uint16_t *t = &rgba16f[4 * i];
+        return vec3(half_to_float(t[0]), half_to_float(t[1]), half_to_float(t[2]));
+    }
+    inline float fetch_alpha(int i) const
+    {
+        return format == TEXEL_RGBA8 ? rgba8[4 * i + 3] / 255.0f : half_to_float(rgba16f[4 * i + 3]);
+    }
+    inline vec3 texel(int x, int y) const
+    {
+        return fetch(index(x, y));
+    }
+    inline float alpha(int x, int y) const
+    {
+        return fetch_alpha(index(x, y));
+    }
+    // stores a linear color, encoding it the way texel decodes it
+    // only for levels that were allocated
+    void set(int x, int y, const vec3 &c, float a)
+    {
+        int i = 4 * (y * width + x);
+        if (format == TEXEL_RGBA16F)
+        {
+            uint16_t *texels = (uint16_t *)storage->data();
+            for (int k = 0; k < 3; k++)
+            {
+                texels[i + k] = float_to_half(c[k]);
+            }
+            texels[i + 3] = float_to_half(a);
+            return;
+        }
+        uint8_t *texels = storage->data();
+        bool srgb = decode == srgb_decode_table();
+        for (int k = 0; k < 3; k++)
+        {
+            float v = clamp(srgb ? linear_to_srgb(c[k]) : c[k], 0.0f, 1.0f);
+            texels[i + k] = (uint8_t)(v * 255 + 0.5f);
+        }
+        texels[i + 3] = (uint8_t)(clamp(a, 0.0f, 1.0f) * 255 + 0.5f);
+    }
+    void allocate()
+    {
+        storage = std::make_shared<std::vector<uint8_t>>(memory_bytes());
+        point_at(storage->data());
+    }
+    // uses texels owned by someone else, who has to keep them alive as long as this level
+    void point_at(const uint8_t *texels)
+    {
+        rgba8 = format == TEXEL_RGBA8 ? texels : nullptr;
+        rgba16f = format == TEXEL_RGBA16F ? (const uint16_t *)texels : nullptr;
+    }
+    const uint8_t *bytes() const
+    {
+        return format == TEXEL_RGBA8 ? rgba8 : (const uint8_t *)rgba16f;
+    }
+    uint8_t *writable_bytes()
+    {
+        return storage->data();
+    }
+    size_t memory_bytes() const
+    {
+        return (size_t)width * height * texel_bytes(format);
+    }
+};
+
 class image_texture : public texture
 {
 public:
-    image_texture(int width, int height) : width(width), height(height)
+    // the base level has to be filled in before build_mip_maps
+    image_texture(int width, int height, texel_format format = TEXEL_RGBA8, bool srgb = false) : width(width), height(height), filter(FILTER_TRILINEAR)
     {
-        data = array_2d<vec3>(width, height);
-        alpha_mask = array_2d<float>(width, height);
+        mip_level base;
+        base.width = width;
+        base.height = height;
+        base.format = format;
+        base.decode = srgb ? srgb_decode_table() : linear_decode_table();
+        base.allocate();
+        levels.push_back(base);
     }
-    vec3 value(float u, float v, const vec3 &p) const
+    // builds the pyramid from the base level, halving each level with a 2x2 box filter down to a single texel.
+    // odd sizes round up and repeat their last row or column. texels are averaged in linear space and encoded again in the same format
+    void build_mip_maps()
     {
-        // assert(0 <= u && u <= 1 && 0 <= v && v <= 1);
-        v -= int(v);
-        if (v < 0)
+        levels.resize(1);
+        while (levels.back().width > 1 || levels.back().height > 1)
         {
-            v += 1;
+            const mip_level &fine = levels.back();
+            mip_level coarse;
+            coarse.width = (fine.width + 1) / 2;
+            coarse.height = (fine.height + 1) / 2;
+            coarse.format = fine.format;
+            coarse.decode = fine.decode;
+            coarse.allocate();
+            for (int y = 0; y < coarse.height; y++)
+            {
+                int y0 = 2 * y, y1 = std::min(2 * y + 1, fine.height - 1);
+                for (int x = 0; x < coarse.width; x++)
+                {
+                    int x0 = 2 * x, x1 = std::min(2 * x + 1, fine.width - 1);
+                    vec3 c = 0.25f * (fine.texel(x0, y0) + fine.texel(x1, y0) + fine.texel(x0, y1) + fine.texel(x1, y1));
+                    float a = 0.25f * (fine.alpha(x0, y0) + fine.alpha(x1, y0) + fine.alpha(x0, y1) + fine.alpha(x1, y1));
+                    coarse.set(x, y, c, a);
+                }
+            }
+            levels.push_back(coarse);
         }
-        u -= int(u);
-        if (u < 0)
+    }
+    // u and v have to be in [0, 1)
+    vec3 bilinear(int level, float u, float v) const
+    {
+        const mip_level &mip = levels[level];
+        // texel centers are at half integers
+        float x = u * mip.width - 0.5f;
+        float y = v * mip.height - 0.5f;
+        int x0 = (int)floor(x);
+        int y0 = (int)floor(y);
+        float fx = x - x0;
+        float fy = y - y0;
+        // the footprint can only stick out by one texel, so it wraps without a division
+        int x1 = x0 + 1 == mip.width ? 0 : x0 + 1;
+        int y1 = y0 + 1 == mip.height ? 0 : y0 + 1;
+        x0 = x0 < 0 ? mip.width - 1 : x0;
+        y0 = y0 < 0 ? mip.height - 1 : y0;
+        int row0 = y0 * mip.width, row1 = y1 * mip.width;
+        return (1 - fx) * (1 - fy) * mip.fetch(row0 + x0) + fx * (1 - fy) * mip.fetch(row0 + x1) +
+               (1 - fx) * fy * mip.fetch(row1 + x0) + fx * fy * mip.fetch(row1 + x1);
+    }
+    // the level where a texel is about as wide as the footprint, with width in uv units, is levels - 1 + log2(width)
+    virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+    {
+        if (filter == FILTER_NEAREST || levels.size() == 1)
         {
-            u += 1;
+            return value(u, v, p);
+        }
+        u -= floor(u);
+        v -= floor(v);
+        int count = levels.size();
+        float level = count - 1 + log2(std::max(width, 1e-8f));
+        if (filter == FILTER_BILINEAR || level <= 0)
+        {
+            return bilinear(0, u, v);
+        }
+        if (level >= count - 1)
+        {
+            return levels[count - 1].texel(0, 0);
         }
-        int y = int(v * height);
-        int x = int(u * width);
-        return data[y][x];
+        int fine = (int)level;
+        float t = level - fine;
+        return (1 - t) * bilinear(fine, u, v) + t * bilinear(fine + 1, u, v);
+    }
+    vec3 value(float u, float v, const vec3 &p) const
+    {
+        return levels[0].fetch(nearest(u, v));
     }
     float alpha(float u, float v, const vec3 &p) const
     {
+        return levels[0].fetch_alpha(nearest(u, v));
+    }
+    // texel of the full resolution image
+    vec3 texel(int x, int y) const
+    {
+        return levels[0].texel(x, y);
+    }
+    size_t memory_bytes() const
+    {
+        size_t total = 0;
+        for (const mip_level &level : levels)
+        {
+            total += level.memory_bytes();
+        }
+        return total;
+    }
+    int width, height;
+    texture_filter filter;
+    std::vector<mip_level> levels;
+
+private:
+    // index of the texel under (u, v) in the full resolution image
+    int nearest(float u, float v) const
+    {
+        // assert(0 <= u && u <= 1 && 0 <= v && v <= 1);
         v -= int(v);
         if (v < 0)
         {
@@ -41,30 +368,32 @@ public:
         {
             u += 1;
         }
-        int y = int(v * height);
-        int x = int(u * width);
-        return alpha_mask[y][x];
+        int y = std::min(int(v * height), height - 1);
+        int x = std::min(int(u * width), width - 1);
+        return y * width + x;
     }
-    int width, height;
-    vec3 **data;
-    float **alpha_mask;
 };
 
-image_texture *from_4byte_vector(std::vector<unsigned char> image, int width, int height)
+// 8 bits per channel, rgba interleaved as lodepng decodes it. the bytes are kept as they are, and only decoded on lookup
+image_texture *from_4byte_vector(const std::vector<unsigned char> &image, int width, int height, bool srgb = false)
 {
-    image_texture *it = new image_texture(width, height);
-    for (int y = height - 1; y >= 0; y--)
+    image_texture *it = new image_texture(width, height, TEXEL_RGBA8, srgb);
+    memcpy(it->levels[0].writable_bytes(), image.data(), 4 * (size_t)width * height);
+    it->build_mip_maps();
+    return it;
+}
+
+// 16 bits per channel, big endian, as lodepng decodes 16 bit pngs. stored as half floats, which keep more than the 11 bits of precision
+// a linear 16 bit channel has near black. srgb is applied before converting, since half floats are always linear
+image_texture *from_8byte_vector(const std::vector<unsigned char> &image, int width, int height, bool srgb = false)
+{
+    image_texture *it = new image_texture(width, height, TEXEL_RGBA16F);
+    uint16_t *texels = (uint16_t *)it->levels[0].writable_bytes();
+    for (size_t i = 0; i < 4 * (size_t)width * height; i++)
     {
-        for (int x = 0; x < width; x++)
-        {
-            float r = image[4 * (y * width + x) + 0] / 255.0;
-            float g = image[4 * (y * width + x) + 1] / 255.0;
-            float b = image[4 * (y * width + x) + 2] / 255.0;
-            it->alpha_mask[y][x] = image[4 * (y * width + x) + 3] / 255.0;
-            it->data[y][x] = vec3(r, g, b);
-            // std::cout << it->alpha_mask[y][x];
-        }
-        // std::cout << '\n';
+        float c = ((image[2 * i] << 8) | image[2 * i + 1]) / 65535.0f;
+        texels[i] = float_to_half(srgb && i % 4 != 3 ? srgb_to_linear(c) : c);
     }
+    it->build_mip_maps();
     return it;
-}
\ No newline at end of file
+}
@@ -7,14 +7,27 @@
 #include "material.h"
 #include "helpers.h"
 #include "pdf.h"
+#include "sampler.h"
+#include "guiding.h"
+#include "reservoir.h"
+#include "aov.h"
+
+// longest path that path guiding learns from. vertices past this still render, they just aren't recorded
+#define MAX_GUIDE_VERTICES 64
 
 class Integrator
 {
 public:
-    virtual vec3 color(ray &r, int depth, long *bounce_count, path *_path, bool skip_light_hit = false) = 0;
+    // sampler supplies every random decision made along the path, in a fixed order of dimensions.
+    // aov is null unless aovs are on. the recursive integrators only record albedo, normal and depth into it
+    virtual vec3 color(ray &r, int depth, long *bounce_count, path *_path, Sampler *sampler, bool skip_light_hit = false, aov_sample *aov = nullptr) = 0;
     int max_bounces;
     World *world;
     Config config;
+    // set when the integrator supports path guiding and it's enabled. the renderer trains it before rendering
+    path_guide *guide = nullptr;
+    // drops anything kept from earlier paths that's only valid for one view. called when an interactive render moves the camera
+    virtual void reset_view() {}
 };
 
 class RecursivePT : public Integrator
@@ -26,24 +39,32 @@ public:
         std::cout << "complex constructor called for recursivePT" << std::endl;
     };
     // reuse this for branched path tracing
-    vec3 color(ray &r, int depth, long *bounce_count, path *_path, bool skip_light_hit)
+    vec3 color(ray &r, int depth, long *bounce_count, path *_path, Sampler *sampler, bool skip_light_hit, aov_sample *aov = nullptr)
     {
         hit_record rec;
         if (world->hit(r, 0.001, MAXFLOAT, rec))
         {
+            const material &mat = scene_materials()[rec.material_id];
             if (_path != nullptr)
             {
                 _path->push_back(rec.p);
             }
+            if (aov != nullptr)
+            {
+                aov->record_surface(r, rec, mat, depth);
+            }
             ray scattered;
             vec3 attenuation;
-            vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-            // if (depth < max_bounces && rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            if (depth < max_bounces && rec.mat_ptr->scatter(r, rec, attenuation))
+            vec3 emitted = mat.emitted(r, rec, rec.u, rec.v, rec.p);
+            // if (depth < max_bounces && mat.scatter(r, rec, attenuation, scattered))
+            float u, v;
+            sampler->get_2d(u, v);
+            if (depth < max_bounces && mat.scatter(r, rec, attenuation))
             {
-                scattered = ray(rec.p, rec.mat_ptr->generate(r, rec));
+                scattered = ray(rec.p, mat.generate(r, rec, u, v));
+                attenuation = mat.sample_weight(r, rec, scattered.direction());
                 (*bounce_count)++;
-                vec3 subcall = this->color(scattered, depth + 1, bounce_count, _path, skip_light_hit);
+                vec3 subcall = this->color(scattered, depth + 1, bounce_count, _path, sampler, skip_light_hit, aov);
                 assert(!is_nan(subcall));
                 assert(!is_nan(emitted));
                 assert(!is_nan(attenuation));
@@ -60,14 +81,7 @@ public:
             {
                 _path->push_back(rec.p);
             }
-            // generate world u v and then sample world texture?
-            // return vec3(0, 0, 0);
-            vec3 unit_direction = unit_vector(r.direction());
-            // get phi and theta values for that direction, then convert to UV values for an environment map.
-            float u = (M_PI + atan2(unit_direction.y(), unit_direction.x())) / TAU;
-            float v = acos(unit_direction.z()) / M_PI;
-
-            return world->value(u, v, unit_direction);
+            return world->background_value(r.direction());
         }
     }
     int max_bounces;
@@ -79,7 +93,7 @@ class NEERecursive : public Integrator
 {
 public:
     NEERecursive(int max_bounces, World *world) : max_bounces(max_bounces), world(world), config(world->config){};
-    vec3 color(ray &r, int depth, long *bounce_count, path *_path, bool skip_light_hit = false)
+    vec3 color(ray &r, int depth, long *bounce_count, path *_path, Sampler *sampler, bool skip_light_hit = false, aov_sample *aov = nullptr)
     {
         hit_record rec;
         // assert non-nan time
@@ -91,64 +105,64 @@ public:
         }
         if (world->hit(r, 0.001f, MAXFLOAT, rec))
         {
+            const material &mat = scene_materials()[rec.material_id];
+            if (aov != nullptr)
+            {
+                aov->record_surface(r, rec, mat, depth);
+            }
             vec3 attenuation;
-            vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-            if (depth < max_bounces && rec.mat_ptr->scatter(r, rec, attenuation))
+            vec3 emitted = mat.emitted(r, rec, rec.u, rec.v, rec.p);
+            if (depth < max_bounces && mat.scatter(r, rec, attenuation))
             {
-                if (rec.mat_ptr->name == "diffuse_light" && skip_light_hit)
+                if (mat.is_light() && skip_light_hit)
                 {
                     return vec3(0, 0, 0);
                 }
                 // assert non-nan time
                 assert(!is_nan(r.time()));
                 (*bounce_count)++;
+                float u, v;
+                sampler->get_2d(u, v);
+                ray scattered = ray(rec.p, mat.generate(r, rec, u, v), r.time());
+                vec3 sum = vec3(0, 0, 0);
+                // light sampling can't reach the single direction of smooth metal and glass, so their bounce keeps the light it hits
+                if (mat.is_specular())
+                {
+                    if (!config.only_direct_illumination)
+                    {
+                        sum += mat.sample_weight(r, rec, scattered.direction()) * this->color(scattered, depth + 1, bounce_count, _path, sampler, false, aov);
+                    }
+                    return sum;
+                }
                 hittable *random_light = world->get_random_light();
                 hittable_pdf l_pdf(random_light, rec.p);
-                // pdf scatter_pdf;
-
                 ray light_ray = ray(rec.p, l_pdf.generate(), r.time());
-                ray scattered = ray(rec.p + 0.001 * rec.normal, rec.mat_ptr->generate(r, rec), r.time());
-                // float weight;
-                vec3 sum = vec3(0, 0, 0);
-                // vec3 sum = vec3(0.0f, 0.0f, 0.0f);
-                // cosine of incoming ray
-                float cos_i = fabs(dot(r.direction(), rec.normal));
                 // pdf of light ray having gone directly towards light
                 float light_pdf_l = l_pdf.value(light_ray.direction());
-                // pdf of scatter having gone directly towards light
-                float scatter_pdf_l = rec.mat_ptr->value(r, rec, light_ray.direction());
-
-                // pdf of light ray having been generated from scatter
-                // float light_pdf_s = l_pdf.value(scattered.direction());
-                // pdf of scattered ray having been generated from scatter
-                // float scatter_pdf_s = rec.mat_ptr->value(r, rec, scattered.direction());
-
-                float weight_l = power_heuristic(1.0f, light_pdf_l, 1.0f, scatter_pdf_l);
-                float inv_weight_l = 1.0f - weight_l;
-                float cos_l = fabs(dot(light_ray.direction(), rec.normal));
-
-                // cosine direction
-                float cos_s = fabs(dot(scattered.direction(), rec.normal));
-
-                // MIS weighted contribtuion of
-                // add contribution from next event estimation
+                // cosine of the light direction, 1 in a medium
+                float cos_l = mat.is_medium() ? 1.0f : fabs(dot(unit_vector(light_ray.direction()), rec.normal.normalized()));
 
+                // both directions are weighed with bsdf * cos / pdf, like in NEEIterative. the light ray only brings the emission it
+                // reaches, and the bounce everything but, so each path is counted once
                 if (!config.only_direct_illumination)
                 {
                     // add contribution from next and future bounces
-                    vec3 fac = inv_weight_l * attenuation / scatter_pdf_l;
-                    vec3 next_and_future_bounces = this->color(scattered, depth + 1, bounce_count, _path, true);
-                    sum += fac * next_and_future_bounces;
+                    vec3 next_and_future_bounces = this->color(scattered, depth + 1, bounce_count, _path, sampler, true, aov);
+                    sum += mat.sample_weight(r, rec, scattered.direction()) * next_and_future_bounces;
                 }
 
-                vec3 light_hit = this->color(light_ray, depth + 1, bounce_count, nullptr, false);
-                sum += weight_l * attenuation / light_pdf_l * light_hit;
-
+                hit_record light_rec;
+                if (light_pdf_l > 0 && world->hit(light_ray, 0.001f, MAXFLOAT, light_rec))
+                {
+                    // add contribution from next event estimation
+                    vec3 light_hit = scene_materials()[light_rec.material_id].emitted(light_ray, light_rec, light_rec.u, light_rec.v, light_rec.p);
+                    sum += mat.eval(r, rec, light_ray.direction()) * cos_l / light_pdf_l * light_hit;
+                }
                 return sum;
             }
             else
             {
-                if (skip_light_hit && rec.mat_ptr->name == "diffuse_light")
+                if (skip_light_hit && mat.is_light())
                 {
                     return vec3(0, 0, 0);
                 }
@@ -157,10 +171,7 @@ public:
         }
         else
         {
-            vec3 unit_direction = unit_vector(r.direction());
-            float u = atan(unit_direction.z() / unit_direction.x());
-            float v = acos(unit_direction.y());
-            return world->value(u, v, unit_direction);
+            return world->background_value(r.direction());
         }
     }
     int max_bounces;
@@ -171,9 +182,30 @@ public:
 class NEEIterative : public Integrator
 {
 public:
-    NEEIterative(int max_bounces, World *world) : max_bounces(max_bounces), world(world), config(world->config){};
-    // iterative is more suited for optimization, and possible gpu execution
-    vec3 color(ray &r, int depth, long *bounce_count, path *_path, bool skip_light_hit = false)
+    NEEIterative(int max_bounces, World *world) : max_bounces(max_bounces), world(world), config(world->config)
+    {
+        if (config.path_guiding)
+        {
+            aabb bounds;
+            world->bounding_box(0, 0, bounds);
+            guide = new path_guide(bounds, config.guiding_bsdf_fraction, config.guiding_spatial_threshold);
+        }
+        if (config.ris_reuse && config.ris_candidates > 0)
+        {
+            reservoirs = new reservoir_buffer(config.film.width, config.film.height);
+        }
+    };
+    // the reservoirs hold first hits of the old view, which the new one would otherwise reuse on its first pass
+    void reset_view()
+    {
+        if (reservoirs != nullptr)
+        {
+            reservoirs->reset();
+        }
+    }
+    // iterative is more suited for optimization, and possible gpu execution.
+    // records every aov: light is direct when it scattered at most once on the way to the camera, counting mirrors and glass
+    vec3 color(ray &r, int depth, long *bounce_count, path *_path, Sampler *sampler, bool skip_light_hit = false, aov_sample *aov = nullptr)
     {
         hit_record rec;
         vec3 sum = vec3(0, 0, 0);
@@ -183,6 +215,21 @@ public:
         float last_bsdf_pdf = -1;
 
         vec3 beta = vec3(1.0, 1.0, 1.0);
+
+        // while path guiding is training, every contribution is also credited to the vertices before it.
+        // NEE samples aren't recorded on their own: direct light is already handled well by NEE,
+        // and recording it pulls the guide towards lights at the expense of the indirect light it's there for
+        bool recording = guide != nullptr && guide->training;
+        guide_vertex vertices[MAX_GUIDE_VERTICES];
+        int vertex_count = 0;
+        auto add_radiance = [&](const vec3 &contribution) {
+            sum += contribution;
+            for (int v = 0; v < vertex_count; v++)
+            {
+                vertices[v].add(contribution);
+            }
+        };
+
         for (int i = 0; i < max_bounces; i++)
         {
             // do russian roulette path termination here? by checking beta?
@@ -192,90 +239,270 @@ public:
             (*bounce_count)++;
             if (world->hit(r, 0.001, MAXFLOAT, rec))
             {
+                const material &mat = scene_materials()[rec.material_id];
                 if (_path != nullptr)
                 {
                     _path->push_back(rec.p);
                 }
-                bool did_scatter = rec.mat_ptr->scatter(r, rec, attenuation);
+                if (aov != nullptr)
+                {
+                    aov->record_surface(r, rec, mat, i);
+                }
+                // how much of a texture this pixel covers here, for camera rays and paths that only bounced off mirrors and smooth glass so far
+                vec3 dpdx, dpdy;
+                bool differentials = compute_differentials(r, rec, dpdx, dpdy);
+                bool did_scatter = mat.scatter(r, rec, attenuation);
+                bool medium = mat.is_medium();
+                // light sampling can't reach smooth metal and glass, so they only continue the path
+                bool specular = did_scatter && mat.is_specular();
+                vec3 normal = rec.normal.normalized();
                 assert(!is_nan(r.time()));
-                float cos_i = fabs(dot(r.direction().normalized(), rec.normal.normalized()));
 
-                hit_emission = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+                // with guiding, directions come from a one-sample mix of the bsdf and the learned incident radiance,
+                // so every pdf of the bsdf technique is the mixture pdf
+                dtree_pair *guide_tree = nullptr;
+                if (guide != nullptr && did_scatter && mat.guidable())
+                {
+                    guide_tree = guide->tree.lookup(rec.p);
+                }
+                bool guided = guide_tree != nullptr && guide_tree->sampling.total() > 0;
+                float bsdf_fraction = guided ? guide->bsdf_fraction : 1.0f;
+                auto scatter_pdf = [&](const vec3 &direction) {
+                    float bsdf_pdf = mat.value(r, rec, direction);
+                    return guided ? bsdf_fraction * bsdf_pdf + (1 - bsdf_fraction) * guide_tree->sampling.pdf(direction) : bsdf_pdf;
+                };
+
+                hit_emission = mat.emitted(r, rec, rec.u, rec.v, rec.p);
                 // if hit emission is greater than some small value
                 if (hit_emission.squared_length() > 0.000001)
                 {
+                    vec3 contribution;
                     if (last_bsdf_pdf <= 0)
                     {
-                        sum += beta * hit_emission;
+                        contribution = beta * hit_emission;
                     }
                     else
                     {
-                        hittable_pdf this_pdf(rec.primitive, r.origin());
-                        float weight = power_heuristic(1.0, last_bsdf_pdf, 1.0, this_pdf.value(rec.p));
-                        sum += beta * hit_emission * weight;
-                        ASSERT(!is_nan(sum), "sum had nan components");
+                        // reuse rec instead of intersecting the light again to get its pdf
+                        float light_pdf = rec.primitive->pdf_from_hit(r.origin(), rec) * world->light_pick_pdf();
+                        float weight = power_heuristic(1.0, last_bsdf_pdf, 1.0, light_pdf);
+                        contribution = beta * hit_emission * weight;
+                    }
+                    add_radiance(contribution);
+                    ASSERT(!is_nan(sum), "sum had nan components");
+                    if (aov != nullptr)
+                    {
+                        aov->add_light(contribution, i, world->light_group_of(rec.primitive));
                     }
                 }
 
-                vec3 light_contribution = vec3(0, 0, 0);
-                for (int i = 0; i < config.light_samples; i++)
-                {
-                    hittable *random_light = world->get_random_light();
-                    float pick_pdf = world->lights.size();
-                    hittable_pdf l_pdf(random_light, rec.p);
-                    // pdf scatter_pdf;
-
-                    // rec.mat_ptr->get_pdf(*scatter_pdf, r, rec);
-                    // mixture_pdf p(&p0, &p1);
-                    // hittable_pdf p = p0;
-                    // cosine_pdf p = p1;
-                    // mixture_pdf p(&p0, rec.mat_ptr->pdf);
-                    // cosine of incoming ray
-
-                    ray light_ray = ray(rec.p, l_pdf.generate(), r.time());
-                    float cos_l = dot(light_ray.direction().normalized(), rec.normal.normalized());
-
-                    // vec3 sum = vec3(0.0f, 0.0f, 0.0f);
-                    // pdf of light ray having gone directly towards light
-                    float light_pdf_l = l_pdf.value(light_ray.direction());
-                    float scatter_pdf_l = rec.mat_ptr->value(r, rec, light_ray.direction());
-                    float weight_l = power_heuristic(1.0f, light_pdf_l, 1.0f, scatter_pdf_l);
-                    float inv_weight_l = 1.0f - weight_l;
-
+                // a light sample is a point on an area light or a direction towards the importance sampled background.
+                // light_pdf is in solid angle and includes the chance of picking the light
+                auto sample_light = [&](float u_pick, float u_light, float v_light, light_candidate &candidate, float &light_pdf) {
+                    hittable *light = world->pick_light(u_pick);
+                    candidate.light = light;
+                    if (light == nullptr)
+                    {
+                        // picked the importance sampled background
+                        float env_pdf;
+                        candidate.p = world->environment->sample(u_light, v_light, env_pdf);
+                        light_pdf = env_pdf * world->light_pick_pdf();
+                        return env_pdf > 0;
+                    }
+                    light_sample ls;
+                    if (!light->sample(rec.p, r.time(), u_light, v_light, ls) || ls.pdf <= 0)
+                    {
+                        return false;
+                    }
+                    candidate.p = ls.p;
+                    candidate.normal = ls.normal;
+                    candidate.u = ls.u;
+                    candidate.v = ls.v;
+                    candidate.material_id = ls.material_id;
+                    light_pdf = ls.pdf * world->light_pick_pdf();
+                    return true;
+                };
+                // pdf of a light sample that was drawn from another shading point, as if it had been drawn from this one
+                auto light_pdf_of = [&](const light_candidate &candidate) {
+                    if (candidate.light == nullptr)
+                    {
+                        return world->environment->pdf(candidate.p) * world->light_pick_pdf();
+                    }
                     hit_record light_rec;
-                    bool did_light_hit = world->hit(light_ray, 0.001, MAXFLOAT, light_rec);
+                    light_rec.p = candidate.p;
+                    light_rec.normal = candidate.normal;
+                    light_rec.time = r.time();
+                    return candidate.light->pdf_from_hit(rec.p, light_rec) * world->light_pick_pdf();
+                };
+                // unshadowed contribution of a light sample without beta, MIS weighted against the bsdf technique. sets the shadow ray to trace
+                auto unshadowed_light = [&](const light_candidate &candidate, float light_pdf, ray &light_ray, float &distance) {
+                    vec3 direction;
+                    if (candidate.light == nullptr)
+                    {
+                        direction = candidate.p;
+                        distance = MAXFLOAT;
+                    }
+                    else
+                    {
+                        direction = candidate.p - rec.p;
+                        distance = direction.length();
+                        direction /= distance;
+                    }
+                    light_ray = ray(rec.p, direction, r.time());
+                    // the bsdf decides which sides of the surface light can arrive from, glass lets it in from behind
+                    vec3 f = mat.eval(r, rec, direction);
+                    float cos_l = medium ? 1.0f : fabs(dot(direction, normal));
+                    if (light_pdf <= 0 || f.squared_length() <= 0.00000001)
+                    {
+                        return vec3(0, 0, 0);
+                    }
+                    vec3 emission;
+                    if (candidate.light == nullptr)
+                    {
+                        emission = world->background_value(direction);
+                    }
+                    else
+                    {
+                        hit_record light_rec;
+                        light_rec.t = distance;
+                        light_rec.p = candidate.p;
+                        light_rec.normal = candidate.normal;
+                        light_rec.time = r.time();
+                        light_rec.u = candidate.u;
+                        light_rec.v = candidate.v;
+                        light_rec.material_id = candidate.material_id;
+                        light_rec.primitive = candidate.light;
+                        emission = scene_materials()[candidate.material_id].emitted(light_ray, light_rec, candidate.u, candidate.v, candidate.p);
+                    }
+                    float weight_l = power_heuristic(1.0f, light_pdf, 1.0f, scatter_pdf(direction));
+                    return f * weight_l * cos_l * emission;
+                };
+                // the sampled point is known, so the shadow ray only has to check for occluders in front of it.
+                // participating media along the way let part of the light through
+                auto visibility = [&](const ray &light_ray, float distance) {
                     (*bounce_count)++;
-                    if (did_light_hit && attenuation.length() > 0.0001)
+                    return world->transmittance(light_ray, 0.001, distance - 0.001);
+                };
+
+                vec3 light_contribution = vec3(0, 0, 0);
+                for (int s = 0; did_scatter && !specular && s < config.light_samples && world->num_lights() > 0; s++)
+                {
+                    light_candidate candidate;
+                    float light_pdf_l;
+                    // what the unshadowed contribution is scaled by, 1 / pdf for a plain light sample
+                    float sample_weight;
+                    if (config.ris_candidates > 0)
                     {
-                        if (true || light_rec.primitive == random_light)
+                        // resampled importance sampling: the candidates only cost a light sample each, and a shadow ray is traced for the one that's kept.
+                        // the target function is the luminance of the unshadowed contribution
+                        reservoir res;
+                        float u_select = sampler->get_1d();
+                        float target_y = 0;
+                        for (int c = 0; c < config.ris_candidates; c++)
                         {
-                            vec3 light_emission = light_rec.mat_ptr->emitted(light_ray, light_rec, light_rec.u, light_rec.v, light_rec.p);
-                            float dropoff = fmax(cos_l, 0.0);
-                            vec3 contribution = attenuation * beta * weight_l / light_pdf_l * dropoff * light_emission / pick_pdf;
-                            if (is_nan(contribution))
+                            float u_pick = sampler->get_1d();
+                            float u_light, v_light;
+                            sampler->get_2d(u_light, v_light);
+                            light_candidate x;
+                            float pdf = 0;
+                            float target = 0;
+                            if (sample_light(u_pick, u_light, v_light, x, pdf))
+                            {
+                                ray light_ray;
+                                float distance;
+                                target = luminance(unshadowed_light(x, pdf, light_ray, distance));
+                            }
+                            if (res.update(x, pdf > 0 ? target / pdf : 0, 1, u_select))
                             {
-                                // likely nan because what was hit by `r` was the same object as what was hit by light_ray
+                                target_y = target;
                             }
-                            else
+                        }
+                        res.finalize(target_y);
+                        if (reservoirs != nullptr && i == 0 && s == 0 && !medium)
+                        {
+                            pixel_reservoir fresh;
+                            fresh.r = res;
+                            fresh.position = rec.p;
+                            fresh.normal = normal;
+                            fresh.valid = true;
+                            res = reuse_reservoir(res, target_y, r, rec, sampler, [&](const light_candidate &y) {
+                                ray light_ray;
+                                float distance;
+                                return luminance(unshadowed_light(y, light_pdf_of(y), light_ray, distance));
+                            });
+                            // later samples and neighbours only get the candidates this pixel drew itself, not the ones it reused.
+                            // reusing reservoirs that were merged already chains reuse across the image, which correlates samples and adds up the bias
+                            reservoirs->store(sampler->pixel_x, sampler->pixel_y, fresh);
+                        }
+                        if (res.W <= 0)
+                        {
+                            continue;
+                        }
+                        candidate = res.y;
+                        light_pdf_l = light_pdf_of(candidate);
+                        sample_weight = res.W;
+                    }
+                    else
+                    {
+                        // draw all of this light sample's dimensions up front, so that later dimensions line up regardless of which branch is taken
+                        float u_pick = sampler->get_1d();
+                        float u_light, v_light;
+                        sampler->get_2d(u_light, v_light);
+                        if (!sample_light(u_pick, u_light, v_light, candidate, light_pdf_l))
+                        {
+                            continue;
+                        }
+                        sample_weight = 1 / light_pdf_l;
+                    }
+
+                    ray light_ray;
+                    float distance;
+                    vec3 unshadowed = unshadowed_light(candidate, light_pdf_l, light_ray, distance);
+                    float transmittance = unshadowed.squared_length() > 0 ? visibility(light_ray, distance) : 0.0f;
+                    if (transmittance > 0)
+                    {
+                        vec3 contribution = beta * unshadowed * sample_weight * transmittance;
+                        if (!is_nan(contribution))
+                        {
+                            light_contribution += contribution;
+                            if (aov != nullptr)
                             {
-                                light_contribution += contribution;
+                                aov->add_light(contribution / config.light_samples, i + 1, world->light_group_of(candidate.light));
                             }
-                            ASSERT(!is_nan(sum), "sum had nan components");
                         }
                     }
                 }
 
-                sum += light_contribution / config.light_samples;
+                add_radiance(light_contribution / config.light_samples);
                 ASSERT(!is_nan(sum), "sum had nan components: " << sum << ", and light contrib: " << light_contribution);
 
                 if (did_scatter)
                 {
+                    float u_bsdf, v_bsdf;
+                    sampler->get_2d(u_bsdf, v_bsdf);
+                    float u_roulette = sampler->get_1d();
+                    float u_guide = guide != nullptr ? sampler->get_1d() : 0.0f;
 
-                    ray scattered = ray(rec.p + config.normal_offset * rec.normal, rec.mat_ptr->generate(r, rec), r.time());
+                    vec3 direction;
+                    if (guided && u_guide >= bsdf_fraction)
+                    {
+                        direction = guide_tree->sampling.sample(u_bsdf, v_bsdf);
+                    }
+                    else
+                    {
+                        direction = mat.generate(r, rec, u_bsdf, v_bsdf);
+                    }
+                    if (direction.squared_length() == 0)
+                    {
+                        break;
+                    }
+                    // refracted directions leave from under the surface
+                    vec3 offset = dot(direction, normal) < 0 ? -rec.normal : rec.normal;
+                    ray scattered = ray(medium ? rec.p : rec.p + config.normal_offset * offset, direction, r.time());
 
                     // float light_pdf_s = l_pdf.value(scattered.direction());
                     // pdf of scattered ray having been generated from scatter
-                    float scatter_pdf_s = rec.mat_ptr->value(r, rec, scattered.direction());
+                    float scatter_pdf_s = scatter_pdf(scattered.direction());
 
                     // cosine direction
                     // float cos_s = fabs(dot(scattered.direction(), rec.normal)) / scattered.direction().length();
@@ -286,7 +513,7 @@ public:
                     float p = std::max(beta.x(), std::max(beta.y(), beta.z()));
                     if (config.russian_roulette && p <= 1 && 0.001 < p)
                     {
-                        if (random_double() > p)
+                        if (u_roulette > p)
                         {
                             break;
                         }
@@ -298,14 +525,43 @@ public:
 
                     if (!config.only_direct_illumination)
                     {
-                        if (scatter_pdf_s < 0.0000001)
+                        if (specular)
+                        {
+                            if (differentials)
+                            {
+                                propagate_differentials(r, rec, mat, dpdx, dpdy, scattered);
+                            }
+                            beta *= mat.specular_weight(r, rec, direction);
+                            // the next hit can't have been reached by light sampling, so it gets all of its emission
+                            last_bsdf_pdf = -1;
+                        }
+                        else
+                        {
+                            if (scatter_pdf_s < 0.0000001)
+                            {
+                                break;
+                            }
+                            // cosine of the scattered direction. guided directions can end up under the surface, where the bsdf is 0
+                            float cos_o = medium ? 1.0f : dot(scattered.direction().normalized(), normal);
+                            if (guided && cos_o <= 0)
+                            {
+                                break;
+                            }
+                            attenuation = mat.eval(r, rec, direction);
+                            beta *= attenuation * fabs(cos_o) / scatter_pdf_s;
+                            ASSERT(!isinf(beta), "beta was inf " << beta << "  " << attenuation << "  " << cos_o << "  " << scatter_pdf_s);
+                            ASSERT(!is_nan(beta), beta << " " << attenuation << " " << cos_o << " " << scatter_pdf_s);
+                            last_bsdf_pdf = scatter_pdf_s;
+                        }
+                        // microfacet directions that end up on the wrong side of the surface carry nothing
+                        if (beta.squared_length() == 0)
                         {
                             break;
                         }
-                        beta *= attenuation * fabs(cos_i) / scatter_pdf_s;
-                        ASSERT(!isinf(beta), "beta was inf " << beta << "  " << attenuation << "  " << cos_i << "  " << scatter_pdf_s);
-                        ASSERT(!is_nan(beta), beta << " " << attenuation << " " << cos_i << " " << scatter_pdf_s);
-                        last_bsdf_pdf = scatter_pdf_s;
+                        if (recording && guide_tree != nullptr && vertex_count < MAX_GUIDE_VERTICES)
+                        {
+                            vertices[vertex_count++] = {guide_tree, scattered.direction().normalized(), beta, vec3(0, 0, 0), scatter_pdf_s};
+                        }
                         // reassign r to continue bouncing.
                         r = scattered;
                     }
@@ -316,30 +572,150 @@ public:
                 }
                 else
                 {
-                    sum += beta * hit_emission;
-                    ASSERT(!is_nan(sum), "sum had nan components, beta was " << beta << " and sum was " << sum);
-
+                    // emission was already added above, MIS weighted
                     break;
                 }
             }
             else
             {
-                vec3 unit_direction = unit_vector(r.direction());
-                // get phi and theta values for that direction, then convert to UV values for an environment map.
-                float u = (M_PI + atan2(unit_direction.y(), unit_direction.x())) / TAU;
-                float v = acos(unit_direction.z()) / M_PI;
+                vec3 background = world->background_value(r.direction());
+                float weight = 1.0f;
+                if (last_bsdf_pdf > 0 && world->environment != nullptr)
+                {
+                    // the background could also have been reached through NEE, so MIS weight this hit
+                    float light_pdf = world->environment->pdf(r.direction()) * world->light_pick_pdf();
+                    weight = power_heuristic(1.0, last_bsdf_pdf, 1.0, light_pdf);
+                }
 
-                sum += beta * world->value(u, v, unit_direction);
-                ASSERT(!is_nan(sum), "sum had nan components, beta was " << beta << ", sum was " << sum << ", and world value was " << world->value(u, v, unit_direction));
+                add_radiance(beta * background * weight);
+                ASSERT(!is_nan(sum), "sum had nan components, beta was " << beta << ", sum was " << sum << ", and world value was " << background);
+                if (aov != nullptr)
+                {
+                    aov->add_light(beta * background * weight, i, world->light_group_of(nullptr));
+                }
 
                 break;
             }
         }
+        for (int v = 0; v < vertex_count; v++)
+        {
+            vertices[v].record();
+        }
         return sum;
     }
+
+    // bends the differentials of r the same way as the specular bounce that produced scattered, treating the surface as flat around the hit.
+    // past rough and diffuse bounces the footprint is too spread out to track, and lookups fall back to the finest level
+    void propagate_differentials(const ray &r, const hit_record &rec, const material &mat, const vec3 &dpdx, const vec3 &dpdy, ray &scattered)
+    {
+        vec3 normal = rec.normal.normalized();
+        bool reflected = dot(scattered.direction(), normal) * dot(r.direction(), normal) < 0;
+        auto bend = [&](const vec3 &d, vec3 &out) {
+            vec3 dir = unit_vector(d);
+            if (reflected)
+            {
+                out = reflect(dir, normal);
+                return true;
+            }
+            return refract_direction(-dir, normal, mat.param, out);
+        };
+        scattered.has_differentials = bend(r.rx_direction, scattered.rx_direction) && bend(r.ry_direction, scattered.ry_direction);
+        scattered.rx_origin = rec.p + dpdx;
+        scattered.ry_origin = rec.p + dpdy;
+    }
+
+    // spatiotemporal reuse (ReSTIR) for the first hit. merges the new reservoir with the one this pixel drew on its previous sample,
+    // and with those of a few random neighbours within ris_reuse_radius, as long as they saw a similar surface.
+    // target(y) is the target function at this hit. this is the biased variant: the weights are normalized with 1 / Z like in Bitterli et al.,
+    // but Z only counts the candidates of reservoirs whose surface faces the kept sample, leaving out visibility and the bsdf that the target
+    // resamples with, so no extra shadow rays are needed. images come out about 1% darker, which is why ris_reuse is off by default.
+    template <typename TargetFunction>
+    reservoir reuse_reservoir(const reservoir &res, float target_y, const ray &r, const hit_record &rec, Sampler *sampler, TargetFunction target)
+    {
+        const int max_merged = 16;
+        pixel_reservoir merged_from[max_merged];
+        int merged_count = 0;
+        float u_select = sampler->get_1d();
+        reservoir merged;
+        float merged_target = 0;
+        int kept = -1;
+        if (merged.update(res.y, target_y * res.W * res.M, res.M, u_select))
+        {
+            merged_target = target_y;
+        }
+        vec3 normal = rec.normal.normalized();
+        float depth = (rec.p - r.origin()).length();
+        auto merge = [&](int x, int y) {
+            pixel_reservoir &other = merged_from[merged_count];
+            if (merged_count == max_merged || !reservoirs->load(x, y, other) || dot(other.normal, normal) < 0.9f || fabs((other.position - r.origin()).length() - depth) > 0.1f * depth)
+            {
+                return;
+            }
+            float t = other.r.W > 0 ? target(other.r.y) : 0;
+            if (merged.update(other.r.y, t * other.r.W * other.r.M, other.r.M, u_select))
+            {
+                merged_target = t;
+                kept = merged_count;
+            }
+            merged_count++;
+        };
+        merge(sampler->pixel_x, sampler->pixel_y);
+        for (int n = 0; n < config.ris_reuse_neighbours; n++)
+        {
+            float u, v;
+            sampler->get_2d(u, v);
+            int dx = (int)((2 * u - 1) * config.ris_reuse_radius);
+            int dy = (int)((2 * v - 1) * config.ris_reuse_radius);
+            if (dx != 0 || dy != 0)
+            {
+                merge(sampler->pixel_x + dx, sampler->pixel_y + dy);
+            }
+        }
+        if (merged_target <= 0)
+        {
+            merged.W = 0;
+            return merged;
+        }
+        // the new reservoir can always produce the kept sample, since it has a nonzero target here
+        float Z = res.M;
+        for (int m = 0; m < merged_count; m++)
+        {
+            if (m == kept || can_reach(merged_from[m], merged.y))
+            {
+                Z += merged_from[m].r.M;
+            }
+        }
+        merged.W = merged.weight_sum / (Z * merged_target);
+        return merged;
+    }
+
+    // whether the shading point a reservoir was made at has a nonzero target function for a light sample, ignoring its bsdf
+    bool can_reach(const pixel_reservoir &at, const light_candidate &y)
+    {
+        if (y.light == nullptr)
+        {
+            return dot(y.p, at.normal) > 0;
+        }
+        vec3 direction = y.p - at.position;
+        if (dot(direction, at.normal) <= 0)
+        {
+            return false;
+        }
+        hit_record light_rec;
+        light_rec.p = y.p;
+        light_rec.normal = y.normal;
+        light_rec.u = y.u;
+        light_rec.v = y.v;
+        light_rec.material_id = y.material_id;
+        light_rec.primitive = y.light;
+        return scene_materials()[y.material_id].emitted(ray(at.position, direction, 0), light_rec, y.u, y.v, y.p).squared_length() > 0;
+    }
+
     int max_bounces;
     World *world;
     Config config;
+    // per pixel reservoirs of first hits, for ris_reuse
+    reservoir_buffer *reservoirs = nullptr;
 };
 
 // class BPT : public Integrator {
@@ -8,6 +8,7 @@
 #include "pdf.h"
 #include "primitive.h"
 #include "random.h"
+#include "scene_cache.h"
 #include "scene_parser.h"
 #include "texture.h"
 #include "thirdparty/json.hpp"
@@ -17,14 +18,17 @@
 #include "integrator.h"
 #include "renderer.h"
 #include "config.h"
+#include "distributed.h"
 
 using json = nlohmann::json;
 
 #include <chrono>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
+#include <sstream>
 #include <thread>
 
 Integrator *integrator_from_config(World *world, Config config)
@@ -83,24 +87,253 @@ Renderer *renderer_from_config(World *world, camera cam, Config config)
     };
 }
 
-camera setup_camera(json camera_json, float aspect_ratio, vec3 vup = vec3(0, 1, 0))
+// writes the image of a distributed render from what its workers left in directory, and the merged checkpoint when checkpoint_path is set,
+// so that --resume can add samples to it
+int merge_distributed(std::string directory, Config config)
 {
-    vec3 lookfrom(
-        camera_json["look_from"].at(0),
-        camera_json["look_from"].at(1),
-        camera_json["look_from"].at(2));
-
-    vec3 lookat(
-        camera_json["look_at"].at(0),
-        camera_json["look_at"].at(1),
-        camera_json["look_at"].at(2));
-
-    float vfov = camera_json.value("fov", 30.0);
-    float aperture = camera_json.value("aperture", 0.0);
-    float dist_to_focus = camera_json.value("dist_to_focus", 10.0);
-
-    return camera(lookfrom, lookat, vup, vfov, aspect_ratio,
-                  aperture, dist_to_focus, 0.0, 1.0);
+    checkpoint merged;
+    if (!merge_worker_outputs(directory, merged))
+    {
+        std::cout << "nothing to merge in " << directory << std::endl;
+        return 1;
+    }
+    // each pixel is divided by its own sample count
+    vec3 **buffer = array_2d<vec3>(merged.width, merged.height);
+    long total_samples = 0;
+    int short_pixels = 0;
+    for (int j = 0; j < merged.height; j++)
+    {
+        for (int i = 0; i < merged.width; i++)
+        {
+            uint32_t count = merged.count(i, j);
+            buffer[j][i] = count > 0 ? merged.sum(i, j) / float(count) : vec3(0, 0, 0);
+            total_samples += count;
+            short_pixels += count < (uint32_t)config.samples;
+        }
+    }
+    std::cout << "merged " << total_samples << " samples, " << float(total_samples) / (merged.width * merged.height) << " per pixel\n";
+    if (short_pixels > 0)
+    {
+        std::cout << "WARNING! " << short_pixels << " pixels have fewer than " << config.samples << " samples, a worker was probably stopped early\n";
+    }
+    float max_luminance, avg_luminance, total_luminance;
+    calculate_luminance(buffer, merged.width, merged.height, 1, merged.width * merged.height, max_luminance, total_luminance, avg_luminance);
+    std::cout << "avg lum " << avg_luminance << std::endl;
+    std::cout << "max lum " << max_luminance << std::endl;
+    std::vector<unsigned char> rgb = tonemap_to_rgb(buffer, merged.width, merged.height, 1, max_luminance, config.film.exposure, config.film.gamma);
+    write_ppm(std::make_shared<std::ofstream>(std::ofstream(config.ppm_output_path)), rgb, merged.width, merged.height);
+    if (!config.png_output_path.empty())
+    {
+        write_png(config.png_output_path, rgb, merged.width, merged.height, false);
+    }
+    if (!config.pfm_output_path.empty())
+    {
+        write_pfm(config.pfm_output_path, buffer, nullptr, 1, merged.width, merged.height);
+    }
+    if (!config.exr_output_path.empty())
+    {
+        write_exr(config.exr_output_path, buffer, nullptr, 1, merged.width, merged.height);
+    }
+    if (!config.checkpoint_path.empty())
+    {
+        if (!merged.write(config.checkpoint_path))
+        {
+            std::cout << "could not write checkpoint " << config.checkpoint_path << std::endl;
+            return 1;
+        }
+        std::cout << "wrote checkpoint " << config.checkpoint_path << std::endl;
+    }
+    return 0;
+}
+
+// tonemaps a linear pfm written by an earlier render into ppm_output_path and png_output_path, with the exposure in config.json
+int tonemap_pfm(std::string path, Config config)
+{
+    vec3 **buffer;
+    int width, height;
+    if (!read_pfm(path, buffer, width, height))
+    {
+        std::cout << "could not read " << path << " as a little endian pfm" << std::endl;
+        return 1;
+    }
+    float max_luminance, avg_luminance, total_luminance;
+    calculate_luminance(buffer, width, height, 1, width * height, max_luminance, total_luminance, avg_luminance);
+    std::vector<unsigned char> rgb = tonemap_to_rgb(buffer, width, height, 1, max_luminance, config.film.exposure, config.film.gamma);
+    write_ppm(std::make_shared<std::ofstream>(std::ofstream(config.ppm_output_path)), rgb, width, height);
+    if (!config.png_output_path.empty())
+    {
+        write_png(config.png_output_path, rgb, width, height, false);
+    }
+    std::cout << "tonemapped " << path << " into " << config.ppm_output_path << std::endl;
+    return 0;
+}
+
+// changes the view of an interactive render with commands from stdin, one per line, until "quit" or the end of the input.
+//   look_from x y z, look_at x y z, fov degrees, aperture a, dist_to_focus d    set that part of the camera, like in the scene json
+//   move dx dy dz    moves look_from and look_at together
+//   camera {...}     sets several at once, like camera {"look_from": [0, 1, 5], "fov": 40}
+//   save             writes the image as it is now, in full quality and with the pfm and exr outputs
+//   quit
+void read_view_commands(Interactive *viewer, json camera_json, float aspect_ratio)
+{
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        std::istringstream words(line);
+        std::string command;
+        if (!(words >> command))
+        {
+            continue;
+        }
+        if (command == "quit")
+        {
+            break;
+        }
+        if (command == "save")
+        {
+            viewer->request_save();
+            continue;
+        }
+        json changed = camera_json;
+        float x, y, z;
+        if ((command == "look_from" || command == "look_at") && words >> x >> y >> z)
+        {
+            changed[command] = {x, y, z};
+        }
+        else if ((command == "fov" || command == "aperture" || command == "dist_to_focus") && words >> x)
+        {
+            changed[command] = x;
+        }
+        else if (command == "move" && words >> x >> y >> z)
+        {
+            for (std::string key : {"look_from", "look_at"})
+            {
+                changed[key] = {changed[key].at(0).get<float>() + x, changed[key].at(1).get<float>() + y, changed[key].at(2).get<float>() + z};
+            }
+        }
+        else if (command == "camera")
+        {
+            std::string rest;
+            std::getline(words, rest);
+            json values = json::parse(rest, nullptr, false);
+            if (!values.is_object())
+            {
+                std::cout << "\nexpected a json object after camera, got" << rest << std::endl;
+                continue;
+            }
+            changed.update(values);
+        }
+        else
+        {
+            std::cout << "\ncould not understand \"" << line << "\"" << std::endl;
+            continue;
+        }
+        camera_json = changed;
+        viewer->set_camera(setup_camera(camera_json, aspect_ratio));
+    }
+    viewer->stop();
+}
+
+// renders one image of world and writes it out. the renderer (and its integrator) is made for the image, while the world is kept
+void render_image(World *world, camera cam, Config config, distributed_job *job, bool resume, std::chrono::high_resolution_clock::time_point start_time)
+{
+    Renderer *renderer = renderer_from_config(world, cam, config);
+    renderer->tile_cache = world->tile_cache;
+    // the denoiser is guided by aovs, which are recorded for it without being written
+    unsigned recorded_aovs = config.aovs;
+    if (config.denoiser != NO_DENOISER)
+    {
+        recorded_aovs |= (1u << AOV_ALBEDO) | (1u << AOV_NORMAL) | (1u << AOV_DEPTH) | (1u << AOV_VARIANCE);
+    }
+    if (recorded_aovs != 0)
+    {
+        renderer->aovs = new aov_buffers(recorded_aovs, config.film.width, config.film.height, world->light_group_names);
+        renderer->aovs->written = config.aovs;
+        unsigned lighting = (1u << AOV_DIRECT) | (1u << AOV_INDIRECT) | (1u << AOV_LIGHT_GROUPS);
+        if ((config.aovs & lighting) != 0 && config.integrator_type != INEEPT)
+        {
+            std::cout << "WARNING! only the iterative nee path tracing integrator records direct, indirect and light group aovs, they'll be black\n";
+        }
+    }
+    if (job != nullptr)
+    {
+        static_cast<Progressive *>(renderer)->distribute(job);
+    }
+    // --resume continues from the checkpoint at checkpoint_path, or starts over if there isn't one yet
+    if (resume && !renderer->resume(config.checkpoint_path))
+    {
+        std::cout << "nothing to resume from at \"" << config.checkpoint_path << "\", starting from scratch\n";
+    }
+    renderer->preprocess();
+    renderer->start_render(start_time);
+
+    while (!renderer->is_done())
+    {
+        renderer->sync_progress();
+        // progress every half a second, but without waiting that long once the threads are done, which adds up over short frames
+        for (int k = 0; k < 50 && !renderer->all_threads_finished(); k++)
+        {
+            using namespace std::chrono_literals;
+            std::this_thread::sleep_for(10ms);
+        }
+    }
+
+    std::cout << " done\n";
+
+    renderer->finalize();
+    delete renderer;
+}
+
+// path with _<frame> put in front of its extension, or after it when it has none. empty paths stay empty
+std::string frame_path(std::string path, int frame)
+{
+    if (path.empty())
+    {
+        return path;
+    }
+    std::ostringstream number;
+    number << '_' << std::setw(4) << std::setfill('0') << frame;
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return path + number.str();
+    }
+    return path.substr(0, dot) + number.str() + path.substr(dot);
+}
+
+// renders config.frames frames from config.frame on with the scene loaded once. between frames the keyframed instances are moved
+// and the bvh is refit around them (see World::set_frame), and every frame writes its own outputs and checkpoint, so --resume picks
+// a killed sequence up at the frame it was on
+int render_sequence(World *world, camera cam, Config config, bool resume)
+{
+    auto sequence_start = std::chrono::high_resolution_clock::now();
+    int rebuilds = 0;
+    for (int frame = config.frame; frame < config.frame + config.frames; frame++)
+    {
+        auto frame_start = std::chrono::high_resolution_clock::now();
+        bool rebuilt = world->set_frame(frame);
+        rebuilds += rebuilt;
+        auto moved = std::chrono::high_resolution_clock::now();
+
+        Config frame_config = config;
+        for (std::string *path : {&frame_config.ppm_output_path, &frame_config.png_output_path, &frame_config.pfm_output_path, &frame_config.exr_output_path,
+                                  &frame_config.aov_output_path, &frame_config.checkpoint_path, &frame_config.traced_paths_output_path, &frame_config.traced_paths_2d_output_path})
+        {
+            *path = frame_path(*path, frame);
+        }
+        std::cout << "\nframe " << frame << '\n';
+        render_image(world, cam, frame_config, nullptr, resume, moved);
+        auto frame_end = std::chrono::high_resolution_clock::now();
+
+        std::cout << std::fixed << std::setprecision(2) << "frame " << frame << ": " << (rebuilt ? "rebuilt" : "refit") << " the bvh in "
+                  << std::chrono::duration<double, std::milli>(moved - frame_start).count() << " ms (traversal cost " << world->cost << ", "
+                  << world->built_cost << " when built), rendered in " << std::chrono::duration<double>(frame_end - moved).count() << " s\n";
+        std::cout.unsetf(std::ios::floatfield);
+    }
+    std::cout << "rendered " << config.frames << " frames in " << std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - sequence_start).count()
+              << " s, rebuilding the bvh " << rebuilds << " times\n";
+    return 0;
 }
 
 std::mutex framebuffer_lock;
@@ -125,44 +358,125 @@ int main(int argc, char *argv[])
     std::cout << "with " << config.samples << " samples per pixel, that sets a minimum number of camera rays at " << min_camera_rays << "\n\n";
     std::cout << "using " << config.threads << " threads\n";
 
+    // --tonemap <file.pfm> redoes the tonemapping of an earlier render, without rendering anything.
+    // --merge <dir> writes the image of a distributed render from its workers' output, without rendering anything.
+    // --worker <dir> joins the distributed render in dir, which can be shared with other processes and machines
+    // --resume continues from the checkpoint at checkpoint_path, see render_image
+    bool resume = false;
+    for (int i = 1; i < argc; i++)
+    {
+        resume = resume || strcmp(argv[i], "--resume") == 0;
+    }
+    distributed_job *job = nullptr;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--tonemap") == 0)
+        {
+            return tonemap_pfm(argv[i + 1], config);
+        }
+        if (strcmp(argv[i], "--merge") == 0)
+        {
+            return merge_distributed(argv[i + 1], config);
+        }
+        if (strcmp(argv[i], "--worker") == 0)
+        {
+            // resuming would overwrite the generation the worker's samples are told apart by, and every worker would add in the same
+            // checkpoint, which the merge then counts once per worker
+            if (resume)
+            {
+                std::cout << "--resume can't be used with --worker. a distributed render goes on by starting more workers, and its merged checkpoint can be resumed without --worker\n";
+                return 1;
+            }
+            job = new distributed_job(argv[i + 1], config.samples, config.distributed_chunk_samples);
+            if (!job->join())
+            {
+                return 1;
+            }
+            std::cout << "joined the distributed render in " << job->directory << " as worker " << job->worker_id << '\n';
+            // what this worker rendered goes into the job directory, next to the other workers'
+            config.checkpoint_path = job->output_path(job->worker_id);
+            config.ppm_output_path = job->directory + "/worker_" + std::to_string(job->worker_id) + ".ppm";
+            config.png_output_path = job->directory + "/worker_" + std::to_string(job->worker_id) + ".png";
+            // the merge writes those for the whole frame. aovs aren't merged, and so the merged image isn't denoised
+            config.pfm_output_path = "";
+            config.exr_output_path = "";
+            config.aovs = 0;
+            config.denoiser = NO_DENOISER;
+            if (config.render_type != PROGRESSIVE)
+            {
+                std::cout << "workers split the render by sample index, rendering progressively instead of with the configured renderer\n";
+                config.render_type = PROGRESSIVE;
+            }
+        }
+    }
+
+    // --interactive keeps the scene loaded and renders the view it's sent on stdin, see read_view_commands
+    bool interactive = false;
+    for (int i = 1; i < argc; i++)
+    {
+        interactive = interactive || strcmp(argv[i], "--interactive") == 0;
+    }
+    if (interactive)
+    {
+        // all it writes are previews of the framebuffer, until it's told to save or quit
+        config.checkpoint_path = "";
+        config.aovs = 0;
+        config.denoiser = NO_DENOISER;
+        config.pixel_filter_splatting = false;
+        config.should_trace_paths = false;
+    }
+
     // x,y,z
     // y is up.
     std::cout << "reading scene data" << std::endl;
 
-    json scene;
-    std::ifstream scene_file(config.scene_path);
-    scene_file >> scene;
-
-    auto t1 = std::chrono::high_resolution_clock::now();
     // hittable *world = cornell_box();
-    World *world = build_scene(scene);
+    texture_cache *tile_cache = nullptr;
+    if (config.texture_cache_mb > 0)
+    {
+        tile_cache = new texture_cache((size_t)config.texture_cache_mb * 1024 * 1024, config.texture_tile_size);
+    }
+    // prints how long each phase of loading took
+    json camera_json;
+    World *world = load_scene(config.scene_path, tile_cache, config.threads, config.scene_cache, camera_json);
     world->config = config;
     auto t2 = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed_seconds = t2 - t1;
-    std::cout << "time taken to build bvh " << elapsed_seconds.count() << std::endl;
 
     // camera setup
 
-    json camera_json = scene["camera"];
     camera cam = setup_camera(camera_json, float(film.width) / float(film.height));
 
     // end camera setup
 
     // before we compute everything, open the file
 
-    Renderer *renderer = renderer_from_config(world, cam, config);
-    // Integrator *integrator = new RecursivePT(config.max_bounces);
-    // Renderer *renderer = new Progressive(integrator, cam, world);
-    renderer->start_render(t2);
-
-    while (!renderer->is_done())
+    if (!world->animations.empty())
     {
-        renderer->sync_progress();
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(0.5s);
+        world->set_frame(config.frame);
+    }
+    if (interactive)
+    {
+        Renderer *renderer = new Interactive(integrator_from_config(world, config), cam, config);
+        renderer->tile_cache = world->tile_cache;
+        renderer->preprocess();
+        renderer->start_render(t2);
+        std::cout << "rendering interactively, waiting for view changes on stdin\n";
+        std::thread commands([&]() { read_view_commands(static_cast<Interactive *>(renderer), camera_json, float(film.width) / float(film.height)); });
+        while (!renderer->is_done())
+        {
+            renderer->sync_progress();
+            using namespace std::chrono_literals;
+            std::this_thread::sleep_for(10ms);
+        }
+        commands.join();
+        renderer->finalize();
+        return 0;
     }
 
-    std::cout << " done\n";
-
-    renderer->finalize();
+    if (config.frames <= 1 || job != nullptr)
+    {
+        render_image(world, cam, config, job, resume, t2);
+        return 0;
+    }
+    return render_sequence(world, cam, config, resume);
 }
@@ -1,133 +1,377 @@
 #pragma once
 #include "hittable.h"
+#include "microfacet.h"
 #include "texture.h"
 #include "vec3.h"
 #include "pdf.h"
+#include "sampler.h"
+#include <vector>
 
+enum material_type
+{
+    LAMBERTIAN,
+    METAL,
+    DIELECTRIC,
+    DIFFUSE_LIGHT,
+    ISOTROPIC
+};
+
+// every material is one tagged record, and shading switches on the tag instead of going through virtual calls.
+// records live in scene_materials() and hit records refer to them by index. the subclasses below only fill in a record,
+// so they can be created with new as before and copied into the table without slicing anything off
 class material
 {
 public:
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, vec3 &attenuation) const
+    material() : type(LAMBERTIAN), id(-1), tex(nullptr), color(0, 0, 0), param(0), roughness(0), two_sided(true) {}
+
+    // a representative bsdf (or phase function) value. false if this material doesn't scatter at all.
+    // eval() has the value for a specific direction, and sample_weight() what a direction from generate() is weighed with
+    bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation) const
     {
-        // mauve
-        std::cout << "WARNING! material::scatter being called" << std::endl;
-        attenuation = vec3(0.8, 0.0, 0.8);
-        return true;
+        switch (type)
+        {
+        case LAMBERTIAN:
+            // unaligned is what we want
+            attenuation = dot(r_in.direction(), rec.normal) < 0 ? tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_width) / M_PI : vec3(0, 0, 0);
+            return true;
+        case METAL:
+            attenuation = color / M_PI;
+            return true;
+        case DIELECTRIC:
+            // change this to something else to have a tinted glass material
+            attenuation = vec3(1.0, 1.0, 1.0);
+            return true;
+        case ISOTROPIC:
+            // the phase function, scattering uniformly over the sphere
+            attenuation = tex->value(rec.u, rec.v, rec.p) / (4 * M_PI);
+            return true;
+        default:
+            return false;
+        }
     }
-    virtual vec3 generate(const ray &r, const hit_record &rec) = 0;
-    virtual float value(const ray &r, const hit_record &rec, const vec3 &direction) = 0;
-    virtual vec3 emitted(const ray &r_in, const hit_record &rec, float u, float v, const vec3 &p) const
+    // the bsdf (or phase function) for light arriving from direction and leaving towards the origin of r_in, without the cosine.
+    // 0 for smooth metal and glass, which only scatter into single directions. see specular_weight for those
+    vec3 eval(const ray &r_in, const hit_record &rec, const vec3 &direction) const
     {
-        return vec3(0, 0, 0);
+        switch (type)
+        {
+        case LAMBERTIAN:
+        {
+            vec3 n = rec.normal.normalized();
+            bool front = dot(r_in.direction(), n) < 0 && dot(direction, n) > 0;
+            return front ? tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_width) / M_PI : vec3(0, 0, 0);
+        }
+        case METAL:
+        case DIELECTRIC:
+        {
+            if (is_specular())
+            {
+                return vec3(0, 0, 0);
+            }
+            onb uvw;
+            uvw.build_from_w(rec.normal);
+            vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+            vec3 wi = uvw.to_local(unit_vector(direction));
+            return type == METAL ? eval_conductor(wo, wi) : vec3(1, 1, 1) * eval_dielectric(wo, wi);
+        }
+        case ISOTROPIC:
+            return tex->value(rec.u, rec.v, rec.p) / (4 * M_PI);
+        default:
+            return vec3(0, 0, 0);
+        }
     }
-    std::string name = "error";
-};
-
-class lambertian : public material
-{
-public:
-    lambertian()
+    // samples a scattered direction from the 2d sample (u, v). a zero vector when the sample is lost
+    vec3 generate(const ray &r_in, const hit_record &rec, float u, float v) const
     {
-        // bsdf_pdf = new cosine_pdf();
+        switch (type)
+        {
+        case LAMBERTIAN:
+        {
+            onb uvw;
+            uvw.build_from_w(rec.normal);
+            return uvw.local(random_cosine_direction(u, v));
+        }
+        case METAL:
+        {
+            if (is_specular())
+            {
+                return reflect(unit_vector(r_in.direction()), rec.normal.normalized());
+            }
+            // reflect about a visible microfacet normal, so that the directions follow the lobe however narrow it is
+            onb uvw;
+            uvw.build_from_w(rec.normal);
+            vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+            vec3 m = ggx_sample_visible_normal(wo, roughness_to_alpha(roughness), u, v);
+            return uvw.local(-wo + 2 * dot(wo, m) * m);
+        }
+        case DIELECTRIC:
+            return is_specular() ? refract_or_reflect(r_in, rec, u) : sample_rough_dielectric(r_in, rec, u, v);
+        default:
+            return random_on_unit_sphere(u, v);
+        }
     }
-    lambertian(texture *a, std::string name = "lambertian") : albedo(a), name(name) {}
-    lambertian(vec3 v, std::string name = "lambertian") : name(name)
+    // solid angle pdf of generate() producing direction. 0 for delta distributions
+    float value(const ray &r, const hit_record &rec, const vec3 &direction) const
     {
-        albedo = new constant_texture(v);
+        switch (type)
+        {
+        case LAMBERTIAN:
+        {
+            float cosine = dot(direction, rec.normal) / (direction.length() * rec.normal.length());
+            return cosine > 0 ? cosine / M_PI : 0;
+        }
+        case METAL:
+        case DIELECTRIC:
+        {
+            if (is_specular())
+            {
+                return 0;
+            }
+            onb uvw;
+            uvw.build_from_w(rec.normal);
+            vec3 wo = uvw.to_local(-unit_vector(r.direction()));
+            vec3 wi = uvw.to_local(unit_vector(direction));
+            return type == METAL ? pdf_conductor(wo, wi) : pdf_dielectric(wo, wi);
+        }
+        case ISOTROPIC:
+            return 1 / (4 * M_PI);
+        default:
+            return 0;
+        }
     }
-    bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation) const
+    // smooth metal and glass scatter into single directions, that can't be hit by light sampling and have no pdf to weigh against
+    bool is_specular() const
     {
-        // unaligned is what we want
-        if (dot(r_in.direction(), rec.normal) < 0)
+        return (type == METAL || type == DIELECTRIC) && roughness_to_alpha(roughness) < GGX_SMOOTH_ALPHA;
+    }
+    // bsdf * cos / pdf of a direction that generate() produced at a specular vertex, where the delta functions cancel out
+    vec3 specular_weight(const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        switch (type)
         {
-            attenuation = albedo->value(rec.u, rec.v, rec.p) / M_PI;
+        case METAL:
+            return fresnel_schlick(color, fabs(dot(unit_vector(r_in.direction()), rec.normal.normalized())));
+        case DIELECTRIC:
+            // reflection and refraction are picked with the fresnel reflectance as probability, which is also their weight
+            return vec3(1, 1, 1);
+        default:
+            return vec3(0, 0, 0);
         }
-        else
+    }
+    // bsdf * cos / pdf of a direction that generate() produced, like the iterative integrator weighs its bounces. for rough metal that's
+    // the visible normal estimator F G2 / G1 (Heitz 2018), which stays below the fresnel reflectance at any roughness. 0 for lost samples
+    vec3 sample_weight(const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        if (direction.squared_length() == 0)
         {
-            attenuation = vec3(0, 0, 0);
+            return vec3(0, 0, 0);
         }
-
-        // scattered = ray(rec.p, target - rec.p);
-        return true;
+        if (is_specular())
+        {
+            return specular_weight(r_in, rec, direction);
+        }
+        float pdf = value(r_in, rec, direction);
+        if (pdf <= 0)
+        {
+            return vec3(0, 0, 0);
+        }
+        float cosine = is_medium() ? 1.0f : fabs(dot(unit_vector(direction), rec.normal.normalized()));
+        return eval(r_in, rec, direction) * cosine / pdf;
     }
-    vec3 generate(const ray &r_in, const hit_record &rec)
+    vec3 emitted(const ray &r_in, const hit_record &rec, float u, float v, const vec3 &p) const
     {
-        /*float alpha = albedo->alpha(rec.u, rec.v, rec.p);
-                if (alpha == 0.0 || random_double() > alpha)
+        switch (type)
         {
-            // passthrough
-            target = rec.p + r_in.direction();
-            attenuation = vec3(1.0, 1.0, 1.0);
+        case DIFFUSE_LIGHT:
+        {
+            // one sided lights only emit towards the side their normal faces
+            bool aligned = dot(rec.normal, r_in.direction()) > 0;
+            if (!aligned || two_sided)
+            {
+                return param * tex->value(u, v, p) * tex->alpha(u, v, p);
+            }
+            return vec3(0, 0, 0);
         }
-        else
-        {*/
-        return cosine_pdf(rec.normal).generate();
-    };
-    float value(const ray &r, const hit_record &rec, const vec3 &direction)
+        case ISOTROPIC:
+            return color;
+        default:
+            return vec3(0, 0, 0);
+        }
+    }
+    // the color of the surface without lighting, for the albedo aov. lights are their emission color, without the power
+    vec3 albedo(const hit_record &rec) const
     {
-        return cosine_pdf(rec.normal).value(direction);
+        switch (type)
+        {
+        case LAMBERTIAN:
+            return tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_width);
+        case METAL:
+            return color;
+        case DIELECTRIC:
+            return vec3(1, 1, 1);
+        case DIFFUSE_LIGHT:
+        case ISOTROPIC:
+            return tex->value(rec.u, rec.v, rec.p);
+        default:
+            return vec3(0, 0, 0);
+        }
+    }
+    // whether path guiding may replace generate() with directions from the learned incident radiance.
+    // only makes sense for reflection lobes wide enough that the guide's directions have a nonzero bsdf
+    bool guidable() const
+    {
+        return type == LAMBERTIAN || (type == METAL && !is_specular());
+    }
+    // phase functions of participating media scatter the same way in every orientation, so there's no surface normal and no cosine term
+    bool is_medium() const
+    {
+        return type == ISOTROPIC;
+    }
+    bool is_light() const
+    {
+        return type == DIFFUSE_LIGHT;
     }
 
-    texture *albedo;
-    std::string name;
-};
+    material_type type;
+    // index in scene_materials(), -1 until it's added
+    int id;
+    // albedo for lambertian and isotropic, emission for diffuse lights
+    texture *tex;
+    // albedo for metal, emission for isotropic
+    vec3 color;
+    // index of refraction for dielectric, power for diffuse lights
+    float param;
+    // perceptual roughness of metal and dielectric, the square root of the GGX alpha. 0 is a perfect mirror or smooth glass
+    float roughness;
+    bool two_sided;
 
-class metal : public material
-{
-public:
-    metal(const vec3 &a, float f, std::string name = "metal") : albedo(a), name(name)
+private:
+    // GGX conductor in the local frame of the normal. both sides of the surface reflect
+    vec3 eval_conductor(vec3 wo, vec3 wi) const
     {
-        if (f < 1)
+        if (wo.z() * wi.z() <= 0)
         {
-            fuzz = f;
+            return vec3(0, 0, 0);
         }
-        else
+        if (wo.z() < 0)
         {
-            fuzz = 1;
+            wo = -wo;
+            wi = -wi;
         }
+        vec3 m = wo + wi;
+        if (m.squared_length() == 0)
+        {
+            return vec3(0, 0, 0);
+        }
+        m.make_unit_vector();
+        float alpha = roughness_to_alpha(roughness);
+        return ggx_d(m, alpha) * ggx_g(wo, wi, alpha) * fresnel_schlick(color, dot(wo, m)) / (4 * wo.z() * wi.z());
     }
-    virtual bool scatter(const ray &r_in, const hit_record &rec,
-                         vec3 &attenuation) const
+    float pdf_conductor(vec3 wo, vec3 wi) const
     {
-        // vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        // scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-        attenuation = albedo / M_PI;
-        // return (dot(scattered.direction(), rec.normal) > 0);
-        return true;
+        if (wo.z() * wi.z() <= 0)
+        {
+            return 0;
+        }
+        vec3 m = wo + wi;
+        if (m.squared_length() == 0)
+        {
+            return 0;
+        }
+        m.make_unit_vector();
+        if (m.z() < 0)
+        {
+            m = -m;
+        }
+        // the visible normal pdf times the jacobian of reflecting about m
+        return ggx_visible_normal_pdf(wo, m, roughness_to_alpha(roughness)) / (4 * fabs(dot(wo, m)));
     }
-    vec3 generate(const ray &r_in, const hit_record &rec)
+    // the microfacet normal that takes wo to wi, by reflection if they're on the same side and by refraction otherwise (Walter et al. 2007).
+    // etap is the relative index of refraction across the surface along wo, 1 for reflection
+    bool dielectric_half_vector(const vec3 &wo, const vec3 &wi, vec3 &m, float &etap) const
     {
-        // for now use cosine.
-        // in the future, program a microfaced brdf
-        return cosine_pdf(rec.normal).generate();
-    };
-    float value(const ray &r, const hit_record &rec, const vec3 &direction)
+        float cos_o = wo.z(), cos_i = wi.z();
+        if (cos_o == 0 || cos_i == 0)
+        {
+            return false;
+        }
+        etap = cos_o * cos_i > 0 ? 1 : (cos_o > 0 ? param : 1 / param);
+        m = wi * etap + wo;
+        if (m.squared_length() == 0)
+        {
+            return false;
+        }
+        m.make_unit_vector();
+        if (m.z() < 0)
+        {
+            m = -m;
+        }
+        // microfacets that face away from either direction can't connect them
+        return dot(m, wi) * cos_i > 0 && dot(m, wo) * cos_o > 0;
+    }
+    // like smooth glass, transmission leaves out the 1 / eta^2 scaling of radiance, which cancels out when a path leaves the object again
+    float eval_dielectric(const vec3 &wo, const vec3 &wi) const
     {
-        return cosine_pdf(rec.normal).value(direction);
+        vec3 m;
+        float etap;
+        if (!dielectric_half_vector(wo, wi, m, etap))
+        {
+            return 0;
+        }
+        float alpha = roughness_to_alpha(roughness);
+        float fresnel = fresnel_dielectric(dot(wo, m), param);
+        float dg = ggx_d(m, alpha) * ggx_g(wo, wi, alpha);
+        if (etap == 1)
+        {
+            return dg * fresnel / fabs(4 * wo.z() * wi.z());
+        }
+        float denom = dot(wi, m) + dot(wo, m) / etap;
+        return dg * (1 - fresnel) * fabs(dot(wi, m) * dot(wo, m) / (denom * denom * wo.z() * wi.z()));
     }
-    vec3 albedo;
-    float fuzz;
-    std::string name;
-};
-
-class dielectric : public material
-{
-public:
-    dielectric(float ri, std::string name = "dielectric") : ref_idx(ri), name(name) {}
-    virtual bool scatter(const ray &r_in, const hit_record &rec,
-                         vec3 &attenuation) const
+    float pdf_dielectric(const vec3 &wo, const vec3 &wi) const
     {
-        attenuation = vec3(1.0, 1.0, 1.0); // change this to something else to have a tinted glass material
-
-        return true;
+        vec3 m;
+        float etap;
+        if (!dielectric_half_vector(wo, wi, m, etap))
+        {
+            return 0;
+        }
+        float alpha = roughness_to_alpha(roughness);
+        float reflect_prob = fresnel_dielectric(wo.z(), param);
+        if (etap == 1)
+        {
+            return reflect_prob * ggx_visible_normal_pdf(wo, m, alpha) / (4 * fabs(dot(wo, m)));
+        }
+        float denom = dot(wi, m) + dot(wo, m) / etap;
+        return (1 - reflect_prob) * ggx_visible_normal_pdf(wo, m, alpha) * fabs(dot(wi, m)) / (denom * denom);
+    }
+    // picks reflection or refraction with the fresnel reflectance of the macro surface, then draws a visible microfacet normal with the rest of u.
+    // refraction can still fail on a steep microfacet, and a steep microfacet can also reflect through the surface or refract back out of it.
+    // the sample is then lost and a zero vector is returned, which keeps the estimator unbiased since the pdf of every direction only counts
+    // the branch that pdf_dielectric classifies it as by its side
+    vec3 sample_rough_dielectric(const ray &r_in, const hit_record &rec, float u, float v) const
+    {
+        onb uvw;
+        uvw.build_from_w(rec.normal);
+        vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+        float reflect_prob = fresnel_dielectric(wo.z(), param);
+        bool reflecting = u < reflect_prob;
+        u = reflecting ? u / reflect_prob : (u - reflect_prob) / (1 - reflect_prob);
+        vec3 m = ggx_sample_visible_normal(wo, roughness_to_alpha(roughness), std::min(u, ONE_MINUS_EPSILON), v);
+        vec3 wi;
+        if (reflecting)
+        {
+            wi = -wo + 2 * dot(wo, m) * m;
+            return wi.z() * wo.z() > 0 ? uvw.local(wi) : vec3(0, 0, 0);
+        }
+        return refract_direction(wo, m, param, wi) && wi.z() * wo.z() < 0 ? uvw.local(wi) : vec3(0, 0, 0);
     }
-    vec3 generate(const ray &r_in, const hit_record &rec)
+    vec3 refract_or_reflect(const ray &r_in, const hit_record &rec, float u) const
     {
+        float ref_idx = param;
         vec3 outward_normal;
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         float ni_over_nt;
-        vec3 scattered_direction;
         vec3 refracted;
 
         float reflect_prob;
@@ -154,124 +398,97 @@ public:
         {
             reflect_prob = 1.0;
         }
-
-        if (random_double() < reflect_prob)
-        {
-            scattered_direction = reflected;
-        }
-        else
-        {
-            scattered_direction = refracted;
-        }
-        return scattered_direction;
-    };
-    float value(const ray &r, const hit_record &rec, const vec3 &direction)
-    {
-        return void_pdf().value(direction);
+        return u < reflect_prob ? reflected : refracted;
     }
-
-    float ref_idx;
-    std::string name;
 };
 
-class diffuse_light : public material
+class lambertian : public material
 {
 public:
-    diffuse_light(texture *a, float power = 1.0, bool two_sided = true) : emit(a), power(power), two_sided(two_sided)
-    {
-    }
-    diffuse_light(vec3 &a, float power = 1.0, bool two_sided = true) : power(power), two_sided(two_sided)
+    lambertian(texture *a)
     {
-        emit = new constant_texture(a);
+        type = LAMBERTIAN;
+        tex = a;
     }
-    virtual bool scatter(const ray &r_in, const hit_record &rec,
-                         vec3 &attenuation) const
+    lambertian(vec3 a) : lambertian(new constant_texture(a)) {}
+};
+
+class metal : public material
+{
+public:
+    metal(const vec3 &a, float f)
     {
-        return false;
+        type = METAL;
+        color = a;
+        roughness = f < 1 ? f : 1;
     }
-    // virtual vec3 emitted(float u, float v, const vec3 &p) const
-    //                      vec3 &attenuation, ray &scattered) const
-    // {
-    // float alpha = emit->alpha(rec.u, rec.v, rec.p);
-    // bool aligned = dot(rec.normal, r_in.direction()) > 0;
-    // // this if condition handles alpha and one-sided visibility
-    // if (alpha == 0.0 || random_double() > alpha || (aligned && !two_sided))
-    // {
-    //     // passthrough ray,
-    //     // because the random was above the alpha threshold,
-    //     // we were at 0 alpha,
-    //     // or the hit occurred from behind the light
+};
 
-    //     // set ray passthrough to right after the ray intersection point and in original ray direction.
-    //     scattered = ray(rec.p + r_in.direction() * 0.01, r_in.direction());
-    //     // set attenuation to 1 (meaning no change)
-    //     attenuation = vec3(1.0, 1.0, 1.0); //emit->value(rec.u, rec.v, rec.p);
-    //     return true;
-    // }
-    // return false;
-    // }
-    virtual vec3 emitted(const ray &r_in, const hit_record &rec, float u, float v, const vec3 &p) const
+class dielectric : public material
+{
+public:
+    dielectric(float ri, float roughness = 0)
     {
-        // this if condition handles one-sidedness
-        bool aligned = dot(rec.normal, r_in.direction()) > 0;
-        if (!aligned || two_sided)
-        {
-            // if normal and r_in.direction are in opposite directions
-            // i.e. if hit on correct side of light
-            return power * emit->value(u, v, p) * emit->alpha(u, v, p);
-        }
-        else
-        {
-            // aligned && !two_sided
-            // opposite is !(aligned && !two_sided)
-            //           = !aligned || two_sided
-            // normal and r_in.direction are aligned, pointing the same way
-            // this means that we hit from the wrong side and that we're not two sided
-            return vec3(0, 0, 0);
-        }
+        type = DIELECTRIC;
+        param = ri;
+        this->roughness = roughness < 1 ? roughness : 1;
     }
-    vec3 generate(const ray &r_in, const hit_record &rec)
-    {
-        return void_pdf().generate();
-    };
-    float value(const ray &r, const hit_record &rec, const vec3 &direction)
+};
+
+class diffuse_light : public material
+{
+public:
+    diffuse_light(texture *a, float power = 1.0, bool two_sided = true)
     {
-        return void_pdf().value(direction);
+        type = DIFFUSE_LIGHT;
+        tex = a;
+        param = power;
+        this->two_sided = two_sided;
     }
-    texture *emit;
-    std::string name;
-    float power;
-    bool two_sided;
+    diffuse_light(vec3 &a, float power = 1.0, bool two_sided = true) : diffuse_light(new constant_texture(a), power, two_sided) {}
 };
 
 class isotropic : public material
 {
 public:
-    isotropic(texture *a, vec3 emission = vec3(0, 0, 0), std::string name = "isotropic") : albedo(a), emission(emission), name(name) {}
-    isotropic(vec3 a, vec3 emission = vec3(0, 0, 0), std::string name = "isotropic") : albedo(new constant_texture(a)), emission(emission), name(name) {}
-    virtual bool scatter(
-        const ray &r_in,
-        const hit_record &rec,
-        vec3 &attenuation) const
+    isotropic(texture *a, vec3 emission = vec3(0, 0, 0))
     {
-
-        // scattered = ray(rec.p, random_in_unit_sphere());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
-        return true;
+        type = ISOTROPIC;
+        tex = a;
+        color = emission;
     }
-    virtual vec3 emitted(float u, float v, const vec3 &p) const
+    isotropic(vec3 a, vec3 emission = vec3(0, 0, 0)) : isotropic(new constant_texture(a), emission) {}
+};
+
+// every material in the scene, in one flat array
+class material_table
+{
+public:
+    // copies m in the first time it's seen, and returns its index from then on
+    int add(material *m)
     {
-        return emission;
+        if (m->id < 0)
+        {
+            m->id = materials.size();
+            materials.push_back(*m);
+        }
+        return m->id;
     }
-    vec3 generate(const ray &r_in, const hit_record &rec)
-    {
-        return random_pdf().generate();
-    };
-    float value(const ray &r, const hit_record &rec, const vec3 &direction)
+    const material &operator[](int id) const
     {
-        return random_pdf().value(direction);
+        return materials[id];
     }
-    texture *albedo;
-    vec3 emission;
-    std::string name;
+    std::vector<material> materials;
 };
+
+material_table &scene_materials()
+{
+    static material_table table;
+    return table;
+}
+
+// what primitives store in place of a material pointer. -1 for none, like the boundary of a volume
+inline int material_id(material *m)
+{
+    return m == nullptr ? -1 : scene_materials().add(m);
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "helpers.h"
+#include "vec3.h"
+
+// isotropic GGX (Trowbridge-Reitz) microfacet distribution, in a local frame where the macro normal is +z.
+// directions point away from the surface on both sides, as in Walter et al. 2007 and pbrt.
+
+// below this alpha a lobe is treated as perfectly smooth, since its peak would be too narrow to sample or evaluate in floats
+#define GGX_SMOOTH_ALPHA 0.001f
+
+// perceptual roughness, which is what scene files specify, to the alpha of the distribution
+inline float roughness_to_alpha(float roughness)
+{
+    return roughness * roughness;
+}
+
+inline float ggx_d(const vec3 &m, float alpha)
+{
+    float a2 = alpha * alpha;
+    float cos2 = m.z() * m.z();
+    float denom = cos2 * (a2 - 1) + 1;
+    return a2 / (M_PI * denom * denom);
+}
+
+// Smith's auxiliary function, for the height correlated masking-shadowing term
+inline float ggx_lambda(const vec3 &w, float alpha)
+{
+    float cos2 = w.z() * w.z();
+    if (cos2 <= 0)
+    {
+        return 0;
+    }
+    float tan2 = fmax(0.0f, 1 - cos2) / cos2;
+    return (-1 + sqrt(1 + alpha * alpha * tan2)) / 2;
+}
+
+inline float ggx_g1(const vec3 &w, float alpha)
+{
+    return 1 / (1 + ggx_lambda(w, alpha));
+}
+
+inline float ggx_g(const vec3 &wo, const vec3 &wi, float alpha)
+{
+    return 1 / (1 + ggx_lambda(wo, alpha) + ggx_lambda(wi, alpha));
+}
+
+// density of the normals visible from wo, which is what ggx_sample_visible_normal draws from
+inline float ggx_visible_normal_pdf(const vec3 &wo, const vec3 &m, float alpha)
+{
+    float cos_o = fabs(wo.z());
+    if (cos_o == 0)
+    {
+        return 0;
+    }
+    return ggx_g1(wo, alpha) / cos_o * ggx_d(m, alpha) * fabs(dot(wo, m));
+}
+
+// samples a microfacet normal proportionally to how much of it wo sees (Heitz 2018), so directions follow the shape of the lobe
+// and no samples are wasted on facets that face away. the result is in the +z hemisphere
+inline vec3 ggx_sample_visible_normal(const vec3 &wo, float alpha, float u, float v)
+{
+    // stretch the view direction so that the distribution becomes a hemisphere
+    vec3 wh = unit_vector(vec3(alpha * wo.x(), alpha * wo.y(), wo.z()));
+    if (wh.z() < 0)
+    {
+        wh = -wh;
+    }
+    float lensq = wh.x() * wh.x() + wh.y() * wh.y();
+    vec3 t1 = lensq > 0 ? vec3(-wh.y(), wh.x(), 0) / sqrt(lensq) : vec3(1, 0, 0);
+    vec3 t2 = cross(wh, t1);
+    // a point on the projected disk, warped towards the part that's visible
+    float r = sqrt(u);
+    float phi = 2 * M_PI * v;
+    float p1 = r * cos(phi);
+    float p2 = r * sin(phi);
+    float s = 0.5f * (1 + wh.z());
+    p2 = (1 - s) * sqrt(fmax(0.0f, 1 - p1 * p1)) + s * p2;
+    vec3 nh = p1 * t1 + p2 * t2 + sqrt(fmax(0.0f, 1 - p1 * p1 - p2 * p2)) * wh;
+    // and unstretch
+    return unit_vector(vec3(alpha * nh.x(), alpha * nh.y(), fmax(1e-6f, nh.z())));
+}
+
+// unpolarized fresnel reflectance of a dielectric interface. eta is the index on the far side of the normal over the near side,
+// and cos_i is signed, negative when arriving from the far side
+inline float fresnel_dielectric(float cos_i, float eta)
+{
+    cos_i = clamp(cos_i, -1.0f, 1.0f);
+    if (cos_i < 0)
+    {
+        eta = 1 / eta;
+        cos_i = -cos_i;
+    }
+    float sin2_t = (1 - cos_i * cos_i) / (eta * eta);
+    if (sin2_t >= 1)
+    {
+        // total internal reflection
+        return 1;
+    }
+    float cos_t = sqrt(fmax(0.0f, 1 - sin2_t));
+    float r_parallel = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+    float r_perpendicular = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+    return (r_parallel * r_parallel + r_perpendicular * r_perpendicular) / 2;
+}
+
+// Schlick's approximation for conductors, with the color at normal incidence as f0
+inline vec3 fresnel_schlick(const vec3 &f0, float cos_i)
+{
+    float m = clamp(1 - cos_i, 0.0f, 1.0f);
+    float m5 = m * m * m * m * m;
+    return f0 + (vec3(1, 1, 1) - f0) * m5;
+}
+
+// refracts wi (pointing away from the surface) through normal n. eta is as in fresnel_dielectric.
+// false on total internal reflection
+inline bool refract_direction(const vec3 &wi, vec3 n, float eta, vec3 &wt)
+{
+    float cos_i = dot(n, wi);
+    if (cos_i < 0)
+    {
+        eta = 1 / eta;
+        cos_i = -cos_i;
+        n = -n;
+    }
+    float sin2_t = fmax(0.0f, 1 - cos_i * cos_i) / (eta * eta);
+    if (sin2_t >= 1)
+    {
+        return false;
+    }
+    float cos_t = sqrt(1 - sin2_t);
+    wt = -wi / eta + (cos_i / eta - cos_t) * n;
+    return true;
+}
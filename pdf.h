@@ -31,6 +31,10 @@ public:
     {
         return uvw.local(random_cosine_direction());
     }
+    vec3 generate(float u, float v) const
+    {
+        return uvw.local(random_cosine_direction(u, v));
+    }
     onb uvw;
 };
 
@@ -46,6 +50,10 @@ public:
     {
         return random_in_unit_sphere();
     }
+    vec3 generate(float u, float v) const
+    {
+        return random_on_unit_sphere(u, v);
+    }
 };
 
 class hittable_pdf : public pdf
@@ -76,6 +84,10 @@ public:
     {
         return random_in_unit_sphere();
     }
+    vec3 generate(float u, float v) const
+    {
+        return random_on_unit_sphere(u, v);
+    }
 };
 
 class mixture_pdf : public pdf
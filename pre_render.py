@@ -12,6 +12,9 @@ if __name__ == "__main__":
     output_paths.append(data["png_output_path"])
     output_paths.append(data["traced_paths_output_path"])
     output_paths.append(data["traced_paths_2d_output_path"])
+    for key in ["pfm_output_path", "exr_output_path"]:
+        if data.get(key):
+            output_paths.append(data[key])
 
     for output_path in output_paths:
         directory, filename = os.path.split(output_path)
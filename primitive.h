@@ -1,8 +1,10 @@
 #pragma once
+#include "animation.h"
 #include "bvh.h"
 #include "scene.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 #include "ray.h"
 #include "transform3.h"
 #include "vec3.h"
@@ -30,24 +32,50 @@ public:
     sphere() {}
 
     sphere(vec3 cen, float r, material *m)
-        : center(cen), radius(r), mat_ptr(m){};
+        : center(cen), radius(r), mat_id(material_id(m)){};
 
     virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+    virtual bool hit_interval(const ray &r, float t_min, float t_max, float &t0, float &t1) const;
     virtual bool bounding_box(float t0, float t1, aabb &box) const;
     virtual float pdf_value(const vec3 &o, const vec3 &v) const
     {
-        hit_record rec;
-        if (this->hit(ray(o, v), 0.001, FLT_MAX, rec))
+        vec3 to_center = center - o;
+        float distance_squared = to_center.squared_length();
+        if (distance_squared <= radius * radius)
         {
-            float cos_theta_max = sqrt(1 - radius * radius / (center - o).squared_length());
-            float solid_angle = 2 * M_PI * (1 - cos_theta_max);
-            return 1 / solid_angle;
+            // inside the sphere, every direction hits it
+            hit_record rec;
+            if (this->hit(ray(o, v), 0.001, FLT_MAX, rec))
+            {
+                return pdf_from_hit(o, rec);
+            }
+            return 0;
+        }
+        // outside, v hits the sphere iff it lies within the cone subtended by it
+        float cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+        float cosine = dot(unit_vector(v), to_center) / sqrt(distance_squared);
+        if (cosine >= cos_theta_max)
+        {
+            return 1 / (2 * M_PI * (1 - cos_theta_max));
         }
         else
         {
             return 0;
         }
     }
+    virtual float pdf_from_hit(const vec3 &o, const hit_record &rec) const
+    {
+        float distance_squared = (center - o).squared_length();
+        if (distance_squared <= radius * radius)
+        {
+            // sampled uniformly by area
+            vec3 d = rec.p - o;
+            float cosine = fabs(dot(rec.normal, unit_vector(d)));
+            return d.squared_length() / (cosine * 4 * M_PI * radius * radius);
+        }
+        float cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+        return 1 / (2 * M_PI * (1 - cos_theta_max));
+    }
     virtual vec3 random(const vec3 &o) const
     {
         vec3 direction = center - o;
@@ -56,9 +84,50 @@ public:
         uvw.build_from_w(direction);
         return uvw.local(random_to_sphere(radius, distance_squared));
     }
+    virtual bool sample(const vec3 &o, float time, float u, float v, light_sample &sample) const
+    {
+        vec3 to_center = center - o;
+        float distance_squared = to_center.squared_length();
+        if (distance_squared <= radius * radius)
+        {
+            // inside the sphere, fall back to sampling uniformly by area
+            sample.normal = random_on_unit_sphere(u, v);
+            sample.p = center + radius * sample.normal;
+            vec3 d = sample.p - o;
+            float cosine = fabs(dot(sample.normal, unit_vector(d)));
+            if (cosine == 0)
+            {
+                return false;
+            }
+            sample.distance = d.length();
+            sample.pdf = d.squared_length() / (cosine * 4 * M_PI * radius * radius);
+        }
+        else
+        {
+            // sample a direction in the cone subtended by the sphere, then compute the point it hits analytically
+            float sin_theta_max2 = radius * radius / distance_squared;
+            float sin_theta_max = sqrt(sin_theta_max2);
+            float cos_theta_max = sqrt(fmax(0.0f, 1 - sin_theta_max2));
+            float cos_theta = 1 + u * (cos_theta_max - 1);
+            float sin_theta2 = 1 - cos_theta * cos_theta;
+            float cos_alpha = sin_theta2 / sin_theta_max + cos_theta * sqrt(fmax(0.0f, 1 - sin_theta2 / sin_theta_max2));
+            float sin_alpha = sqrt(fmax(0.0f, 1 - cos_alpha * cos_alpha));
+            float phi = TAU * v;
+            onb uvw;
+            uvw.build_from_w(to_center);
+            sample.normal = -uvw.local(sin_alpha * cos(phi), sin_alpha * sin(phi), cos_alpha);
+            sample.p = center + radius * sample.normal;
+            sample.distance = (sample.p - o).length();
+            sample.pdf = 1 / (2 * M_PI * (1 - cos_theta_max));
+        }
+        sample.u = 0;
+        sample.v = 0;
+        sample.material_id = mat_id;
+        return true;
+    }
     vec3 center;
     float radius;
-    material *mat_ptr;
+    int mat_id;
 };
 
 bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
@@ -76,7 +145,9 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            // spheres have no uv parametrization yet
+            rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+            rec.material_id = mat_id;
             rec.primitive = (hittable *)this;
             return true;
         }
@@ -86,7 +157,8 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+            rec.material_id = mat_id;
             rec.primitive = (hittable *)this;
             return true;
         }
@@ -94,6 +166,23 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
     return false;
 }
 
+bool sphere::hit_interval(const ray &r, float t_min, float t_max, float &t0, float &t1) const
+{
+    vec3 oc = r.origin() - center;
+    float a = dot(r.direction(), r.direction());
+    float b = dot(oc, r.direction());
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b * b - a * c;
+    if (discriminant <= 0)
+    {
+        return false;
+    }
+    float root = sqrt(discriminant);
+    t0 = ffmax((-b - root) / a, t_min);
+    t1 = ffmin((-b + root) / a, t_max);
+    return t0 < t1;
+}
+
 bool sphere::bounding_box(float t0, float t1, aabb &box) const
 {
     box = aabb(center - vec3(radius, radius, radius),
@@ -125,7 +214,7 @@ class rect : public hittable
 public:
     rect() {}
     rect(float _x0, float _z0, float _x1, float _z1, float _y, material *mat, plane_enum type = XZ, bool flipped = false)
-        : x0(_x0), z0(_z0), x1(_x1), z1(_z1), y(_y), mp(mat), type(type), normal(!flipped)
+        : x0(_x0), z0(_z0), x1(_x1), z1(_z1), y(_y), mat_id(material_id(mat)), type(type), normal(!flipped)
     {
         // std::cout << "constructor called with " << type << '\n';
     }
@@ -158,17 +247,21 @@ public:
         hit_record rec;
         if (this->hit(ray(o, v), 0.001, FLT_MAX, rec))
         {
-            float area = (x1 - x0) * (z1 - z0);
-            float vlen = v.length();
-            float distance_squared = powf(rec.t * vlen, 2.0);
-            float cosine = fabs(dot(v, rec.normal) / vlen);
-            return distance_squared / (cosine * area);
+            return pdf_from_hit(o, rec);
         }
         else
         {
             return 0;
         }
     }
+    virtual float pdf_from_hit(const vec3 &o, const hit_record &rec) const
+    {
+        float area = (x1 - x0) * (z1 - z0);
+        vec3 d = rec.p - o;
+        float distance_squared = d.squared_length();
+        float cosine = fabs(dot(d, rec.normal)) / sqrt(distance_squared);
+        return distance_squared / (cosine * area);
+    }
     virtual vec3 random(const vec3 &o) const
     {
         vec3 random_point = shuffle(vec3(x0 + random_double() * (x1 - x0), y,
@@ -176,7 +269,30 @@ public:
                                     type);
         return random_point - o;
     }
-    material *mp;
+    virtual bool sample(const vec3 &o, float time, float u, float v, light_sample &sample) const
+    {
+        sample.u = u;
+        sample.v = v;
+        sample.p = shuffle(vec3(x0 + sample.u * (x1 - x0), y, z0 + sample.v * (z1 - z0)), type);
+        sample.normal = shuffle(vec3(0, 2 * normal - 1, 0), type);
+        vec3 d = sample.p - o;
+        if (two_sided && dot(d, sample.normal) > 0)
+        {
+            // face the normal towards o, like hit does
+            sample.normal = -sample.normal;
+        }
+        float distance_squared = d.squared_length();
+        sample.distance = sqrt(distance_squared);
+        float cosine = fabs(dot(d, sample.normal)) / sample.distance;
+        if (cosine == 0)
+        {
+            return false;
+        }
+        sample.pdf = distance_squared / (cosine * (x1 - x0) * (z1 - z0));
+        sample.material_id = mat_id;
+        return true;
+    }
+    int mat_id;
     bool normal;
     bool two_sided = true;
     float x0, z0, x1, z1, y;
@@ -204,9 +320,11 @@ bool rect::hit(const ray &r, float t0, float t1, hit_record &rec) const
         return false;
     }
     rec.u = (xh - x0) / (x1 - x0);
-    rec.v = (zh - x0) / (z1 - z0);
+    rec.v = (zh - z0) / (z1 - z0);
+    rec.dpdu = shuffle(vec3(x1 - x0, 0, 0), type);
+    rec.dpdv = shuffle(vec3(0, 0, z1 - z0), type);
     rec.t = t;
-    rec.mat_ptr = mp;
+    rec.material_id = mat_id;
 
     rec.p = r.point_at_parameter(t);
 
@@ -244,6 +362,29 @@ public:
     {
         return group->hit(r, t0, t1, rec);
     }
+    // slab test against the corners, the same as aabb::hit
+    virtual bool hit_interval(const ray &r, float t_min, float t_max, float &t0, float &t1) const
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            float invD = 1.0f / r.direction()[a];
+            float near = (p0[a] - r.origin()[a]) * invD;
+            float far = (p1[a] - r.origin()[a]) * invD;
+            if (invD < 0.0f)
+            {
+                std::swap(near, far);
+            }
+            t_min = near > t_min ? near : t_min;
+            t_max = far < t_max ? far : t_max;
+            if (t_max <= t_min)
+            {
+                return false;
+            }
+        }
+        t0 = t_min;
+        t1 = t_max;
+        return true;
+    }
     virtual bool bounding_box(float t0, float t1, aabb &box) const
     {
         // box = aabb(p0, p1);
@@ -255,19 +396,155 @@ public:
     vec3 p0, p1;
 };
 
+// bounds of a moving instance are fit to where it is at this many times across the shutter
+#define MOTION_BOUNDS_STEPS 32
+
 class instance : public hittable
 {
 public:
     instance(hittable *p) : ptr(p)
     {
         transform = transform3();
+        inverse_transform = transform3();
         hasbbox = ptr->bounding_box(0, 1, bbox);
     }
-    instance(hittable *p, transform3 transform) : ptr(p), transform(transform)
+    instance(hittable *p, transform3 transform) : ptr(p)
+    {
+        set_transform(transform);
+    }
+    // for instances that move between frames. the bvh above has to be refit after
+    void set_transform(transform3 transform)
+    {
+        moving = false;
+        this->transform = transform;
+        inverse_transform = transform.inverse();
+        hasbbox = bounds_under(transform, bbox);
+    }
+    // moves the instance from start at shutter open (ray time 0) to end at shutter close (ray time 1), for motion blur.
+    // rays are intersected with it where it is at their time. the bounds at both ends are grown until the bounds interpolated between them
+    // hold it at every one of MOTION_BOUNDS_STEPS times in between, which rotations need. with swept set both are the box around the
+    // whole motion instead, for comparing against a bvh that doesn't know about time. the bvh above has to be refit after
+    void set_motion(keyframe start, keyframe end, bool swept)
+    {
+        set_transform(to_transform(start));
+        if ((end.scale - start.scale).squared_length() == 0 && (end.rotate - start.rotate).squared_length() == 0 && (end.translate - start.translate).squared_length() == 0)
+        {
+            return;
+        }
+        moving = true;
+        shutter[0] = start;
+        shutter[1] = end;
+        aabb open = bbox, close;
+        bounds_under(to_transform(end), close);
+        aabb all = surrounding_box(open, close);
+        vec3 grow_min(0, 0, 0), grow_max(0, 0, 0);
+        for (int k = 1; k < MOTION_BOUNDS_STEPS; k++)
+        {
+            float t = float(k) / MOTION_BOUNDS_STEPS;
+            aabb at_t, interpolated = lerp(open, close, t);
+            bounds_under(to_transform(interpolate(start, end, t)), at_t);
+            all = surrounding_box(all, at_t);
+            for (int c = 0; c < 3; c++)
+            {
+                grow_min[c] = ffmax(grow_min[c], interpolated.min()[c] - at_t.min()[c]);
+                grow_max[c] = ffmax(grow_max[c], at_t.max()[c] - interpolated.max()[c]);
+            }
+        }
+        if (swept)
+        {
+            bbox = end_bbox = all;
+            return;
+        }
+        // moving both ends out moves the interpolated bounds out by as much at every time
+        bbox = aabb(open.min() - grow_min, open.max() + grow_max);
+        end_bbox = aabb(close.min() - grow_min, close.max() + grow_max);
+    }
+    // where the instance is at a ray's time
+    transform3 transform_at(float time) const
+    {
+        return to_transform(interpolate(shutter[0], shutter[1], time));
+    }
+
+    virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+    {
+        if (moving)
+        {
+            transform3 moved = transform_at(r.time());
+            return hit_under(r, t_min, t_max, rec, moved, moved.inverse());
+        }
+        return hit_under(r, t_min, t_max, rec, transform, inverse_transform);
+    }
+
+    // the transform is applied to the direction without normalizing it, so ray parameters are the same in both spaces
+    virtual bool hit_interval(const ray &r, float t_min, float t_max, float &t0, float &t1) const
+    {
+        return ptr->hit_interval(r.apply(moving ? transform_at(r.time()).inverse() : inverse_transform), t_min, t_max, t0, t1);
+    }
+    virtual float transmittance(const ray &r, float t_min, float t_max) const
+    {
+        return ptr->transmittance(r.apply(moving ? transform_at(r.time()).inverse() : inverse_transform), t_min, t_max);
+    }
+
+    // the box around everything the instance covers while the shutter is open
+    virtual bool bounding_box(float t0, float t1, aabb &box) const
+    {
+        box = moving ? surrounding_box(bbox, end_bbox) : bbox;
+        return hasbbox;
+    }
+    virtual bool motion_bounds(aabb &start, aabb &end) const
+    {
+        start = bbox;
+        end = moving ? end_bbox : bbox;
+        return moving;
+    }
+    // these two are where the instance is at shutter open
+    virtual float pdf_value(const vec3 &o, const vec3 &v) const
+    {
+        // inverse transform to local space
+        return ptr->pdf_value(inverse_transform * o, inverse_transform.apply_linear(v));
+    }
+    virtual vec3 random(const vec3 &o) const
+    {
+        // inverse transform
+        return transform.apply_linear(ptr->random(inverse_transform * o));
+    }
+    virtual bool sample(const vec3 &o, float time, float u, float v, light_sample &sample) const
+    {
+        if (moving)
+        {
+            transform3 moved = transform_at(time);
+            return sample_under(o, time, u, v, sample, moved, moved.inverse());
+        }
+        return sample_under(o, time, u, v, sample, transform, inverse_transform);
+    }
+    virtual float pdf_from_hit(const vec3 &o, const hit_record &rec) const
+    {
+        if (moving)
+        {
+            transform3 moved = transform_at(rec.time);
+            return pdf_from_hit_under(o, rec, moved, moved.inverse());
+        }
+        return pdf_from_hit_under(o, rec, transform, inverse_transform);
+    }
+
+    transform3 transform;
+    transform3 inverse_transform;
+    aabb bbox;
+    bool hasbbox;
+    hittable *ptr;
+    // set by set_motion. bbox is then the bounds at shutter open, and end_bbox the ones at shutter close
+    bool moving = false;
+    keyframe shutter[2];
+    aabb end_bbox;
+
+private:
+    // the box around ptr's box with its corners moved by to_world, false when ptr has none
+    bool bounds_under(const transform3 &to_world, aabb &box) const
     {
         vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
         vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-        hasbbox = ptr->bounding_box(0, 1, bbox);
+        aabb local;
+        bool has_box = ptr->bounding_box(0, 1, local);
         // narrow down the bounding box based on the transform
         for (int i = 0; i < 2; i++)
         {
@@ -275,10 +552,10 @@ public:
             {
                 for (int k = 0; k < 2; k++)
                 {
-                    float x = i * bbox.max().x() + (1 - i) * bbox.min().x();
-                    float y = j * bbox.max().y() + (1 - j) * bbox.min().y();
-                    float z = k * bbox.max().z() + (1 - k) * bbox.min().z();
-                    vec3 tester = transform * vec3(x, y, z);
+                    float x = i * local.max().x() + (1 - i) * local.min().x();
+                    float y = j * local.max().y() + (1 - j) * local.min().y();
+                    float z = k * local.max().z() + (1 - k) * local.min().z();
+                    vec3 tester = to_world * vec3(x, y, z);
                     for (int c = 0; c < 3; c++)
                     {
                         if (tester[c] > max[c])
@@ -293,16 +570,20 @@ public:
                 }
             }
         }
-        bbox = aabb(min, max);
+        box = aabb(min, max);
+        return has_box;
     }
-    virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+    bool hit_under(const ray &r, float t_min, float t_max, hit_record &rec, const transform3 &to_world, const transform3 &to_local) const
     {
-        const ray local = r.apply(transform.inverse());
+        const ray local = r.apply(to_local);
         if (ptr->hit(local, t_min, t_max, rec))
         {
-            rec.p = transform * rec.p;
-            rec.normal = transform.apply_normal(rec.normal);
+            rec.p = to_world * rec.p;
+            rec.normal = to_world.apply_normal(rec.normal);
+            rec.dpdu = to_world.apply_linear(rec.dpdu);
+            rec.dpdv = to_world.apply_linear(rec.dpdv);
             rec.primitive = (hittable *)this;
+            rec.time = r.time();
             return true;
         }
         else
@@ -310,39 +591,45 @@ public:
             return false;
         }
     }
-
-    virtual bool bounding_box(float t0, float t1, aabb &box) const
+    bool sample_under(const vec3 &o, float time, float u, float v, light_sample &sample, const transform3 &to_world, const transform3 &to_local) const
     {
-        box = bbox;
-        return hasbbox;
+        vec3 local_o = to_local * o;
+        light_sample local;
+        if (!ptr->sample(local_o, time, u, v, local))
+        {
+            return false;
+        }
+        sample = local;
+        sample.p = to_world * local.p;
+        sample.normal = to_world.apply_normal(local.normal);
+        sample.distance = (sample.p - o).length();
+        sample.pdf = to_world_pdf(local.pdf, local_o, local.p, local.normal, o, sample.p, sample.normal, to_world);
+        return sample.pdf > 0;
     }
-    virtual float pdf_value(const vec3 &o, const vec3 &v) const
+    float pdf_from_hit_under(const vec3 &o, const hit_record &rec, const transform3 &to_world, const transform3 &to_local) const
     {
-        // hit_record rec;
-        // if (this->hit(ray(o, v), 0.001, FLT_MAX, rec))
-        // {
-        //     float area = (x1 - x0) * (z1 - z0);
-        //     float vlen = v.length();
-        //     float distance_squared = powf(rec.t * vlen, 2.0);
-        //     float cosine = fabs(dot(v, rec.normal) / vlen);
-        //     return distance_squared / (cosine * area);
-        // }
-        // else
-        // {
-        //     return 0;
-        // }
-
-        // inverse transform to local space
-        return ptr->pdf_value(transform.inverse() * o, transform.inverse().apply_linear(v));
+        vec3 local_o = to_local * o;
+        hit_record local = rec;
+        local.p = to_local * rec.p;
+        local.normal = to_local.apply_normal(rec.normal);
+        float local_pdf = ptr->pdf_from_hit(local_o, local);
+        return to_world_pdf(local_pdf, local_o, local.p, local.normal, o, rec.p, rec.normal, to_world);
     }
-    virtual vec3 random(const vec3 &o) const
+    // converts a solid angle pdf in local space to one in world space by going through area measure,
+    // since solid angles are not preserved under non-uniform scales.
+    float to_world_pdf(float local_pdf, const vec3 &local_o, const vec3 &local_p, const vec3 &local_normal, const vec3 &o, const vec3 &p, const vec3 &normal, const transform3 &to_world) const
     {
-        // inverse transform
-        return transform.apply_linear(ptr->random(transform.inverse() * o));
+        vec3 local_d = local_p - local_o;
+        vec3 d = p - o;
+        float local_distance_squared = local_d.squared_length();
+        float distance_squared = d.squared_length();
+        float local_cosine = fabs(dot(local_normal, local_d)) / sqrt(local_distance_squared);
+        float cosine = fabs(dot(normal, d)) / sqrt(distance_squared);
+        if (local_cosine == 0 || cosine == 0)
+        {
+            return 0;
+        }
+        float area_pdf = local_pdf * local_cosine / local_distance_squared / to_world.area_scale(local_normal);
+        return area_pdf * distance_squared / cosine;
     }
-
-    transform3 transform;
-    aabb bbox;
-    bool hasbbox;
-    hittable *ptr;
 };
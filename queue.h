@@ -41,6 +41,19 @@ public:
         return val;
     }
 
+    // takes the front element if there is one, without waiting
+    bool try_dequeue(T &t)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (q.empty())
+        {
+            return false;
+        }
+        t = q.front();
+        q.pop();
+        return true;
+    }
+
     bool empty(void)
     {
         return q.empty();
@@ -56,7 +69,10 @@ private:
 class Spiral
 {
 public:
+    virtual ~Spiral() {}
     virtual std::pair<std::pair<int, int>, std::pair<int, int>> next() = 0;
+    // false once every block was handed out. unlike checking is_empty before next, this never waits on a block another thread took
+    virtual bool try_next(std::pair<std::pair<int, int>, std::pair<int, int>> &block) = 0;
     virtual bool is_empty() = 0;
 
     SafeQueue<std::pair<int, int>> queue;
@@ -120,7 +136,20 @@ public:
     }
     std::pair<std::pair<int, int>, std::pair<int, int>> next()
     {
-        std::pair<int, int> topleft_in_block_coordinates = queue.dequeue();
+        return block_at(queue.dequeue());
+    }
+    bool try_next(std::pair<std::pair<int, int>, std::pair<int, int>> &block)
+    {
+        std::pair<int, int> topleft_in_block_coordinates;
+        if (!queue.try_dequeue(topleft_in_block_coordinates))
+        {
+            return false;
+        }
+        block = block_at(topleft_in_block_coordinates);
+        return true;
+    }
+    std::pair<std::pair<int, int>, std::pair<int, int>> block_at(std::pair<int, int> topleft_in_block_coordinates)
+    {
         std::pair<int, int> topleft = std::pair<int, int>(topleft_in_block_coordinates.first * block_width, topleft_in_block_coordinates.second * block_height);
         std::pair<int, int> bottomright = std::pair<int, int>(min(topleft.first + block_width, width), min(topleft.second + block_height, height));
         return std::pair<std::pair<int, int>, std::pair<int, int>>(topleft, bottomright);
@@ -4,7 +4,7 @@
 #include <random>
 #include "vec3.h"
 
-#define TAU 2 * M_PI
+#define TAU (2 * M_PI)
 
 inline double random_double()
 {
@@ -23,19 +23,29 @@ inline vec3 random_in_unit_sphere()
     return vec3(cos(u) * sin(v) * w, cos(v) * w, sin(u) * sin(v) * w);
 }
 
-inline vec3 random_in_unit_disk()
+inline vec3 random_in_unit_disk(float u, float v)
 {
-    float u, v;
-    u = random_double() * TAU;
-    v = powf(random_double(), 1.0 / 2.0);
+    u = u * TAU;
+    v = powf(v, 1.0 / 2.0);
     vec3 p = vec3(cos(u) * v, sin(u) * v, 0);
     return p;
 }
 
-inline vec3 random_cosine_direction()
+inline vec3 random_in_unit_disk()
+{
+    return random_in_unit_disk(random_double(), random_double());
+}
+
+inline vec3 random_on_unit_sphere(float u, float v)
+{
+    float z = 1 - 2 * v;
+    float r = sqrt(fmax(0.0f, 1 - z * z));
+    float phi = TAU * u;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline vec3 random_cosine_direction(float r1, float r2)
 {
-    float r1 = random_double();
-    float r2 = random_double();
     float z = sqrt(1 - r2);
     float phi = 2 * M_PI * r1;
     float x = cos(phi) * sqrt(r2);
@@ -43,6 +53,11 @@ inline vec3 random_cosine_direction()
     return vec3(x, y, z);
 }
 
+inline vec3 random_cosine_direction()
+{
+    return random_cosine_direction(random_double(), random_double());
+}
+
 inline vec3 random_to_sphere(float radius, float distance_squared)
 {
     float r1 = random_double();
@@ -5,8 +5,8 @@
 class ray
 {
 public:
-    ray() {}
-    ray(const vec3 &a, const vec3 &b, float ti = 0.0)
+    ray() : has_differentials(false) {}
+    ray(const vec3 &a, const vec3 &b, float ti = 0.0) : has_differentials(false)
     {
         A = a;
         B = b;
@@ -26,5 +26,10 @@ public:
     vec3 A;
     vec3 B;
     float _time;
+    // rays through the neighbouring pixels in x and y, for working out how much of a texture a pixel covers (Igehy 1999).
+    // camera rays have them, and specular bounces keep them. they're in world space, transforms don't carry them
+    bool has_differentials;
+    vec3 rx_origin, rx_direction;
+    vec3 ry_origin, ry_direction;
 };
 
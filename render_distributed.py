@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# renders the frame in config.json with several worker processes that share a job directory, then merges what they rendered.
+# workers on other machines can help by running ./main.exe --worker on the same directory, if it's on a shared filesystem
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-n", "--workers", type=int, default=2, help="how many worker processes to start")
+parser.add_argument("-d", "--directory", type=str, default="output/job", help="job directory, emptied first")
+parser.add_argument("-e", "--executable", type=str, default="./main.exe")
+
+if __name__ == "__main__":
+    args = parser.parse_args()
+    shutil.rmtree(args.directory, ignore_errors=True)
+    os.makedirs(args.directory)
+
+    workers = []
+    for n in range(args.workers):
+        log = open(os.path.join(args.directory, "worker_{}.log".format(n)), "w")
+        workers.append(subprocess.Popen([args.executable, "--worker", args.directory], stdout=log, stderr=subprocess.STDOUT))
+    failed = 0
+    for n, worker in enumerate(workers):
+        if worker.wait() != 0:
+            print("worker process {} exited with {}".format(n, worker.returncode))
+            failed += 1
+    # whatever the failed ones saved before they stopped is still merged
+    result = subprocess.run([args.executable, "--merge", args.directory])
+    sys.exit(result.returncode or failed > 0)
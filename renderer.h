@@ -10,9 +10,24 @@
 #include "config.h"
 // for output_to_file
 #include "tonemap.h"
+// for write_linear_outputs
+#include "hdr_output.h"
+// for write_image
+#include "png_output.h"
+// for the aov buffers
+#include "aov.h"
+// for final_image
+#include "denoiser.h"
+// for pixel filters and splats
+#include "film.h"
 // for Tiled
 #include "queue.h"
+#include "sampler.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <thread>
 #include <fstream>
 #include <mutex>
@@ -21,14 +36,13 @@
 
 using json = nlohmann::json;
 
-void output_to_file(std::shared_ptr<std::ofstream> output, vec3 **buffer, int width, int height, int samples, float max_luminance, float exposure, float gamma)
+// the 8 bit rgb image, rows top to bottom
+std::vector<unsigned char> tonemap_to_rgb(vec3 **buffer, int width, int height, int samples, float max_luminance, float exposure, float gamma)
 {
-    output->seekp(0);
-    // output file
-    (*output) << "P6\n"
-              << width << " " << height << "\n255\n";
+    std::vector<unsigned char> rgb(3 * (size_t)width * height);
     for (int j = height - 1; j >= 0; j--)
     {
+        unsigned char *row = &rgb[3 * (size_t)(height - 1 - j) * width];
         for (int i = 0; i < width; i++)
         {
             vec3 col = buffer[j][i];
@@ -48,9 +62,21 @@ void output_to_file(std::shared_ptr<std::ofstream> output, vec3 **buffer, int wi
             unsigned char ig = int(col[1]);
             // unsigned char ib = clamp<float>(255 * powf(col[2], gamma), 0, 255);
             unsigned char ib = int(col[2]);
-            (*output) << ir << ig << ib;
+            row[3 * i + 0] = ir;
+            row[3 * i + 1] = ig;
+            row[3 * i + 2] = ib;
         }
     }
+    return rgb;
+}
+
+void write_ppm(std::shared_ptr<std::ofstream> output, const std::vector<unsigned char> &rgb, int width, int height)
+{
+    output->seekp(0);
+    // output file
+    (*output) << "P6\n"
+              << width << " " << height << "\n255\n";
+    output->write((const char *)rgb.data(), rgb.size());
     output->flush();
 }
 
@@ -95,6 +121,32 @@ void handle_traced_paths(std::string output_path, std::string output_2d_path, ca
     traced_paths_output2d.close();
 }
 
+// starts sample `sample_index` of pixel (i, j) and generates its camera ray.
+// the first 5 sampler dimensions of a path go to the pixel position, lens and time.
+// the ray differentials span the part of the pixel that one sample stands for, so texture filtering blurs less as samples add up
+// position is where on the film the ray starts. it's importance sampled from filter around the pixel when there is one,
+// and uniform within the pixel when there isn't
+ray generate_camera_ray(camera &cam, int width, int height, Sampler *sampler, int i, int j, int sample_index, const pixel_filter *filter, film_sample &position)
+{
+    sampler->start_pixel(i, j, sample_index);
+    float jitter_x, jitter_y, lens_u, lens_v;
+    sampler->get_2d(jitter_x, jitter_y);
+    sampler->get_2d(lens_u, lens_v);
+    float time_u = sampler->get_1d();
+    position = filter != nullptr ? filter->sample(i, j, jitter_x, jitter_y) : film_sample{i + jitter_x, j + jitter_y, 1.0f};
+    float u = position.x / float(width);
+    float v = position.y / float(height);
+    float footprint = std::max(0.125f, 1 / sqrtf((float)sampler->samples_per_pixel));
+    return cam.get_ray_differential(u, v, footprint / width, footprint / height, lens_u, lens_v, time_u);
+}
+
+// a sample that stays in its pixel, for callers that don't filter
+ray generate_camera_ray(camera &cam, int width, int height, Sampler *sampler, int i, int j, int sample_index)
+{
+    film_sample position;
+    return generate_camera_ray(cam, width, height, sampler, i, j, sample_index, nullptr, position);
+}
+
 void print_out_progress(long num_samples_done, long num_samples_left, std::chrono::high_resolution_clock::time_point start_time)
 {
     auto intermediate = std::chrono::high_resolution_clock::now();
@@ -126,19 +178,320 @@ public:
         this->cam = cam;
         this->integrator = integrator;
         this->output = std::make_shared<std::ofstream>(std::ofstream(config.ppm_output_path));
+        if (!config.png_output_path.empty())
+        {
+            png = std::make_shared<png_writer>();
+        }
         ;
 
         // create framebuffer
         framebuffer = array_2d<vec3>(film.width, film.height);
+        // each thread renders with its own clone of this
+        sampler = make_sampler(config.sampler_type, config.samples);
+        sample_counts = array_2d<int>(film.width, film.height);
+        resumed_samples = array_2d<int>(film.width, film.height);
+        filter = new pixel_filter(config.pixel_filter, config.pixel_filter_radius, film.width, film.height);
+        if (config.pixel_filter_splatting)
+        {
+            splats = new splat_buffer(filter, film.width, film.height, config.threads);
+        }
+        samples_to_render = (long)config.samples * film.total_pixels;
+        last_checkpoint_time = std::chrono::high_resolution_clock::now();
     };
-    virtual void preprocess() = 0;
+    // after finalize, when the render threads are done. frames of a sequence get a renderer each
+    virtual ~Renderer()
+    {
+        delete_2d(framebuffer, film.height);
+        delete_2d(sample_counts, film.height);
+        delete_2d(resumed_samples, film.height);
+        delete sampler;
+        delete splats;
+        delete filter;
+        delete aovs;
+    }
+    // trains path guiding, if the integrator has it, on iterations of 1, 2, 4, ... spp over the whole image.
+    // each iteration samples from what the previous one learned. the training images are thrown away.
+    virtual void preprocess()
+    {
+        path_guide *guide = integrator->guide;
+        if (guide == nullptr)
+        {
+            return;
+        }
+        auto training_start = std::chrono::high_resolution_clock::now();
+        int budget = config.guiding_training_samples;
+        for (int spp = 1; spp <= budget; spp *= 2)
+        {
+            budget -= spp;
+            Sampler *prototype = make_sampler(config.sampler_type, spp, guide->iteration + 1);
+            std::vector<std::thread> workers;
+            for (int thread_id = 0; thread_id < config.threads; thread_id++)
+            {
+                workers.emplace_back([&, thread_id]() {
+                    Sampler *sampler = prototype->clone(thread_id);
+                    long count = 0;
+                    for (int j = thread_id; j < film.height; j += config.threads)
+                    {
+                        for (int i = 0; i < film.width; i++)
+                        {
+                            for (int s = 0; s < spp; s++)
+                            {
+                                film_sample position;
+                                ray r = camera_ray(sampler, i, j, s, position);
+                                integrator->color(r, 0, &count, nullptr, sampler);
+                            }
+                        }
+                    }
+                    delete sampler;
+                });
+            }
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+            delete prototype;
+            guide->end_iteration(spp);
+            guide->print_stats();
+        }
+        guide->finish_training();
+        std::chrono::duration<double> elapsed_seconds = std::chrono::high_resolution_clock::now() - training_start;
+        std::cout << "time taken to train path guiding " << elapsed_seconds.count() << std::endl;
+    }
     virtual void start_render(std::chrono::high_resolution_clock::time_point) = 0;
     virtual void next_pixel_and_ray(int thread_id, ray &ray, int x, int y) = 0;
     virtual void sync_progress() = 0;
     virtual bool is_done() = 0;
     virtual void compute(int thread_id) = 0;
     virtual void finalize() = 0;
-    vec3 **framebuffer;
+
+    // the filter camera samples are importance sampled from, or nullptr when they're spread over their pixel. splatted samples reach
+    // the neighbouring pixels through the splat, and the default box of one pixel is the same as spreading them over it
+    const pixel_filter *filter_to_sample() const
+    {
+        bool sample_filter = splats == nullptr && (config.pixel_filter != BOX_FILTER || filter->radius != 0.5f);
+        return sample_filter ? filter : nullptr;
+    }
+    ray camera_ray(Sampler *sampler, int i, int j, int sample_index, film_sample &position)
+    {
+        return generate_camera_ray(cam, film.width, film.height, sampler, i, j, sample_index, filter_to_sample(), position);
+    }
+    // where a camera sample's color goes: splatted around its position, or weighted into the pixel it was taken for
+    void add_sample(int thread_id, int i, int j, const film_sample &position, const vec3 &color)
+    {
+        if (splats != nullptr)
+        {
+            splats->splat(thread_id, position.x, position.y, color);
+        }
+        else
+        {
+            framebuffer[j][i] += color;
+        }
+    }
+    // adds what the thread splatted to the framebuffer. render threads call it between passes, tiles or rows
+    void flush_splats(int thread_id)
+    {
+        if (splats != nullptr)
+        {
+            splats->flush(thread_id, framebuffer, framebuffer_lock);
+        }
+    }
+
+    // progressive and tiled renders stop between passes or tiles for checkpoints, and skip the samples a checkpoint already has
+    virtual bool supports_checkpoints()
+    {
+        return false;
+    }
+    // puts the samples from the checkpoint at path into the framebuffer, so that only the missing ones get rendered.
+    // resuming a finished render after raising "samples" adds the new samples on top of it
+    bool resume(std::string path)
+    {
+        checkpoint saved;
+        if (!supports_checkpoints() || !saved.read(path))
+        {
+            return false;
+        }
+        if (saved.width != film.width || saved.height != film.height)
+        {
+            std::cout << "checkpoint " << path << " is " << saved.width << "x" << saved.height << ", not " << film.width << "x" << film.height << '\n';
+            return false;
+        }
+        if (saved.sampler_type != (uint32_t)config.sampler_type)
+        {
+            std::cout << "WARNING! checkpoint " << path << " was rendered with a different sampler, the samples will be less well distributed\n";
+        }
+        generation = saved.generation + 1;
+        if (config.sampler_type == INDEPENDENT)
+        {
+            // the other samplers are a function of the pixel and sample index, and continue the sequence where it stopped.
+            // this one isn't, so it needs a new seed to not repeat the saved samples
+            delete sampler;
+            sampler = make_sampler(config.sampler_type, config.samples, hash_combine(saved.seed, generation));
+        }
+        samples_to_render = 0;
+        resumed_sample_total = 0;
+        for (int j = 0; j < film.height; j++)
+        {
+            for (int i = 0; i < film.width; i++)
+            {
+                int count = saved.count(i, j);
+                framebuffer[j][i] = saved.sum(i, j);
+                sample_counts[j][i] = resumed_samples[j][i] = count;
+                resumed_sample_total += count;
+                samples_to_render += std::max(config.samples - count, 0);
+            }
+        }
+        std::cout << "resuming from " << path << " with " << resumed_sample_total << " samples already rendered and " << samples_to_render << " to go\n";
+        return true;
+    }
+    // only while the render threads are paused or done
+    void write_checkpoint()
+    {
+        checkpoint state(film.width, film.height);
+        state.sampler_type = config.sampler_type;
+        state.seed = sampler->seed;
+        state.generation = generation;
+        for (int j = 0; j < film.height; j++)
+        {
+            for (int i = 0; i < film.width; i++)
+            {
+                state.set(i, j, framebuffer[j][i], sample_counts[j][i]);
+            }
+        }
+        if (!state.write(config.checkpoint_path))
+        {
+            std::cout << "\ncould not write checkpoint " << config.checkpoint_path << '\n';
+        }
+        last_checkpoint_time = std::chrono::high_resolution_clock::now();
+    }
+    // called by render threads between passes or tiles. waits while a checkpoint is written, so that it only ever has whole ones
+    void pause_point()
+    {
+        if (!pause_requested)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(pause_lock);
+        paused_threads++;
+        pause_changed.notify_all();
+        pause_changed.wait(guard, [this]() { return !pause_requested; });
+        paused_threads--;
+    }
+    // threads that ran out of work are paused for good
+    void thread_finished()
+    {
+        std::lock_guard<std::mutex> guard(pause_lock);
+        finished_threads++;
+        pause_changed.notify_all();
+    }
+    // the tonemapped image as a ppm, and as a png that's encoded in the background. previews are compressed for speed,
+    // and the final image is waited for
+    void write_image(vec3 **image, int samples, float max_luminance, bool preview)
+    {
+        std::vector<unsigned char> rgb = tonemap_to_rgb(image, film.width, film.height, samples, max_luminance, film.exposure, film.gamma);
+        write_ppm(output, rgb, film.width, film.height);
+        if (png != nullptr)
+        {
+            png->submit(config.png_output_path, std::move(rgb), film.width, film.height, preview);
+            if (!preview)
+            {
+                png->wait();
+            }
+        }
+    }
+    // image divided by each pixel's own count, like the linear outputs are. a resumed checkpoint can have more samples than "samples",
+    // which would come out too bright divided by that. free with delete_2d
+    vec3 **pixel_means(vec3 **image, int **counts, int samples)
+    {
+        vec3 **means = array_2d<vec3>(film.width, film.height);
+        for (int j = 0; j < film.height; j++)
+        {
+            for (int i = 0; i < film.width; i++)
+            {
+                means[j][i] = pixel_mean(image, counts, samples, i, j);
+            }
+        }
+        return means;
+    }
+    // the linear float images that are configured, of image as it is now.
+    // pixels are divided by their counts, or by samples where there's no count
+    void write_linear_outputs(vec3 **image, int **counts, int samples)
+    {
+        if (!config.pfm_output_path.empty() && !write_pfm(config.pfm_output_path, image, counts, samples, film.width, film.height))
+        {
+            std::cout << "could not write " << config.pfm_output_path << std::endl;
+        }
+        if (!config.exr_output_path.empty() && !write_exr(config.exr_output_path, image, counts, samples, film.width, film.height))
+        {
+            std::cout << "could not write " << config.exr_output_path << std::endl;
+        }
+        if (aovs != nullptr)
+        {
+            aovs->write(config.aov_output_path);
+        }
+    }
+    // what the final outputs are made from: the framebuffer, or a denoised copy of its pixel means when a denoiser is on.
+    // samples and counts become what the image's pixels have to be divided by. checkpoints keep the framebuffer itself
+    vec3 **final_image(int &samples, int **&counts)
+    {
+        counts = sample_counts;
+        if (config.denoiser == NO_DENOISER || aovs == nullptr)
+        {
+            return framebuffer;
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        atrous_denoiser denoiser(film.width, film.height, config.denoiser_iterations, config.denoiser_strength, config.threads);
+        vec3 **denoised = denoiser.denoise(framebuffer, sample_counts, samples, *aovs);
+        if (denoised == nullptr)
+        {
+            return framebuffer;
+        }
+        std::chrono::duration<double> elapsed_seconds = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "denoised in " << elapsed_seconds.count() * 1000 << " ms" << std::endl;
+        samples = 1;
+        counts = nullptr;
+        return denoised;
+    }
+    bool all_threads_finished()
+    {
+        std::lock_guard<std::mutex> guard(pause_lock);
+        return finished_threads == config.threads;
+    }
+    // from sync_progress, once checkpoint_interval seconds passed since the last checkpoint
+    void checkpoint_if_due()
+    {
+        std::chrono::duration<double> since_last = std::chrono::high_resolution_clock::now() - last_checkpoint_time;
+        if (config.checkpoint_path.empty() || since_last.count() < config.checkpoint_interval)
+        {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> guard(pause_lock);
+            pause_requested = true;
+            pause_changed.wait(guard, [this]() { return paused_threads + finished_threads == config.threads; });
+        }
+        write_checkpoint();
+        {
+            std::lock_guard<std::mutex> guard(pause_lock);
+            pause_requested = false;
+        }
+        pause_changed.notify_all();
+    }
+
+    vec3 **framebuffer = nullptr;
+    // samples in each pixel of the framebuffer so far, and how many of those came from a checkpoint
+    int **sample_counts = nullptr;
+    int **resumed_samples = nullptr;
+    long resumed_sample_total = 0;
+    long samples_to_render;
+    // times the render was resumed
+    uint32_t generation = 0;
+    std::chrono::high_resolution_clock::time_point last_checkpoint_time;
+    std::atomic<bool> pause_requested{false};
+    int paused_threads = 0;
+    int finished_threads = 0;
+    std::mutex pause_lock;
+    std::condition_variable pause_changed;
+    Sampler *sampler = nullptr;
     std::mutex framebuffer_lock;
     std::chrono::high_resolution_clock::time_point render_start_time;
     bool completed;
@@ -147,6 +500,16 @@ public:
     Config config;
     s_film film;
     std::shared_ptr<std::ofstream> output;
+    std::shared_ptr<png_writer> png;
+    // set when textures are paged in through a cache, to print its stats at the end
+    texture_cache *tile_cache = nullptr;
+    // set when this process is one of the workers of a distributed render
+    distributed_job *job = nullptr;
+    // set when aovs are on
+    aov_buffers *aovs = nullptr;
+    pixel_filter *filter = nullptr;
+    // set when samples are splatted
+    splat_buffer *splats = nullptr;
 };
 
 class Progressive : public Renderer
@@ -162,7 +525,20 @@ public:
             queue.enqueue(s);
         }
     };
-    void preprocess(){};
+    ~Progressive()
+    {
+        for (int thread_id = 0; threads != nullptr && thread_id < N_THREADS; thread_id++)
+        {
+            if (threads[thread_id].joinable())
+            {
+                threads[thread_id].join();
+            }
+        }
+        delete[] threads;
+        delete[] bounce_counts;
+        delete[] samples_done;
+        delete[] array_of_paths;
+    }
     void start_render(std::chrono::high_resolution_clock::time_point program_start_time)
     {
         threads = new std::thread[N_THREADS];
@@ -215,22 +591,53 @@ public:
         std::cout << "joining threads\n";
     };
     void next_pixel_and_ray(int thread_id, ray &ray, int x, int y){};
+    // renders the chunks of sample indices it claims from job instead of all of them. call before start_render
+    void distribute(distributed_job *job)
+    {
+        this->job = job;
+        int sample_id;
+        while (queue.try_dequeue(sample_id))
+        {
+        }
+        // each worker is a generation of its own, so that the independent sampler doesn't repeat another worker's samples
+        generation = job->worker_id + 1;
+        if (config.sampler_type == INDEPENDENT)
+        {
+            uint32_t seed = sampler->seed;
+            delete sampler;
+            sampler = make_sampler(config.sampler_type, config.samples, hash_combine(seed, generation));
+        }
+    }
     void sync_progress() override
     {
         long num_samples_done = 0;
-        long min_camera_rays = config.samples * film.total_pixels;
         for (int thread_id = 0; thread_id < N_THREADS; thread_id++)
         {
             assert(samples_done[thread_id] >= 0);
             num_samples_done += samples_done[thread_id];
         }
-        long num_samples_left = min_camera_rays - num_samples_done;
+        if (job != nullptr)
+        {
+            // a worker only knows how much it renders once the job runs out of chunks
+            std::lock_guard<std::mutex> guard(claim_lock);
+            samples_to_render = (long)job->claimed_samples * film.total_pixels;
+        }
+        long num_samples_left = samples_to_render - num_samples_done;
         print_out_progress(num_samples_done, num_samples_left, render_start_time);
         float avg_luminance, max_luminance, total_luminance;
-        calculate_luminance(framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), film.width * film.height, max_luminance, total_luminance, avg_luminance);
-        output_to_file(output, framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), max_luminance, film.exposure, film.gamma);
-        completed = num_samples_left <= 0;
+        long samples_per_pixel = 1 + (resumed_sample_total + num_samples_done) / (film.width * film.height);
+        calculate_luminance(framebuffer, film.width, film.height, samples_per_pixel, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        write_image(framebuffer, samples_per_pixel, max_luminance, true);
+        completed = job != nullptr ? all_threads_finished() : num_samples_left <= 0;
+        if (!completed)
+        {
+            checkpoint_if_due();
+        }
     };
+    bool supports_checkpoints()
+    {
+        return true;
+    }
 
     bool is_done()
     {
@@ -241,21 +648,32 @@ public:
         // start of multithreaded code.
         int traces = 0;
         int sample_id;
-        while (!queue.empty())
+        Sampler *sampler = this->sampler->clone(thread_id);
+        // handed to the integrator for every sample when aovs are on
+        aov_sample aov_record;
+        aov_sample *aov = aovs != nullptr ? &aov_record : nullptr;
+        while (true)
         {
-            sample_id = queue.dequeue();
+            pause_point();
+            if (!next_sample(sample_id))
+            {
+                break;
+            }
             for (int j = film.height - 1; j >= 0; j--)
             {
                 // std::cout << "computing row " << j << std::endl;
                 for (int i = 0; i < film.width; i++)
                 {
+                    if (sample_id < resumed_samples[j][i])
+                    {
+                        continue;
+                    }
                     // std::cout << "computing column " << i << std::endl;
                     vec3 col = vec3(0, 0, 0);
                     long *count = new long(0);
 
-                    float u = float(i + random_double()) / float(film.width);
-                    float v = float(j + random_double()) / float(film.height);
-                    ray r = cam.get_ray(u, v);
+                    film_sample position;
+                    ray r = camera_ray(sampler, i, j, sample_id, position);
                     std::vector<vec3> *_path = nullptr;
                     if (random_double() < trace_probability)
                     {
@@ -275,7 +693,12 @@ public:
                     {
                         _path = nullptr;
                     }
-                    col += de_nan(integrator->color(r, 0, count, _path));
+                    if (aov != nullptr)
+                    {
+                        aov->reset(aovs->enabled);
+                    }
+                    vec3 sample_color = position.weight * de_nan(integrator->color(r, 0, count, _path, sampler, false, aov));
+                    col += sample_color;
                     if (_path != nullptr)
                     {
                         // std::cout << "traced _path, size is " << _path->size() << std::endl;
@@ -286,15 +709,52 @@ public:
                     }
                     // framebuffer accesses need to be guarded with a lock so that multiple threads don't write to the same pixel at the same time.
                     framebuffer_lock.lock();
-                    framebuffer[j][i] += col;
+                    add_sample(thread_id, i, j, position, col);
+                    if (aov != nullptr)
+                    {
+                        aovs->add(i, j, sample_color, *aov);
+                    }
+                    sample_counts[j][i]++;
                     bounce_counts[thread_id] += *count;
                     samples_done[thread_id] += 1;
                     framebuffer_lock.unlock();
                 }
             }
+            // before a checkpoint can be written at the next pause point
+            flush_splats(thread_id);
         }
+        thread_finished();
         // std::cout << "total length of traced paths : " << paths[thread_id].size() << std::endl;
     }
+    // workers of a distributed render claim another chunk once the queue runs dry
+    bool next_sample(int &sample_id)
+    {
+        if (queue.try_dequeue(sample_id))
+        {
+            return true;
+        }
+        if (job == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(claim_lock);
+        // another thread may have claimed one while this one waited for the lock
+        if (queue.try_dequeue(sample_id))
+        {
+            return true;
+        }
+        int first, last;
+        if (!job->claim_chunk(first, last))
+        {
+            return false;
+        }
+        for (int s = first + 1; s < last; s++)
+        {
+            queue.enqueue(s);
+        }
+        sample_id = first;
+        return true;
+    }
 
     void finalize()
     {
@@ -306,10 +766,14 @@ public:
         auto t4 = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed_seconds3 = t4 - render_start_time;
         std::cout << "time taken to compute " << elapsed_seconds3.count() << std::endl;
-        float rate1 = film.total_pixels * config.samples / elapsed_seconds3.count();
+        float rate1 = samples_to_render / elapsed_seconds3.count();
         float rate2 = total_bounces / elapsed_seconds3.count();
-        std::cout << "computed " << film.total_pixels * config.samples << " camera rays in " << elapsed_seconds3.count() << "s, at " << rate1 << " rays per second, or " << rate1 / N_THREADS << "per thread" << std::endl;
+        std::cout << "computed " << samples_to_render << " camera rays in " << elapsed_seconds3.count() << "s, at " << rate1 << " rays per second, or " << rate1 / N_THREADS << "per thread" << std::endl;
         std::cout << "computed " << total_bounces << " rays, at " << rate2 << " rays per second, or " << rate2 / N_THREADS << " per thread" << std::endl;
+        if (tile_cache != nullptr)
+        {
+            tile_cache->print_stats();
+        }
 
         int added_paths = 0;
         if (config.should_trace_paths)
@@ -324,20 +788,34 @@ public:
         }
         std::cout << "added " << added_paths << " paths" << std::endl;
 
+        // a worker only has its share of the samples
+        int samples_per_pixel = job != nullptr ? std::max(job->claimed_samples, 1) : config.samples;
+        int **counts;
+        vec3 **image = final_image(samples_per_pixel, counts);
+        vec3 **means = pixel_means(image, counts, samples_per_pixel);
         float max_luminance, avg_luminance, total_luminance;
-        calculate_luminance(framebuffer, film.width, film.height, config.samples, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        calculate_luminance(means, film.width, film.height, 1, film.width * film.height, max_luminance, total_luminance, avg_luminance);
         std::cout << "avg lum " << avg_luminance << std::endl;
         std::cout << "max lum " << max_luminance << std::endl;
 
-        output_to_file(output, framebuffer, film.width, film.height, config.samples, max_luminance, film.exposure, film.gamma);
+        write_image(means, 1, max_luminance, false);
+        delete_2d(means, film.height);
+        write_linear_outputs(image, counts, samples_per_pixel);
+        if (!config.checkpoint_path.empty())
+        {
+            // so that more samples can be added later
+            write_checkpoint();
+            std::cout << "wrote checkpoint " << config.checkpoint_path << std::endl;
+        }
     }
 
     int N_THREADS;
-    paths *array_of_paths;
+    paths *array_of_paths = nullptr;
     SafeQueue<int> queue;
-    std::thread *threads;
-    long *bounce_counts;
-    int *samples_done;
+    std::mutex claim_lock;
+    std::thread *threads = nullptr;
+    long *bounce_counts = nullptr;
+    int *samples_done = nullptr;
     float trace_probability;
 };
 
@@ -353,13 +831,29 @@ public:
         int remaining_samples = config.samples % N_THREADS;
         std::cout << "samples per thread " << min_samples << std::endl;
         std::cout << "leftover samples to be allocated " << remaining_samples << std::endl;
+        // each thread gets a contiguous range of sample indices, so that no two threads draw the same sample of a pixel
+        int first_sample = 0;
         for (int t = 0; t < config.threads; t++)
         {
             int samples = min_samples + (int)(t < remaining_samples);
-            queue.enqueue(samples);
+            queue.enqueue(std::pair<int, int>(first_sample, samples));
+            first_sample += samples;
         }
     };
-    void preprocess(){};
+    ~Naive()
+    {
+        for (int thread_id = 0; threads != nullptr && thread_id < N_THREADS; thread_id++)
+        {
+            if (threads[thread_id].joinable())
+            {
+                threads[thread_id].join();
+            }
+        }
+        delete[] threads;
+        delete[] bounce_counts;
+        delete[] samples_done;
+        delete[] array_of_paths;
+    }
     void start_render(std::chrono::high_resolution_clock::time_point program_start_time)
     {
         threads = new std::thread[N_THREADS];
@@ -420,7 +914,7 @@ public:
         print_out_progress(num_samples_done, num_samples_left, render_start_time);
         float avg_luminance, max_luminance, total_luminance;
         calculate_luminance(framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), film.width * film.height, max_luminance, total_luminance, avg_luminance);
-        output_to_file(output, framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), max_luminance, film.exposure, film.gamma);
+        write_image(framebuffer, 1 + num_samples_done / (film.width * film.height), max_luminance, true);
         completed = num_samples_left <= 0;
     };
 
@@ -432,12 +926,18 @@ public:
     {
         // start of multithreaded code.
 
-        int samples = queue.dequeue();
+        std::pair<int, int> sample_range = queue.dequeue();
+        int first_sample = sample_range.first;
+        int samples = sample_range.second;
         if (samples == 0)
         {
             return;
         }
         int traces = 0;
+        Sampler *sampler = this->sampler->clone(thread_id);
+        // handed to the integrator for every sample when aovs are on
+        aov_sample aov_record;
+        aov_sample *aov = aovs != nullptr ? &aov_record : nullptr;
         for (int j = film.height - 1; j >= 0; j--)
         {
             // std::cout << "computing row " << j << std::endl;
@@ -450,9 +950,8 @@ public:
                 for (int s = 0; s < samples; s++)
                 {
 
-                    float u = float(i + random_double()) / float(film.width);
-                    float v = float(j + random_double()) / float(film.height);
-                    ray r = cam.get_ray(u, v);
+                    film_sample position;
+                    ray r = camera_ray(sampler, i, j, first_sample + s, position);
                     std::vector<vec3> *_path = nullptr;
                     if (random_double() < trace_probability)
                     {
@@ -472,7 +971,12 @@ public:
                     {
                         _path = nullptr;
                     }
-                    col += de_nan(integrator->color(r, 0, count, _path));
+                    if (aov != nullptr)
+                    {
+                        aov->reset(aovs->enabled);
+                    }
+                    vec3 sample_color = position.weight * de_nan(integrator->color(r, 0, count, _path, sampler, false, aov));
+                    col += sample_color;
                     if (_path != nullptr)
                     {
                         // std::cout << "traced _path, size is " << _path->size() << std::endl;
@@ -483,12 +987,17 @@ public:
                     }
                     // framebuffer accesses need to be guarded with a lock so that multiple threads don't write to the same pixel at the same time.
                     framebuffer_lock.lock();
-                    framebuffer[j][i] += col;
+                    add_sample(thread_id, i, j, position, sample_color);
+                    if (aov != nullptr)
+                    {
+                        aovs->add(i, j, sample_color, *aov);
+                    }
                     bounce_counts[thread_id] += *count;
                     samples_done[thread_id] += 1;
                     framebuffer_lock.unlock();
                 }
             }
+            flush_splats(thread_id);
         }
         // std::cout << "total length of traced paths : " << paths[thread_id].size() << std::endl;
     }
@@ -507,6 +1016,10 @@ public:
         float rate2 = total_bounces / elapsed_seconds3.count();
         std::cout << "computed " << film.total_pixels * config.samples << " camera rays in " << elapsed_seconds3.count() << "s, at " << rate1 << " rays per second, or " << rate1 / N_THREADS << "per thread" << std::endl;
         std::cout << "computed " << total_bounces << " rays, at " << rate2 << " rays per second, or " << rate2 / N_THREADS << " per thread" << std::endl;
+        if (tile_cache != nullptr)
+        {
+            tile_cache->print_stats();
+        }
 
         int added_paths = 0;
         if (config.should_trace_paths)
@@ -521,21 +1034,25 @@ public:
         }
         std::cout << "added " << added_paths << " paths" << std::endl;
 
+        int samples_per_pixel = config.samples;
+        int **counts;
+        vec3 **image = final_image(samples_per_pixel, counts);
         float max_luminance, avg_luminance, total_luminance;
-        calculate_luminance(framebuffer, film.width, film.height, config.samples, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        calculate_luminance(image, film.width, film.height, samples_per_pixel, film.width * film.height, max_luminance, total_luminance, avg_luminance);
         std::cout << "avg lum " << avg_luminance << std::endl;
         std::cout << "total lum " << total_luminance << std::endl;
         std::cout << "max lum " << max_luminance << std::endl;
 
-        output_to_file(output, framebuffer, film.width, film.height, config.samples, max_luminance, film.exposure, film.gamma);
+        write_image(image, samples_per_pixel, max_luminance, false);
+        write_linear_outputs(image, counts, samples_per_pixel);
     }
 
     int N_THREADS;
-    SafeQueue<int> queue;
-    paths *array_of_paths;
-    std::thread *threads;
-    long *bounce_counts;
-    int *samples_done;
+    SafeQueue<std::pair<int, int>> queue;
+    paths *array_of_paths = nullptr;
+    std::thread *threads = nullptr;
+    long *bounce_counts = nullptr;
+    int *samples_done = nullptr;
     float trace_probability;
 };
 
@@ -549,7 +1066,21 @@ public:
         completed = false;
         spiral = new NaiveSpiral(film.width, film.height, config.block_width, config.block_height);
     };
-    void preprocess(){};
+    ~Tiled()
+    {
+        for (int thread_id = 0; threads != nullptr && thread_id < N_THREADS; thread_id++)
+        {
+            if (threads[thread_id].joinable())
+            {
+                threads[thread_id].join();
+            }
+        }
+        delete[] threads;
+        delete[] bounce_counts;
+        delete[] samples_done;
+        delete[] array_of_paths;
+        delete spiral;
+    }
     void start_render(std::chrono::high_resolution_clock::time_point program_start_time)
     {
         threads = new std::thread[N_THREADS];
@@ -605,19 +1136,27 @@ public:
     void sync_progress() override
     {
         long num_samples_done = 0;
-        long min_camera_rays = config.samples * film.total_pixels;
         for (int thread_id = 0; thread_id < N_THREADS; thread_id++)
         {
             assert(samples_done[thread_id] >= 0);
             num_samples_done += samples_done[thread_id];
         }
-        long num_samples_left = min_camera_rays - num_samples_done;
+        long num_samples_left = samples_to_render - num_samples_done;
         print_out_progress(num_samples_done, num_samples_left, render_start_time);
         float avg_luminance, max_luminance, total_luminance;
-        calculate_luminance(framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), film.width * film.height, max_luminance, total_luminance, avg_luminance);
-        output_to_file(output, framebuffer, film.width, film.height, 1 + num_samples_done / (film.width * film.height), max_luminance, film.exposure, film.gamma);
+        long samples_per_pixel = 1 + (resumed_sample_total + num_samples_done) / (film.width * film.height);
+        calculate_luminance(framebuffer, film.width, film.height, samples_per_pixel, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        write_image(framebuffer, samples_per_pixel, max_luminance, true);
         completed = num_samples_left <= 0;
+        if (!completed)
+        {
+            checkpoint_if_due();
+        }
     };
+    bool supports_checkpoints()
+    {
+        return true;
+    }
 
     bool is_done()
     {
@@ -629,9 +1168,18 @@ public:
         int traces = 0;
         std::pair<int, int> topleft;
         std::pair<int, int> bottomright;
-        while (!spiral->is_empty())
+        Sampler *sampler = this->sampler->clone(thread_id);
+        // handed to the integrator for every sample when aovs are on
+        aov_sample aov_record;
+        aov_sample *aov = aovs != nullptr ? &aov_record : nullptr;
+        std::pair<std::pair<int, int>, std::pair<int, int>> rect;
+        while (true)
         {
-            auto rect = spiral->next();
+            pause_point();
+            if (!spiral->try_next(rect))
+            {
+                break;
+            }
             topleft = rect.first;
             bottomright = rect.second;
             for (int s = 0; s < config.samples; s++)
@@ -641,13 +1189,16 @@ public:
                     // std::cout << "computing row " << j << std::endl;
                     for (int i = topleft.first; i < bottomright.first; i++)
                     {
+                        if (s < resumed_samples[j][i])
+                        {
+                            continue;
+                        }
                         // std::cout << "computing column " << i << std::endl;
                         vec3 col = vec3(0, 0, 0);
                         long *count = new long(0);
 
-                        float u = float(i + random_double()) / float(film.width);
-                        float v = float(j + random_double()) / float(film.height);
-                        ray r = cam.get_ray(u, v);
+                        film_sample position;
+                        ray r = camera_ray(sampler, i, j, s, position);
                         std::vector<vec3> *_path = nullptr;
                         if (random_double() < trace_probability)
                         {
@@ -667,7 +1218,12 @@ public:
                         {
                             _path = nullptr;
                         }
-                        col += de_nan(integrator->color(r, 0, count, _path));
+                        if (aov != nullptr)
+                        {
+                            aov->reset(aovs->enabled);
+                        }
+                        vec3 sample_color = position.weight * de_nan(integrator->color(r, 0, count, _path, sampler, false, aov));
+                        col += sample_color;
                         if (_path != nullptr)
                         {
                             // std::cout << "traced _path, size is " << _path->size() << std::endl;
@@ -679,14 +1235,22 @@ public:
                         // framebuffer accesses need to be guarded with a lock so that multiple threads don't write to the same pixel at the same time.
                         // since this is a tiled renderer, this does not apply, so the locks can be removed.
                         // framebuffer_lock.lock();
-                        framebuffer[j][i] += col;
+                        add_sample(thread_id, i, j, position, col);
+                        if (aov != nullptr)
+                        {
+                            aovs->add(i, j, sample_color, *aov);
+                        }
+                        sample_counts[j][i]++;
                         bounce_counts[thread_id] += *count;
                         samples_done[thread_id] += 1;
                         // framebuffer_lock.unlock();
                     }
                 }
             }
+            // splats reach into tiles of other threads, which is why they're only added under the lock
+            flush_splats(thread_id);
         }
+        thread_finished();
         // std::cout << "total length of traced paths : " << paths[thread_id].size() << std::endl;
     }
 
@@ -700,10 +1264,14 @@ public:
         auto t4 = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed_seconds3 = t4 - render_start_time;
         std::cout << "time taken to compute " << elapsed_seconds3.count() << std::endl;
-        float rate1 = film.total_pixels * config.samples / elapsed_seconds3.count();
+        float rate1 = samples_to_render / elapsed_seconds3.count();
         float rate2 = total_bounces / elapsed_seconds3.count();
-        std::cout << "computed " << film.total_pixels * config.samples << " camera rays in " << elapsed_seconds3.count() << "s, at " << rate1 << " rays per second, or " << rate1 / N_THREADS << "per thread" << std::endl;
+        std::cout << "computed " << samples_to_render << " camera rays in " << elapsed_seconds3.count() << "s, at " << rate1 << " rays per second, or " << rate1 / N_THREADS << "per thread" << std::endl;
         std::cout << "computed " << total_bounces << " rays, at " << rate2 << " rays per second, or " << rate2 / N_THREADS << " per thread" << std::endl;
+        if (tile_cache != nullptr)
+        {
+            tile_cache->print_stats();
+        }
 
         int added_paths = 0;
         if (config.should_trace_paths)
@@ -718,19 +1286,216 @@ public:
         }
         std::cout << "added " << added_paths << " paths" << std::endl;
 
+        int samples_per_pixel = config.samples;
+        int **counts;
+        vec3 **image = final_image(samples_per_pixel, counts);
+        vec3 **means = pixel_means(image, counts, samples_per_pixel);
         float max_luminance, avg_luminance, total_luminance;
-        calculate_luminance(framebuffer, film.width, film.height, config.samples, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        calculate_luminance(means, film.width, film.height, 1, film.width * film.height, max_luminance, total_luminance, avg_luminance);
         std::cout << "avg lum " << avg_luminance << std::endl;
         std::cout << "max lum " << max_luminance << std::endl;
 
-        output_to_file(output, framebuffer, film.width, film.height, config.samples, max_luminance, film.exposure, film.gamma);
+        write_image(means, 1, max_luminance, false);
+        delete_2d(means, film.height);
+        write_linear_outputs(image, counts, samples_per_pixel);
+        if (!config.checkpoint_path.empty())
+        {
+            // so that more samples can be added later
+            write_checkpoint();
+            std::cout << "wrote checkpoint " << config.checkpoint_path << std::endl;
+        }
     }
 
     int N_THREADS;
-    paths *array_of_paths;
+    paths *array_of_paths = nullptr;
     Spiral *spiral;
-    std::thread *threads;
-    long *bounce_counts;
-    int *samples_done;
+    std::thread *threads = nullptr;
+    long *bounce_counts = nullptr;
+    int *samples_done = nullptr;
     float trace_probability;
-};
\ No newline at end of file
+};
+// keeps rendering the same world while the camera is moved (main.exe --interactive). render threads take rows of passes from a shared
+// counter, so that all of them work on the first pass after a change and it shows up quickly. a change of view starts a new epoch:
+// the framebuffer is cleared under the framebuffer lock, rows of the old epoch that are still being rendered are dropped, and the
+// threads move on to the new view without being respawned. once every pixel has config.samples samples the threads wait for the next change
+class Interactive : public Renderer
+{
+public:
+    Interactive(Integrator *integrator, camera cam, Config config) : Renderer{integrator, cam, config}
+    {
+        N_THREADS = config.threads;
+        completed = false;
+        display = array_2d<vec3>(film.width, film.height);
+    };
+    void start_render(std::chrono::high_resolution_clock::time_point program_start_time)
+    {
+        threads = new std::thread[N_THREADS];
+        for (int thread_id = 0; thread_id < N_THREADS; thread_id++)
+        {
+            threads[thread_id] = std::thread([this](int thread_id) { compute(thread_id); }, thread_id);
+        }
+        render_start_time = view_start_time = last_preview_time = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed_seconds = render_start_time - program_start_time;
+        std::cout << "time taken to setup the rest and spawn threads " << elapsed_seconds.count() << std::endl;
+    };
+    void next_pixel_and_ray(int thread_id, ray &ray, int x, int y){};
+
+    // starts accumulating from scratch with a new view. from any thread
+    void set_camera(camera view)
+    {
+        {
+            std::lock_guard<std::mutex> guard(framebuffer_lock);
+            cam = view;
+            epoch++;
+            integrator->reset_view();
+            next_row = 0;
+            rows_done = 0;
+            for (int j = 0; j < film.height; j++)
+            {
+                for (int i = 0; i < film.width; i++)
+                {
+                    framebuffer[j][i] = vec3(0, 0, 0);
+                    sample_counts[j][i] = 0;
+                }
+            }
+            view_start_time = std::chrono::high_resolution_clock::now();
+        }
+        work_changed.notify_all();
+    }
+    // writes the next preview with final quality, and the linear outputs with it
+    void request_save()
+    {
+        save_requested = true;
+    }
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(framebuffer_lock);
+            completed = true;
+        }
+        work_changed.notify_all();
+    }
+
+    // a preview of the current view, at most interactive_fps times a second
+    void sync_progress() override
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> since_preview = now - last_preview_time;
+        long rows = rows_done;
+        bool save = save_requested.exchange(false);
+        // nothing new, or only the cleared framebuffer of a view that just changed
+        if (!save && (rows == previewed_rows || rows == 0 || since_preview.count() < 1.0 / config.interactive_fps))
+        {
+            return;
+        }
+        last_preview_time = now;
+        previewed_rows = rows;
+        float max_luminance = update_display();
+        write_image(display, 1, max_luminance, !save);
+        if (save)
+        {
+            // from the snapshot, since render threads keep adding to the framebuffer and a camera change can clear it meanwhile
+            write_linear_outputs(display, nullptr, 1);
+            std::cout << "\nsaved the image at " << rows / film.height << " spp" << std::endl;
+        }
+        std::chrono::duration<double> since_change = now - view_start_time;
+        std::cout << "view " << std::setw(4) << epoch << ", " << std::setw(5) << rows / film.height << " spp in " << std::setw(8) << std::fixed << std::setprecision(2) << since_change.count() << std::defaultfloat << "s" << '\r' << std::flush;
+    };
+    bool is_done()
+    {
+        return this->completed;
+    }
+    void compute(int thread_id)
+    {
+        Sampler *sampler = this->sampler->clone(thread_id);
+        long total_rows = (long)config.samples * film.height;
+        std::vector<vec3> row_colors(film.width);
+        while (true)
+        {
+            camera view;
+            uint32_t row_epoch;
+            long item;
+            {
+                std::unique_lock<std::mutex> guard(framebuffer_lock);
+                work_changed.wait(guard, [&]() { return completed || next_row < total_rows; });
+                if (completed)
+                {
+                    break;
+                }
+                item = next_row++;
+                row_epoch = epoch;
+                view = cam;
+            }
+            // top row first
+            int sample_id = item / film.height;
+            int j = film.height - 1 - item % film.height;
+            long bounces = 0;
+            for (int i = 0; i < film.width; i++)
+            {
+                film_sample position;
+                ray r = generate_camera_ray(view, film.width, film.height, sampler, i, j, sample_id, filter_to_sample(), position);
+                row_colors[i] = position.weight * de_nan(integrator->color(r, 0, &bounces, nullptr, sampler));
+                if (epoch != row_epoch)
+                {
+                    break;
+                }
+            }
+            std::lock_guard<std::mutex> guard(framebuffer_lock);
+            if (epoch != row_epoch)
+            {
+                continue;
+            }
+            for (int i = 0; i < film.width; i++)
+            {
+                framebuffer[j][i] += row_colors[i];
+                sample_counts[j][i]++;
+            }
+            rows_done++;
+        }
+        delete sampler;
+    }
+
+    void finalize()
+    {
+        for (int thread_id = 0; thread_id < N_THREADS; thread_id++)
+        {
+            threads[thread_id].join();
+        }
+        float max_luminance = update_display();
+        std::cout << "\nfinished at " << rows_done / film.height << " spp" << std::endl;
+        write_image(display, 1, max_luminance, false);
+        write_linear_outputs(framebuffer, sample_counts, 1);
+    }
+
+    int N_THREADS;
+    std::thread *threads;
+    // pixel means, since rows of the current pass don't all have the same number of samples
+    vec3 **display;
+    std::condition_variable work_changed;
+    // changed under the framebuffer lock. render threads also read epoch without it to notice a change mid row
+    std::atomic<uint32_t> epoch{0};
+    long next_row = 0;
+    std::atomic<long> rows_done{0};
+    long previewed_rows = -1;
+    std::atomic<bool> save_requested{false};
+    std::chrono::high_resolution_clock::time_point view_start_time, last_preview_time;
+
+private:
+    // fills display with a snapshot of the pixel means and returns their max luminance
+    float update_display()
+    {
+        {
+            std::lock_guard<std::mutex> guard(framebuffer_lock);
+            for (int j = 0; j < film.height; j++)
+            {
+                for (int i = 0; i < film.width; i++)
+                {
+                    display[j][i] = pixel_mean(framebuffer, sample_counts, 1, i, j);
+                }
+            }
+        }
+        float max_luminance, avg_luminance, total_luminance;
+        calculate_luminance(display, film.width, film.height, 1, film.width * film.height, max_luminance, total_luminance, avg_luminance);
+        return max_luminance;
+    }
+};
@@ -0,0 +1,124 @@
+#pragma once
+#include "hittable.h"
+#include "sampler.h"
+#include "vec3.h"
+#include <mutex>
+#include <vector>
+
+// resampled importance sampling of direct light, after Talbot et al. 2005 and Bitterli et al. 2020 (ReSTIR).
+// many cheap light samples are weighed by their unshadowed contribution, one of them is kept, and only that one gets a shadow ray.
+
+// a point on a light, or a direction towards the background, that can be evaluated again from a different shading point
+struct light_candidate
+{
+    light_candidate() : light(nullptr), u(0), v(0), material_id(-1) {}
+    // nullptr for the background
+    hittable *light;
+    // point on the light, or the direction for the background
+    vec3 p;
+    vec3 normal;
+    float u;
+    float v;
+    int material_id;
+};
+
+// weighted reservoir sampling (Chao 1982) that keeps one candidate out of a stream.
+// one uniform number decides the whole stream: it's rescaled after every decision so that it stays uniform for the next one.
+struct reservoir
+{
+    reservoir() : weight_sum(0), M(0), W(0) {}
+
+    // w is the resampling weight, target / source pdf. count is how many candidates it stands for, which is more than 1 when merging reservoirs
+    bool update(const light_candidate &candidate, float w, float count, float &u)
+    {
+        M += count;
+        if (!(w > 0) || std::isinf(w))
+        {
+            return false;
+        }
+        weight_sum += w;
+        float p = w / weight_sum;
+        if (u < p)
+        {
+            y = candidate;
+            u = std::min(u / p, ONE_MINUS_EPSILON);
+            return true;
+        }
+        u = std::min((u - p) / (1 - p), ONE_MINUS_EPSILON);
+        return false;
+    }
+
+    // call once the stream is done, with the target function of the kept candidate. W then weighs its contribution like 1 / pdf would
+    void finalize(float target)
+    {
+        W = target > 0 && M > 0 ? weight_sum / (M * target) : 0;
+    }
+
+    light_candidate y;
+    float weight_sum;
+    // number of candidates seen, including the ones merged in from other reservoirs
+    float M;
+    float W;
+};
+
+// the reservoir of the first hit of each pixel, with where that hit was so that reuse can reject neighbours on other surfaces.
+// samples of one pixel can run on different threads at once in the progressive renderer, so every access takes one of a few striped locks.
+struct pixel_reservoir
+{
+    pixel_reservoir() : valid(false) {}
+    reservoir r;
+    vec3 position;
+    vec3 normal;
+    bool valid;
+};
+
+#define RESERVOIR_LOCKS 64
+
+class reservoir_buffer
+{
+public:
+    reservoir_buffer(int width, int height) : width(width), height(height), pixels(width * height) {}
+
+    bool load(int x, int y, pixel_reservoir &out)
+    {
+        if (x < 0 || y < 0 || x >= width || y >= height)
+        {
+            return false;
+        }
+        int index = y * width + x;
+        std::lock_guard<std::mutex> guard(locks[index % RESERVOIR_LOCKS]);
+        out = pixels[index];
+        return out.valid;
+    }
+
+    void store(int x, int y, const pixel_reservoir &in)
+    {
+        if (x < 0 || y < 0 || x >= width || y >= height)
+        {
+            return;
+        }
+        int index = y * width + x;
+        std::lock_guard<std::mutex> guard(locks[index % RESERVOIR_LOCKS]);
+        pixels[index] = in;
+    }
+
+    // forgets every pixel, for when the camera moves and the first hits they were made at aren't seen anymore
+    void reset()
+    {
+        for (int l = 0; l < RESERVOIR_LOCKS; l++)
+        {
+            std::lock_guard<std::mutex> guard(locks[l]);
+            for (size_t index = l; index < pixels.size(); index += RESERVOIR_LOCKS)
+            {
+                pixels[index] = pixel_reservoir();
+            }
+        }
+    }
+
+    int width;
+    int height;
+
+private:
+    std::vector<pixel_reservoir> pixels;
+    std::mutex locks[RESERVOIR_LOCKS];
+};
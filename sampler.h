@@ -0,0 +1,399 @@
+#pragma once
+#include <stdint.h>
+#include <random>
+#include <iostream>
+#include <map>
+#include <string>
+
+// largest float below 1
+#define ONE_MINUS_EPSILON 0.99999994f
+
+enum SamplerType
+{
+    INDEPENDENT,
+    STRATIFIED,
+    HALTON,
+    SOBOL,
+    BLUE_NOISE
+};
+
+SamplerType get_sampler_type_for(std::string type)
+{
+    static std::map<std::string, SamplerType> mapping = {
+        {"independent", INDEPENDENT},
+        {"stratified", STRATIFIED},
+        {"halton", HALTON},
+        {"sobol", SOBOL},
+        {"blue noise", BLUE_NOISE}};
+    if (mapping.count(type) == 0)
+    {
+        std::cout << "WARNING! unknown sampler \"" << type << "\", using independent\n";
+    }
+    return mapping.count(type) > 0 ? mapping[type] : INDEPENDENT;
+}
+
+inline uint32_t mix_bits(uint32_t v)
+{
+    v ^= v >> 16;
+    v *= 0x7feb352d;
+    v ^= v >> 15;
+    v *= 0x846ca68b;
+    v ^= v >> 16;
+    return v;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return mix_bits(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+// Kensler, "Correlated Multi-Jittered Sampling". returns element i of a random permutation of [0, l) selected by p
+inline uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+inline float hashed_float(uint32_t i, uint32_t p)
+{
+    i ^= p;
+    i ^= i >> 17;
+    i ^= i >> 10;
+    i *= 0xb36534e5;
+    i ^= i >> 12;
+    i ^= i >> 21;
+    i *= 0x93fc4795;
+    i ^= 0xdf6e307f;
+    i ^= i >> 17;
+    i *= 1 | p >> 18;
+    return i * (1.0f / 4294967808.0f);
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Burley, "Practical Hash-based Owen Scrambling"
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline float to_unit_float(uint32_t x)
+{
+    float f = x * 2.3283064365386963e-10f;
+    return f < ONE_MINUS_EPSILON ? f : ONE_MINUS_EPSILON;
+}
+
+// a source of sample values for one thread. values come in per-pixel, per-sample streams,
+// and each call to get_1d advances to the next dimension of the current stream.
+class Sampler
+{
+public:
+    Sampler(int samples_per_pixel, uint32_t seed) : samples_per_pixel(samples_per_pixel), seed(seed), pixel_seed(seed), sample_index(0), dimension(0), pixel_x(0), pixel_y(0) {}
+    virtual ~Sampler() {}
+    virtual void start_pixel(int x, int y, int sample_index)
+    {
+        pixel_x = x;
+        pixel_y = y;
+        pixel_seed = hash_combine(hash_combine(seed, x), y);
+        this->sample_index = sample_index;
+        dimension = 0;
+    }
+    virtual float get_1d() = 0;
+    void get_2d(float &u, float &v)
+    {
+        u = get_1d();
+        v = get_1d();
+    }
+    // a copy for another thread
+    virtual Sampler *clone(uint32_t seed) = 0;
+
+    int samples_per_pixel;
+    uint32_t seed;
+    uint32_t pixel_seed;
+    int sample_index;
+    int dimension;
+    // pixel being sampled, for integrators that keep per pixel state
+    int pixel_x;
+    int pixel_y;
+};
+
+class IndependentSampler : public Sampler
+{
+public:
+    IndependentSampler(int samples_per_pixel, uint32_t seed = 0) : Sampler(samples_per_pixel, seed), generator(seed), distribution(0.0f, 1.0f) {}
+    float get_1d()
+    {
+        dimension++;
+        float f = distribution(generator);
+        return f < ONE_MINUS_EPSILON ? f : ONE_MINUS_EPSILON;
+    }
+    Sampler *clone(uint32_t seed)
+    {
+        return new IndependentSampler(samples_per_pixel, hash_combine(this->seed, seed));
+    }
+    std::mt19937 generator;
+    std::uniform_real_distribution<float> distribution;
+};
+
+// jittered strata along every dimension, with an independent permutation of the strata per pixel and dimension.
+// samples past samples_per_pixel start a new, differently permuted set of strata.
+class StratifiedSampler : public Sampler
+{
+public:
+    StratifiedSampler(int samples_per_pixel, uint32_t seed = 0) : Sampler(samples_per_pixel, seed) {}
+    float get_1d()
+    {
+        uint32_t pass = sample_index / samples_per_pixel;
+        uint32_t index = sample_index % samples_per_pixel;
+        uint32_t dimension_seed = hash_combine(hash_combine(pixel_seed, dimension++), pass);
+        uint32_t stratum = permutation_element(index, samples_per_pixel, dimension_seed);
+        float jitter = hashed_float(index, mix_bits(dimension_seed));
+        float f = (stratum + jitter) / samples_per_pixel;
+        return f < ONE_MINUS_EPSILON ? f : ONE_MINUS_EPSILON;
+    }
+    Sampler *clone(uint32_t seed)
+    {
+        return new StratifiedSampler(samples_per_pixel, this->seed);
+    }
+};
+
+#define HALTON_DIMENSIONS 64
+static const uint32_t halton_primes[HALTON_DIMENSIONS] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+
+// radical inverse in the given base, with every digit permuted based on the digits before it (owen scrambling)
+inline float owen_scrambled_radical_inverse(uint32_t a, uint32_t base, uint32_t seed)
+{
+    float inv_base = 1.0f / base;
+    float inv_base_m = 1;
+    uint64_t reversed_digits = 0;
+    uint32_t depth = 0;
+    // keep going past the last nonzero digit of a, so that the trailing digits get scrambled too
+    while (1 - (base - 1) * inv_base_m < 1)
+    {
+        uint32_t next = a / base;
+        uint32_t digit = a - next * base;
+        // the permutation depends on the depth as well as the digits so far, otherwise a leading 0 digit reuses the seed
+        uint32_t digit_seed = hash_combine(hash_combine(seed, depth++), (uint32_t)reversed_digits);
+        digit = permutation_element(digit, base, digit_seed);
+        reversed_digits = reversed_digits * base + digit;
+        inv_base_m *= inv_base;
+        a = next;
+    }
+    float f = inv_base_m * reversed_digits;
+    return f < ONE_MINUS_EPSILON ? f : ONE_MINUS_EPSILON;
+}
+
+// owen scrambled halton sequence, with the scramble seeded per pixel and dimension.
+// dimensions past the prime table fall back to hashed independent values.
+class HaltonSampler : public Sampler
+{
+public:
+    HaltonSampler(int samples_per_pixel, uint32_t seed = 0) : Sampler(samples_per_pixel, seed) {}
+    float get_1d()
+    {
+        int d = dimension++;
+        uint32_t dimension_seed = hash_combine(pixel_seed, d);
+        if (d >= HALTON_DIMENSIONS)
+        {
+            return hashed_float(sample_index, dimension_seed);
+        }
+        return owen_scrambled_radical_inverse(sample_index, halton_primes[d], dimension_seed);
+    }
+    Sampler *clone(uint32_t seed)
+    {
+        return new HaltonSampler(samples_per_pixel, this->seed);
+    }
+};
+
+// direction numbers for the first four sobol dimensions, from the Joe-Kuo tables
+struct sobol_table
+{
+    sobol_table()
+    {
+        const int s[4] = {0, 1, 2, 3};
+        const uint32_t a[4] = {0, 0, 1, 1};
+        const uint32_t m[4][3] = {{1}, {1}, {1, 3}, {1, 3, 1}};
+        for (int k = 0; k < 32; k++)
+        {
+            directions[0][k] = 1u << (31 - k);
+        }
+        for (int d = 1; d < 4; d++)
+        {
+            for (int k = 0; k < 32; k++)
+            {
+                if (k < s[d])
+                {
+                    directions[d][k] = m[d][k] << (31 - k);
+                }
+                else
+                {
+                    uint32_t v = directions[d][k - s[d]];
+                    v ^= v >> s[d];
+                    for (int i = 1; i < s[d]; i++)
+                    {
+                        if ((a[d] >> (s[d] - 1 - i)) & 1)
+                        {
+                            v ^= directions[d][k - i];
+                        }
+                    }
+                    directions[d][k] = v;
+                }
+            }
+        }
+    }
+    uint32_t sample(uint32_t index, int d) const
+    {
+        uint32_t x = 0;
+        for (int bit = 0; index; index >>= 1, bit++)
+        {
+            if (index & 1)
+            {
+                x ^= directions[d][bit];
+            }
+        }
+        return x;
+    }
+    uint32_t directions[4][32];
+};
+
+// owen scrambled sobol, padded in blocks of 4 dimensions.
+// each block shuffles the sample index with its own seed, so that blocks are decorrelated from each other (Burley 2020).
+inline float owen_scrambled_sobol(uint32_t sample_index, int d, uint32_t seed)
+{
+    static const sobol_table table;
+    uint32_t block_seed = hash_combine(seed, d / 4);
+    uint32_t index = nested_uniform_scramble(sample_index, block_seed);
+    uint32_t x = table.sample(index, d % 4);
+    return to_unit_float(nested_uniform_scramble(x, hash_combine(block_seed, d % 4)));
+}
+
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler(int samples_per_pixel, uint32_t seed = 0) : Sampler(samples_per_pixel, seed) {}
+    float get_1d()
+    {
+        return owen_scrambled_sobol(sample_index, dimension++, pixel_seed);
+    }
+    Sampler *clone(uint32_t seed)
+    {
+        return new SobolSampler(samples_per_pixel, this->seed);
+    }
+};
+
+// spreads the bits of a 16 bit integer out to the even bits
+inline uint32_t part_1_by_1(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+#define BLUE_NOISE_TILE_BITS 6
+
+// owen scrambled sobol where neighbouring pixels share one sequence instead of each getting their own (Ahmed and Wonka 2020).
+// pixels are ranked along a morton curve over 64x64 tiles, with the order of the quadrants randomly permuted at every level,
+// and each pixel takes the next block of samples_per_pixel (rounded up to a power of 2) consecutive sample indices.
+// the owen scrambling keeps aligned blocks of indices together, so every aligned 2x2, 4x4, ... group of pixels
+// jointly covers a stratified set of samples in every dimension. the error of neighbouring pixels cancels out instead of clumping,
+// which pushes the error of a 1-4 spp preview into high frequencies (blue noise), while every pixel still converges like sobol.
+// samples past samples_per_pixel overlap the next pixel's block, and are correlated with it.
+class BlueNoiseSampler : public Sampler
+{
+public:
+    BlueNoiseSampler(int samples_per_pixel, uint32_t seed = 0) : Sampler(samples_per_pixel, seed), sample_bits(0), index(0)
+    {
+        while ((1 << sample_bits) < samples_per_pixel)
+        {
+            sample_bits++;
+        }
+    }
+    void start_pixel(int x, int y, int sample_index)
+    {
+        pixel_x = x;
+        pixel_y = y;
+        this->sample_index = sample_index;
+        dimension = 0;
+        pixel_seed = hash_combine(hash_combine(seed, x >> BLUE_NOISE_TILE_BITS), y >> BLUE_NOISE_TILE_BITS);
+        const int tile_mask = (1 << BLUE_NOISE_TILE_BITS) - 1;
+        uint32_t morton = (part_1_by_1(y & tile_mask) << 1) | part_1_by_1(x & tile_mask);
+        // scramble the morton code from the top down, which permutes quadrants within quadrants
+        const int shift = 32 - 2 * BLUE_NOISE_TILE_BITS;
+        uint32_t rank = nested_uniform_scramble(morton << shift, pixel_seed) >> shift;
+        index = (rank << sample_bits) + sample_index;
+    }
+    float get_1d()
+    {
+        return owen_scrambled_sobol(index, dimension++, pixel_seed);
+    }
+    Sampler *clone(uint32_t seed)
+    {
+        return new BlueNoiseSampler(samples_per_pixel, this->seed);
+    }
+    int sample_bits;
+    uint32_t index;
+};
+
+Sampler *make_sampler(SamplerType type, int samples_per_pixel, uint32_t seed = 0)
+{
+    switch (type)
+    {
+    case BLUE_NOISE:
+        return new BlueNoiseSampler(samples_per_pixel, seed);
+    case STRATIFIED:
+        return new StratifiedSampler(samples_per_pixel, seed);
+    case HALTON:
+        return new HaltonSampler(samples_per_pixel, seed);
+    case SOBOL:
+        return new SobolSampler(samples_per_pixel, seed);
+    case INDEPENDENT:
+    default:
+        return new IndependentSampler(samples_per_pixel, seed);
+    }
+}
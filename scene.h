@@ -7,15 +7,6 @@
 
 typedef vec3 color;
 
-enum material_type
-{
-    LAMBERTIAN,
-    METAL,
-    DIELECTRIC,
-    DIFFUSE_LIGHT,
-    ISOTROPIC
-};
-
 material_type get_material_type_for(std::string type)
 {
     static std::map<std::string, material_type> mapping = {
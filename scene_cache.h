@@ -0,0 +1,1005 @@
+#pragma once
+#include "scene_parser.h"
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a compiled copy of a scene, written next to its json (.scache) so that rendering the same scene again skips parsing the json,
+// decoding textures and building the bvh. everything build_scene made is flattened into records that refer to each other by index,
+// and texels are stored as they are in memory so that image textures point straight into the mapped file.
+//
+// file layout, all native endian:
+//   header (64 bytes): "SCNC", version, key, records_size, blob_offset, blob_size, then padding
+//   records: right after the header. the camera json and the asset paths, then textures, materials, density fields and hittables,
+//            each a count followed by that many records. anything a record refers to comes before it, so every section is read in one pass.
+//            then the bvh root, the lights with their light groups and the background
+//   blobs: at blob_offset, which is page aligned. the texels of every mip level, dense density grids and majorant cells, each 64 byte aligned
+//
+// key is a hash of the scene json, the contents of every file it names and the settings that change what gets built,
+// so a cache that's out of date is never used, just built again
+
+#define SCENE_CACHE_MAGIC 0x434e4353 // "SCNC"
+#define SCENE_CACHE_VERSION 2
+#define SCENE_CACHE_EXTENSION ".scache"
+#define SCENE_CACHE_BLOB_ALIGNMENT 64
+
+struct scene_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t records_size;
+    uint64_t blob_offset;
+    uint64_t blob_size;
+    uint32_t padding[6];
+};
+
+enum cached_texture_type
+{
+    CACHED_CONSTANT,
+    CACHED_CHECKER,
+    CACHED_NOISE,
+    CACHED_TURBULENCE,
+    CACHED_IMAGE,
+    CACHED_TILED
+};
+
+enum cached_density_type
+{
+    CACHED_CONSTANT_DENSITY,
+    CACHED_TEXTURE_DENSITY,
+    CACHED_GRID_DENSITY,
+    CACHED_SPARSE_DENSITY
+};
+
+enum cached_hittable_type
+{
+    CACHED_SPHERE,
+    CACHED_RECT,
+    CACHED_BOX,
+    CACHED_INSTANCE,
+    CACHED_MEDIUM,
+    CACHED_BVH
+};
+
+// FNV-1a over 8 byte words instead of single bytes, so that hashing the textures of a big scene doesn't take longer than loading it.
+// every step is invertible, so changing any one word always changes the hash
+class content_hash
+{
+public:
+    content_hash() : value(0xcbf29ce484222325ull) {}
+    void add(const void *data, size_t size)
+    {
+        const char *bytes = (const char *)data;
+        for (; size >= 8; bytes += 8, size -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, bytes, size);
+        mix(tail ^ ((uint64_t)size << 56));
+    }
+    // the length goes in first, so that neighbouring strings can't trade characters without changing the hash
+    void add(const std::string &s)
+    {
+        uint64_t size = s.size();
+        add(&size, sizeof(size));
+        add(s.data(), s.size());
+    }
+    void add_file(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            add(std::string("missing"));
+            return;
+        }
+        std::vector<char> chunk(1 << 20);
+        while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0)
+        {
+            add(chunk.data(), file.gcount());
+        }
+    }
+    uint64_t value;
+
+private:
+    void mix(uint64_t word)
+    {
+        value = (value ^ word) * 0x100000001b3ull;
+        // the multiply only carries upwards, so the high bits are folded back down
+        value ^= value >> 29;
+    }
+};
+
+// the files a scene json names, which what gets built depends on: png textures, raw density grids and sparse volumes
+void collect_asset_paths(const json &j, std::vector<std::string> &paths)
+{
+    if (j.is_object())
+    {
+        for (auto it = j.begin(); it != j.end(); ++it)
+        {
+            if ((it.key() == "path" || it.key() == "file" || it.key() == "sparse") && it.value().is_string())
+            {
+                paths.push_back(it.value().get<std::string>());
+            }
+            else
+            {
+                collect_asset_paths(it.value(), paths);
+            }
+        }
+    }
+    else if (j.is_array())
+    {
+        for (auto &element : j)
+        {
+            collect_asset_paths(element, paths);
+        }
+    }
+}
+
+// tile_size is 0 without a tile cache, since png textures are built differently with one
+uint64_t scene_cache_key(const std::string &scene_text, const std::vector<std::string> &assets, int tile_size)
+{
+    content_hash hash;
+    uint32_t version = SCENE_CACHE_VERSION;
+    hash.add(&version, sizeof(version));
+    hash.add(&tile_size, sizeof(tile_size));
+    hash.add(scene_text);
+    for (auto &path : assets)
+    {
+        hash.add(path);
+        hash.add_file(path);
+    }
+    return hash.value;
+}
+
+class scene_cache_writer
+{
+public:
+    // false, with the reason in error, if the scene has something that can't be stored
+    bool write(const World *world, const json &camera_json, const std::vector<std::string> &assets, uint64_t key, std::string path)
+    {
+        if (!world->animations.empty())
+        {
+            // the cache has the bvh as it was split, which keyframes move things out of
+            error = "keyframed instances are only read from the json";
+            return false;
+        }
+        std::string world_record;
+        put<int32_t>(world_record, hittable_index(world->ptr));
+        put<int32_t>(world_record, world->lights.size());
+        for (size_t k = 0; k < world->lights.size(); k++)
+        {
+            put<int32_t>(world_record, hittable_index(world->lights[k]));
+            put_string(world_record, world->light_group_labels[k]);
+        }
+        put<int32_t>(world_record, texture_index(world->background));
+        put<uint8_t>(world_record, world->environment != nullptr);
+
+        // materials go last since they can add textures, but are read right after them
+        const std::vector<material> &table = scene_materials().materials;
+        std::string materials;
+        for (const material &m : table)
+        {
+            put<int32_t>(materials, m.type);
+            put<int32_t>(materials, texture_index(m.tex));
+            put_vec3(materials, m.color);
+            put<float>(materials, m.param);
+            put<float>(materials, m.roughness);
+            put<uint8_t>(materials, m.two_sided);
+        }
+        if (!error.empty())
+        {
+            return false;
+        }
+
+        std::string records;
+        put_string(records, camera_json.dump());
+        put<int32_t>(records, assets.size());
+        for (auto &asset : assets)
+        {
+            put_string(records, asset);
+        }
+        put<int32_t>(records, textures.count);
+        records += textures.bytes;
+        put<int32_t>(records, table.size());
+        records += materials;
+        put<int32_t>(records, densities.count);
+        records += densities.bytes;
+        put<int32_t>(records, hittables.count);
+        records += hittables.bytes;
+        records += world_record;
+
+        scene_cache_header header = {};
+        header.magic = SCENE_CACHE_MAGIC;
+        header.version = SCENE_CACHE_VERSION;
+        header.key = key;
+        header.records_size = records.size();
+        header.blob_offset = (sizeof(header) + records.size() + 4095) / 4096 * 4096;
+        header.blob_size = blob_size;
+
+        // written aside and renamed over the old cache, so a render that's interrupted or running at the same time never sees half a file
+        std::string temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary);
+        file.write((const char *)&header, sizeof(header));
+        file.write(records.data(), records.size());
+        std::string zeros(header.blob_offset - sizeof(header) - records.size(), '\0');
+        file.write(zeros.data(), zeros.size());
+        uint64_t written = 0;
+        for (const blob &b : blobs)
+        {
+            zeros.assign(b.offset - written, '\0');
+            file.write(zeros.data(), zeros.size());
+            file.write((const char *)b.data, b.size);
+            written = b.offset + b.size;
+        }
+        file.close();
+        if (!file || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            error = "could not write " + path;
+            return false;
+        }
+        return true;
+    }
+
+    std::string error;
+
+private:
+    // records of one kind, in the order they're read back
+    struct section
+    {
+        std::string bytes;
+        int count = 0;
+    };
+    struct blob
+    {
+        const void *data;
+        size_t size;
+        uint64_t offset;
+    };
+
+    template <typename T>
+    static void put(std::string &out, T value)
+    {
+        out.append((const char *)&value, sizeof(T));
+    }
+    static void put_vec3(std::string &out, const vec3 &v)
+    {
+        put<float>(out, v.x());
+        put<float>(out, v.y());
+        put<float>(out, v.z());
+    }
+    static void put_aabb(std::string &out, const aabb &box)
+    {
+        put_vec3(out, box.min());
+        put_vec3(out, box.max());
+    }
+    static void put_string(std::string &out, const std::string &s)
+    {
+        put<uint32_t>(out, s.size());
+        out += s;
+    }
+    // returns the offset of data in the blob section. data isn't copied, so it has to stay alive until the file is written
+    uint64_t put_blob(const void *data, size_t size)
+    {
+        uint64_t offset = (blob_size + SCENE_CACHE_BLOB_ALIGNMENT - 1) / SCENE_CACHE_BLOB_ALIGNMENT * SCENE_CACHE_BLOB_ALIGNMENT;
+        blobs.push_back({data, size, offset});
+        blob_size = offset + size;
+        return offset;
+    }
+    int add(section &s, const void *object, const std::string &record)
+    {
+        s.bytes += record;
+        indices[object] = s.count;
+        return s.count++;
+    }
+
+    void put_image(std::string &record, const image_texture &image)
+    {
+        put<int32_t>(record, CACHED_IMAGE);
+        put<int32_t>(record, image.width);
+        put<int32_t>(record, image.height);
+        put<int32_t>(record, image.filter);
+        put<int32_t>(record, image.levels.size());
+        for (const mip_level &level : image.levels)
+        {
+            put<int32_t>(record, level.width);
+            put<int32_t>(record, level.height);
+            put<int32_t>(record, level.format);
+            put<uint8_t>(record, level.decode == srgb_decode_table());
+            put<uint64_t>(record, put_blob(level.bytes(), level.memory_bytes()));
+        }
+    }
+    // -1 for none. everything a texture refers to is added before it
+    int texture_index(const texture *t)
+    {
+        if (t == nullptr)
+        {
+            return -1;
+        }
+        auto found = indices.find(t);
+        if (found != indices.end())
+        {
+            return found->second;
+        }
+        std::string record;
+        if (auto c = dynamic_cast<const constant_texture *>(t))
+        {
+            put<int32_t>(record, CACHED_CONSTANT);
+            put_vec3(record, c->color);
+            put<float>(record, c->a);
+        }
+        else if (auto c = dynamic_cast<const checker_texture *>(t))
+        {
+            int even = texture_index(c->even);
+            int odd = texture_index(c->odd);
+            put<int32_t>(record, CACHED_CHECKER);
+            put<int32_t>(record, even);
+            put<int32_t>(record, odd);
+            put<float>(record, c->scale);
+        }
+        else if (auto n = dynamic_cast<const noise_texture *>(t))
+        {
+            // the perlin tables are shared by every noise texture in the process, so only the scale is part of the scene
+            put<int32_t>(record, CACHED_NOISE);
+            put<float>(record, n->scale);
+        }
+        else if (auto n = dynamic_cast<const turbulence_texture *>(t))
+        {
+            put<int32_t>(record, CACHED_TURBULENCE);
+            put<float>(record, n->scale);
+        }
+        else if (auto image = dynamic_cast<const image_texture *>(t))
+        {
+            put_image(record, *image);
+        }
+        else if (auto tiled = dynamic_cast<const tiled_image_texture *>(t))
+        {
+            if (tiled->resident)
+            {
+                // its tiled file couldn't be written, so it's cached like any other image in memory
+                put_image(record, *tiled->resident);
+            }
+            else
+            {
+                put<int32_t>(record, CACHED_TILED);
+                put<int32_t>(record, tiled->filter);
+                put_string(record, tiled->path);
+            }
+        }
+        else
+        {
+            error = "a texture of a type the scene cache doesn't know";
+            return -1;
+        }
+        return add(textures, t, record);
+    }
+
+    int density_index(const density_field *f)
+    {
+        auto found = indices.find(f);
+        if (found != indices.end())
+        {
+            return found->second;
+        }
+        std::string record;
+        if (auto c = dynamic_cast<const constant_density *>(f))
+        {
+            put<int32_t>(record, CACHED_CONSTANT_DENSITY);
+            put<float>(record, c->d);
+        }
+        else if (auto t = dynamic_cast<const texture_density *>(f))
+        {
+            int tex = texture_index(t->tex);
+            put<int32_t>(record, CACHED_TEXTURE_DENSITY);
+            put<int32_t>(record, tex);
+            put<float>(record, t->scale);
+        }
+        else if (auto g = dynamic_cast<const grid_density *>(f))
+        {
+            put<int32_t>(record, CACHED_GRID_DENSITY);
+            put<int32_t>(record, g->nx);
+            put<int32_t>(record, g->ny);
+            put<int32_t>(record, g->nz);
+            put_aabb(record, g->bounds);
+            put<float>(record, g->scale);
+            put<uint64_t>(record, put_blob(g->values.data(), g->values.size() * sizeof(float)));
+        }
+        else if (auto s = dynamic_cast<const sparse_grid_density *>(f))
+        {
+            // the bricks are already mapped from their own file
+            put<int32_t>(record, CACHED_SPARSE_DENSITY);
+            put_string(record, s->path);
+            put_aabb(record, s->bounds);
+            put<float>(record, s->scale);
+        }
+        else
+        {
+            error = "a density field of a type the scene cache doesn't know";
+            return -1;
+        }
+        return add(densities, f, record);
+    }
+
+    // -1 for none. children are added before their parents, so the bvh comes out bottom up
+    int hittable_index(const hittable *h)
+    {
+        if (h == nullptr)
+        {
+            return -1;
+        }
+        auto found = indices.find(h);
+        if (found != indices.end())
+        {
+            return found->second;
+        }
+        std::string record;
+        if (auto s = dynamic_cast<const sphere *>(h))
+        {
+            put<int32_t>(record, CACHED_SPHERE);
+            put_vec3(record, s->center);
+            put<float>(record, s->radius);
+            put<int32_t>(record, s->mat_id);
+        }
+        else if (auto r = dynamic_cast<const rect *>(h))
+        {
+            put<int32_t>(record, CACHED_RECT);
+            put<float>(record, r->x0);
+            put<float>(record, r->z0);
+            put<float>(record, r->x1);
+            put<float>(record, r->z1);
+            put<float>(record, r->y);
+            put<int32_t>(record, r->mat_id);
+            put<int32_t>(record, r->type);
+            put<uint8_t>(record, r->normal);
+        }
+        else if (auto b = dynamic_cast<const box *>(h))
+        {
+            // the sides are rebuilt from the corners, and all of them have the same material
+            const rect *side = (const rect *)((const hittable_list *)b->group)->list[0];
+            put<int32_t>(record, CACHED_BOX);
+            put_vec3(record, b->p0);
+            put_vec3(record, b->p1);
+            put<int32_t>(record, side->mat_id);
+        }
+        else if (auto i = dynamic_cast<const instance *>(h))
+        {
+            int child = hittable_index(i->ptr);
+            put<int32_t>(record, CACHED_INSTANCE);
+            put<int32_t>(record, child);
+            Eigen::Matrix4f matrix = i->transform._transform.matrix();
+            record.append((const char *)matrix.data(), 16 * sizeof(float));
+        }
+        else if (auto m = dynamic_cast<const heterogeneous_medium *>(h))
+        {
+            int boundary = hittable_index(m->boundary);
+            int field = density_index(m->field);
+            const majorant_grid *majorants = m->majorants;
+            put<int32_t>(record, CACHED_MEDIUM);
+            put<int32_t>(record, boundary);
+            put<int32_t>(record, field);
+            put<int32_t>(record, m->phase_function);
+            put_aabb(record, majorants->bounds);
+            put<int32_t>(record, majorants->resolution);
+            put<uint64_t>(record, put_blob(majorants->cells.data(), majorants->cells.size() * sizeof(float)));
+        }
+        else if (auto node = dynamic_cast<const bvh_node *>(h))
+        {
+            int left = hittable_index(node->left);
+            int right = hittable_index(node->right);
+            put<int32_t>(record, CACHED_BVH);
+            put<int32_t>(record, left);
+            put<int32_t>(record, right);
+            put_aabb(record, node->box);
+        }
+        else
+        {
+            error = "a primitive of a type the scene cache doesn't know";
+            return -1;
+        }
+        return add(hittables, h, record);
+    }
+
+    section textures, densities, hittables;
+    // every object already added, to its index within its own section
+    std::map<const void *, int> indices;
+    std::vector<blob> blobs;
+    uint64_t blob_size = 0;
+};
+
+class scene_cache_reader
+{
+public:
+    scene_cache_reader() : mapping(nullptr), mapping_size(0) {}
+    // unmaps the file unless a scene was read from it, since its image textures point into the mapping
+    ~scene_cache_reader()
+    {
+#ifndef _WIN32
+        if (mapping != nullptr && !keep_mapping)
+        {
+            munmap(mapping, mapping_size);
+        }
+#else
+        if (!keep_mapping)
+        {
+            delete contents;
+        }
+#endif
+    }
+
+    // nullptr when there's no cache at path or it isn't for scene_text and the files it names as they are now.
+    // camera_json is only filled in on success
+    World *read(std::string path, const std::string &scene_text, texture_cache *tile_cache, json &camera_json)
+    {
+        if (!map_file(path))
+        {
+            return nullptr;
+        }
+        header = *(const scene_cache_header *)base;
+        if (header.magic != SCENE_CACHE_MAGIC || header.version != SCENE_CACHE_VERSION || sizeof(header) + header.records_size > header.blob_offset ||
+            header.blob_offset + header.blob_size > mapping_size)
+        {
+            std::cout << "scene cache " << path << " has a bad header or is truncated\n";
+            return nullptr;
+        }
+        at = base + sizeof(header);
+        end = at + header.records_size;
+
+        std::string camera = get_string();
+        std::vector<std::string> assets(get<int32_t>());
+        for (size_t i = 0; i < assets.size() && ok; i++)
+        {
+            assets[i] = get_string();
+        }
+        if (!ok || scene_cache_key(scene_text, assets, tile_cache != nullptr ? tile_cache->tile_size : 0) != header.key)
+        {
+            std::cout << "scene cache " << path << " is out of date\n";
+            return nullptr;
+        }
+
+        std::vector<texture *> textures(std::max(get<int32_t>(), 0));
+        for (size_t i = 0; i < textures.size() && ok; i++)
+        {
+            textures[i] = read_texture(textures, i, tile_cache);
+        }
+        std::vector<material> materials(std::max(get<int32_t>(), 0));
+        for (size_t i = 0; i < materials.size() && ok; i++)
+        {
+            material &m = materials[i];
+            m.type = (material_type)get<int32_t>();
+            m.id = i;
+            m.tex = lookup(textures, get<int32_t>(), textures.size(), true);
+            m.color = get_vec3();
+            m.param = get<float>();
+            m.roughness = get<float>();
+            m.two_sided = get<uint8_t>();
+        }
+        std::vector<density_field *> densities(std::max(get<int32_t>(), 0));
+        for (size_t i = 0; i < densities.size() && ok; i++)
+        {
+            densities[i] = read_density(textures);
+        }
+        std::vector<hittable *> hittables(std::max(get<int32_t>(), 0));
+        for (size_t i = 0; i < hittables.size() && ok; i++)
+        {
+            hittables[i] = read_hittable(hittables, i, densities, materials);
+        }
+        bvh_node *root = dynamic_cast<bvh_node *>(lookup(hittables, get<int32_t>(), hittables.size(), false));
+        std::vector<hittable *> lights(std::max(get<int32_t>(), 0));
+        std::vector<std::string> light_groups(lights.size());
+        for (size_t i = 0; i < lights.size() && ok; i++)
+        {
+            lights[i] = lookup(hittables, get<int32_t>(), hittables.size(), false);
+            light_groups[i] = get_string();
+        }
+        texture *background = lookup(textures, get<int32_t>(), textures.size(), false);
+        bool importance_sample = get<uint8_t>();
+        if (!ok || root == nullptr || !scene_materials().materials.empty())
+        {
+            // the objects made so far are leaked, like the rest of a scene
+            std::cout << "scene cache " << path << " is corrupt\n";
+            return nullptr;
+        }
+
+        scene_materials().materials = materials;
+        environment_map *environment = nullptr;
+        image_texture *image = dynamic_cast<image_texture *>(background);
+        if (importance_sample && image != nullptr)
+        {
+            environment = new environment_map(image);
+        }
+        camera_json = json::parse(camera);
+        World *world = new World(root, background, lights, environment);
+        world->assign_light_groups(light_groups);
+        world->tile_cache = tile_cache;
+        keep_mapping = true;
+        std::cout << "read " << textures.size() << " textures, " << materials.size() << " materials and " << hittables.size() << " primitives and bvh nodes from " << path << '\n';
+        return world;
+    }
+
+private:
+    template <typename T>
+    T get()
+    {
+        T value = T();
+        if (!ok || end - at < (ptrdiff_t)sizeof(T))
+        {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, at, sizeof(T));
+        at += sizeof(T);
+        return value;
+    }
+    vec3 get_vec3()
+    {
+        float x = get<float>();
+        float y = get<float>();
+        float z = get<float>();
+        return vec3(x, y, z);
+    }
+    aabb get_aabb()
+    {
+        vec3 min = get_vec3();
+        return aabb(min, get_vec3());
+    }
+    std::string get_string()
+    {
+        uint32_t size = get<uint32_t>();
+        if (!ok || (size_t)(end - at) < size)
+        {
+            ok = false;
+            return "";
+        }
+        std::string s(at, size);
+        at += size;
+        return s;
+    }
+    // size bytes at offset in the blob section
+    const char *get_blob(uint64_t size)
+    {
+        uint64_t offset = get<uint64_t>();
+        if (!ok || offset > header.blob_size || size > header.blob_size - offset)
+        {
+            ok = false;
+            return nullptr;
+        }
+        return base + header.blob_offset + offset;
+    }
+    // records only refer to ones before them, so anything at or past before is corrupt
+    template <typename T>
+    T *lookup(const std::vector<T *> &objects, int32_t index, size_t before, bool optional)
+    {
+        if (optional && index == -1)
+        {
+            return nullptr;
+        }
+        if (index < 0 || (size_t)index >= before || (size_t)index >= objects.size())
+        {
+            ok = false;
+            return nullptr;
+        }
+        return objects[index];
+    }
+
+    texture *read_texture(const std::vector<texture *> &textures, size_t index, texture_cache *tile_cache)
+    {
+        switch (get<int32_t>())
+        {
+        case CACHED_CONSTANT:
+        {
+            vec3 color = get_vec3();
+            return new constant_texture(color, get<float>());
+        }
+        case CACHED_CHECKER:
+        {
+            texture *even = lookup(textures, get<int32_t>(), index, false);
+            texture *odd = lookup(textures, get<int32_t>(), index, false);
+            return new checker_texture(even, odd, get<float>());
+        }
+        case CACHED_NOISE:
+            return new noise_texture(get<float>());
+        case CACHED_TURBULENCE:
+            return new turbulence_texture(get<float>());
+        case CACHED_IMAGE:
+        {
+            image_texture *image = new image_texture(0, 0);
+            image->width = get<int32_t>();
+            image->height = get<int32_t>();
+            image->filter = (texture_filter)get<int32_t>();
+            int count = get<int32_t>();
+            // one level per halving of a 32 bit size at most
+            if (count < 0 || count > 33)
+            {
+                ok = false;
+                return image;
+            }
+            image->levels.assign(count, mip_level());
+            for (mip_level &level : image->levels)
+            {
+                level.width = get<int32_t>();
+                level.height = get<int32_t>();
+                level.format = (texel_format)get<int32_t>();
+                level.decode = get<uint8_t>() ? srgb_decode_table() : linear_decode_table();
+                if (level.width < 0 || level.height < 0 || (level.format != TEXEL_RGBA8 && level.format != TEXEL_RGBA16F))
+                {
+                    ok = false;
+                    break;
+                }
+                // no copy, the texels are paged in from the cache as they're used
+                level.point_at((const uint8_t *)get_blob(level.memory_bytes()));
+            }
+            return image;
+        }
+        case CACHED_TILED:
+        {
+            texture_filter filter = (texture_filter)get<int32_t>();
+            std::string path = get_string();
+            if (!ok || tile_cache == nullptr)
+            {
+                ok = false;
+                return nullptr;
+            }
+            tiled_image_texture *tiled = new tiled_image_texture(path, tile_cache);
+            tiled->filter = filter;
+            // the tiles are a separate file, which may be gone even though the png is the same
+            ok = tiled->open();
+            return tiled;
+        }
+        default:
+            ok = false;
+            return nullptr;
+        }
+    }
+
+    density_field *read_density(const std::vector<texture *> &textures)
+    {
+        switch (get<int32_t>())
+        {
+        case CACHED_CONSTANT_DENSITY:
+            return new constant_density(get<float>());
+        case CACHED_TEXTURE_DENSITY:
+        {
+            texture *tex = lookup(textures, get<int32_t>(), textures.size(), false);
+            return new texture_density(tex, get<float>());
+        }
+        case CACHED_GRID_DENSITY:
+        {
+            int nx = get<int32_t>();
+            int ny = get<int32_t>();
+            int nz = get<int32_t>();
+            aabb bounds = get_aabb();
+            float scale = get<float>();
+            if (nx < 0 || ny < 0 || nz < 0)
+            {
+                ok = false;
+                return nullptr;
+            }
+            size_t count = (size_t)nx * ny * nz;
+            const float *values = (const float *)get_blob(count * sizeof(float));
+            if (!ok)
+            {
+                return nullptr;
+            }
+            return new grid_density(nx, ny, nz, std::vector<float>(values, values + count), bounds, scale);
+        }
+        case CACHED_SPARSE_DENSITY:
+        {
+            std::string path = get_string();
+            aabb bounds = get_aabb();
+            return new sparse_grid_density(path, bounds, get<float>());
+        }
+        default:
+            ok = false;
+            return nullptr;
+        }
+    }
+
+    hittable *read_hittable(const std::vector<hittable *> &hittables, size_t index, const std::vector<density_field *> &densities, std::vector<material> &materials)
+    {
+        switch (get<int32_t>())
+        {
+        case CACHED_SPHERE:
+        {
+            sphere *s = new sphere();
+            s->center = get_vec3();
+            s->radius = get<float>();
+            s->mat_id = get_material_id(materials);
+            return s;
+        }
+        case CACHED_RECT:
+        {
+            rect *r = new rect();
+            r->x0 = get<float>();
+            r->z0 = get<float>();
+            r->x1 = get<float>();
+            r->z1 = get<float>();
+            r->y = get<float>();
+            r->mat_id = get_material_id(materials);
+            r->type = (plane_enum)get<int32_t>();
+            r->normal = get<uint8_t>();
+            return r;
+        }
+        case CACHED_BOX:
+        {
+            vec3 p0 = get_vec3();
+            vec3 p1 = get_vec3();
+            int mat_id = get_material_id(materials);
+            // the records already have their ids, so the sides refer to the same index without adding anything to the table
+            return new box(p0, p1, mat_id >= 0 ? &materials[mat_id] : nullptr);
+        }
+        case CACHED_INSTANCE:
+        {
+            hittable *child = lookup(hittables, get<int32_t>(), index, false);
+            Eigen::Matrix4f matrix;
+            for (int i = 0; i < 16; i++)
+            {
+                matrix.data()[i] = get<float>();
+            }
+            if (!ok)
+            {
+                return nullptr;
+            }
+            Eigen::Affine3f transform;
+            transform.matrix() = matrix;
+            return new instance(child, transform3(transform));
+        }
+        case CACHED_MEDIUM:
+        {
+            hittable *boundary = lookup(hittables, get<int32_t>(), index, false);
+            density_field *field = lookup(densities, get<int32_t>(), densities.size(), false);
+            int phase_function = get_material_id(materials);
+            aabb bounds = get_aabb();
+            int resolution = get<int32_t>();
+            if (resolution < 0)
+            {
+                ok = false;
+                return nullptr;
+            }
+            size_t count = (size_t)resolution * resolution * resolution;
+            const float *cells = (const float *)get_blob(count * sizeof(float));
+            if (!ok)
+            {
+                return nullptr;
+            }
+            majorant_grid *majorants = new majorant_grid(bounds, resolution, std::vector<float>(cells, cells + count));
+            return new heterogeneous_medium(boundary, field, phase_function, majorants);
+        }
+        case CACHED_BVH:
+        {
+            // the tree comes back exactly as it was built, instead of being split again along new random axes
+            bvh_node *node = new bvh_node();
+            node->left = lookup(hittables, get<int32_t>(), index, false);
+            node->right = lookup(hittables, get<int32_t>(), index, false);
+            node->box = get_aabb();
+            return node;
+        }
+        default:
+            ok = false;
+            return nullptr;
+        }
+    }
+    int get_material_id(const std::vector<material> &materials)
+    {
+        int id = get<int32_t>();
+        if (id < -1 || id >= (int)materials.size())
+        {
+            ok = false;
+            return -1;
+        }
+        return id;
+    }
+
+    bool map_file(std::string path)
+    {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(scene_cache_header))
+        {
+            close(fd);
+            return false;
+        }
+        mapping_size = info.st_size;
+        mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            return false;
+        }
+        base = (const char *)mapping;
+#else
+        // no mmap, so read the whole file instead
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            return false;
+        }
+        contents = new std::vector<char>((size_t)file.tellg());
+        file.seekg(0);
+        if (contents->size() < sizeof(scene_cache_header) || !file.read(contents->data(), contents->size()))
+        {
+            return false;
+        }
+        mapping_size = contents->size();
+        base = contents->data();
+#endif
+        return true;
+    }
+
+    scene_cache_header header;
+    const char *base;
+    const char *at;
+    const char *end;
+    bool ok = true;
+    bool keep_mapping = false;
+    void *mapping;
+    size_t mapping_size;
+#ifdef _WIN32
+    std::vector<char> *contents = nullptr;
+#endif
+};
+
+// the scene from its cache when the cache is current, otherwise built from the json and cached for next time.
+// camera_json is filled in either way
+World *load_scene(std::string scene_path, texture_cache *tile_cache, int threads, bool use_cache, json &camera_json)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    std::ifstream scene_file(scene_path, std::ios::binary);
+    std::stringstream scene_text;
+    scene_text << scene_file.rdbuf();
+    std::string cache_path = scene_path + SCENE_CACHE_EXTENSION;
+    if (use_cache)
+    {
+        scene_cache_reader reader;
+        World *world = reader.read(cache_path, scene_text.str(), tile_cache, camera_json);
+        if (world != nullptr)
+        {
+            std::cout << std::fixed << std::setprecision(1) << "scene loaded from cache in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms\n";
+            std::cout.unsetf(std::ios::floatfield);
+            return world;
+        }
+    }
+
+    json scene = json::parse(scene_text.str());
+    camera_json = scene["camera"];
+    World *world = build_scene(scene, tile_cache, threads);
+    if (use_cache)
+    {
+        auto cache_start = std::chrono::high_resolution_clock::now();
+        std::vector<std::string> assets;
+        collect_asset_paths(scene, assets);
+        uint64_t key = scene_cache_key(scene_text.str(), assets, tile_cache != nullptr ? tile_cache->tile_size : 0);
+        scene_cache_writer writer;
+        if (writer.write(world, camera_json, assets, key, cache_path))
+        {
+            std::cout << std::fixed << std::setprecision(1) << "wrote scene cache " << cache_path << " in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cache_start).count() << " ms\n";
+            std::cout.unsetf(std::ios::floatfield);
+        }
+        else
+        {
+            std::cout << "not caching the scene: " << writer.error << '\n';
+        }
+    }
+    return world;
+}
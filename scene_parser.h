@@ -5,12 +5,21 @@
 #include "material.h"
 #include "primitive.h"
 #include "volume.h"
+#include "sparse_volume.h"
 #include "world.h"
 #include "scene.h"
 #include "image.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
 #include "thirdparty/json.hpp"
 #include "thirdparty/lodepng/lodepng.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <map>
+#include <sstream>
 #include <string>
 
 #define MAUVE vec3(0.8, 0.2, 0.8)
@@ -36,22 +45,34 @@ vec3 json_to_vec3(json color)
     return vec3(color.at(0), color.at(1), color.at(2));
 }
 
-texture *decode_into_texture(std::string path)
+// 16 bit pngs are kept at half float precision, everything else is expanded to 8 bit rgba.
+// srgb decodes the color channels to linear, for images painted or photographed rather than rendered
+image_texture *decode_into_texture(std::string path, bool srgb = false)
 {
     std::vector<unsigned char> image; //the raw pixels
     unsigned width, height;
 
+    // the bit depth is the 25th byte of the file, in the IHDR chunk that always comes first
+    std::ifstream file(path, std::ios::binary);
+    char header[25] = {};
+    file.read(header, sizeof(header));
+    unsigned bitdepth = header[24] == 16 ? 16 : 8;
+
     //decode
-    unsigned error = lodepng::decode(image, width, height, path.data());
+    unsigned error = lodepng::decode(image, width, height, path.data(), LCT_RGBA, bitdepth);
 
     //if there's an error, display it
     if (error)
     {
         std::cout << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
     }
-    //the pixels are now in the vector "image", 4 bytes per pixel, ordered RGBARGBA..., use it as texture, draw it, ...
+    //the pixels are now in the vector "image", 4 or 8 bytes per pixel, ordered RGBARGBA..., use it as texture, draw it, ...
 
-    return from_4byte_vector(image, width, height);
+    if (bitdepth == 16)
+    {
+        return from_8byte_vector(image, width, height, srgb);
+    }
+    return from_4byte_vector(image, width, height, srgb);
 }
 
 class wrapped_material
@@ -62,7 +83,7 @@ public:
     wrapped_material(material *_material, std::string type) : _material(_material), _type(type) {}
     material *_material;
     std::string _type;
-    material *unwrap()
+    material *unwrap() const
     {
         return _material;
     }
@@ -78,11 +99,11 @@ public:
     wrapped_hittable(hittable *_hittable, wrapped_material _material) : _hittable(_hittable), _material(_material) {}
     hittable *_hittable;
     wrapped_material _material;
-    hittable *unwrap()
+    hittable *unwrap() const
     {
         return _hittable;
     }
-    wrapped_material get_material()
+    wrapped_material get_material() const
     {
         return _material;
     }
@@ -101,19 +122,80 @@ texture *error_texture()
     return e_texture;
 }
 
+camera setup_camera(json camera_json, float aspect_ratio, vec3 vup = vec3(0, 1, 0))
+{
+    vec3 lookfrom(
+        camera_json["look_from"].at(0),
+        camera_json["look_from"].at(1),
+        camera_json["look_from"].at(2));
+
+    vec3 lookat(
+        camera_json["look_at"].at(0),
+        camera_json["look_at"].at(1),
+        camera_json["look_at"].at(2));
+
+    float vfov = camera_json.value("fov", 30.0);
+    float aperture = camera_json.value("aperture", 0.0);
+    float dist_to_focus = camera_json.value("dist_to_focus", 10.0);
+
+    return camera(lookfrom, lookat, vup, vfov, aspect_ratio,
+                  aperture, dist_to_focus, 0.0, 1.0);
+}
+
+// overwrites the parts of a transform that j_transform has. scale is a number or a vector
+void parse_transform_parts(const json &j_transform, vec3 &scale, vec3 &rotate, vec3 &translate)
+{
+    if (j_transform.contains("scale") && j_transform["scale"].is_array())
+    {
+        scale = json_to_vec3(j_transform["scale"]);
+    }
+    else if (j_transform.contains("scale"))
+    {
+        float fscale = j_transform["scale"].get<float>();
+        scale = vec3(fscale, fscale, fscale);
+    }
+    if (j_transform.contains("rotate"))
+    {
+        rotate = json_to_vec3(j_transform["rotate"]);
+    }
+    if (j_transform.contains("translate"))
+    {
+        translate = json_to_vec3(j_transform["translate"]);
+    }
+}
+
+// the isotropic phase function a volume scatters with, in the volume's "color"
+material *volume_phase_function(const json &element)
+{
+    vec3 color;
+    if (element.contains("color"))
+    {
+        color = json_to_vec3(element["color"]);
+        // } else if (element.contains("texture")) {
+    }
+    else
+    {
+        std::cout << "unimplemented\n";
+        color = MAUVE;
+    }
+    return new isotropic(color);
+}
+
+// only reads the maps, so primitives can be parsed on several threads at once. every material they use, including the phase functions
+// of volumes, has to be in scene_materials() already, since adding to it isn't thread safe
 wrapped_hittable
-parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::map<std::string, wrapped_material> materials, json element)
+parse_prim_or_instance(const std::map<std::string, wrapped_hittable> &primitives, const std::map<std::string, wrapped_material> &materials, const std::map<std::string, texture *> &textures,
+                       const std::map<const json *, material *> &phase_functions, const json &element)
 {
     // material assign
     wrapped_material _material;
     wrapped_hittable primitive;
-    std::cout << element << '\n';
 
     if (element.contains("material") && element["material"].contains("id"))
     {
         std::string material_id = element["material"]["id"].get<std::string>();
         assert(materials.count(material_id) > 0);
-        _material = materials[material_id];
+        _material = materials.at(material_id);
     }
     else
     {
@@ -125,12 +207,11 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
     switch (get_primitive_type_for(element["type"].get<std::string>()))
     {
     case MESH:
-        std::cout << "found MESH" << '\n';
+        std::cout << "WARNING! mesh primitives are not implemented yet, skipping " << element << '\n';
         break;
 
     case SPHERE:
     {
-        std::cout << "found SPHERE" << '\n';
         float r = 1.0;
         vec3 origin = vec3(0.0, 0.0, 0.0);
         if (element.contains("radius"))
@@ -146,13 +227,11 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
     }
     case RECT:
     {
-        std::cout << "found RECT" << '\n';
         plane_enum align = XZ;
         bool flipped = element.value("flip", false);
 
         if (element.contains("align"))
         {
-            std::cout << "set alignment to " << element["align"].get<std::string>() << '\n';
             align = plane_enum_mapping(element["align"].get<std::string>());
         }
 
@@ -186,10 +265,8 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
     }
     case BOX:
     {
-        std::cout << "found BOX" << '\n';
         if (element.contains("p0") && element.contains("p1"))
         {
-            std::cout << "\tp0 and p1 path" << std::endl;
             vec3 p0, p1;
             p0 = json_to_vec3(element["p0"]);
             p1 = json_to_vec3(element["p1"]);
@@ -197,7 +274,6 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
         }
         else
         {
-            std::cout << "\tsize path" << std::endl;
             vec3 size;
             if (element.contains("size"))
             {
@@ -214,21 +290,57 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
 
     case VOLUME:
     {
-        std::cout << "found VOLUME" << '\n';
         std::string primitive_id = element["primitive"].get<std::string>();
-        float density = element["density"].get<float>();
-        vec3 color;
-        if (element.contains("color"))
+        auto found = primitives.find(primitive_id);
+        if (found == primitives.end())
+        {
+            std::cout << "WARNING! volume refers to missing primitive " << primitive_id << '\n';
+            break;
+        }
+        hittable *boundary = found->second.unwrap();
+        // density is either a number, {"texture": id, "scale": s}, a sparse volume {"sparse": .svol path, "scale": s} made by convert_volume.py,
+        // or a grid {"resolution": [nx, ny, nz], "values": [...] or "file": raw float32 path, "scale": s}. volumes are stretched over the boundary's bounding box
+        const json &density = element["density"];
+        density_field *field;
+        int majorant_resolution = element.value("majorant_resolution", 16);
+        if (density.is_number())
+        {
+            field = new constant_density(density.get<float>());
+            majorant_resolution = 1;
+        }
+        else if (density.contains("texture"))
+        {
+            auto texture = textures.find(density["texture"].get<std::string>());
+            field = new texture_density(texture != textures.end() ? texture->second : error_texture(), density.value("scale", 1.0f));
+        }
+        else if (density.contains("sparse"))
         {
-            color = json_to_vec3(element["color"]);
-            // } else if (element.contains("texture")) {
+            aabb bounds;
+            boundary->bounding_box(0, 1, bounds);
+            field = new sparse_grid_density(density["sparse"].get<std::string>(), bounds, density.value("scale", 1.0f));
         }
         else
         {
-            std::cout << "unimplemented\n";
-            color = MAUVE;
+            std::vector<int> resolution = density["resolution"].get<std::vector<int>>();
+            std::vector<float> values;
+            if (density.contains("file"))
+            {
+                values = read_raw_grid(density["file"].get<std::string>(), resolution[0], resolution[1], resolution[2]);
+            }
+            else
+            {
+                values = density["values"].get<std::vector<float>>();
+            }
+            if (values.size() != (size_t)resolution[0] * resolution[1] * resolution[2])
+            {
+                std::cout << "density grid has " << values.size() << " values, expected " << resolution[0] * resolution[1] * resolution[2] << ". using an empty grid\n";
+                values.assign((size_t)resolution[0] * resolution[1] * resolution[2], 0.0f);
+            }
+            aabb bounds;
+            boundary->bounding_box(0, 1, bounds);
+            field = new grid_density(resolution[0], resolution[1], resolution[2], values, bounds, density.value("scale", 1.0f));
         }
-        primitive = wrapped_hittable(new constant_medium(primitives[primitive_id].unwrap(), density, color), primitives[primitive_id].get_material());
+        primitive = wrapped_hittable(new heterogeneous_medium(boundary, field, phase_functions.at(&element), majorant_resolution), found->second.get_material());
         break;
     }
 
@@ -238,10 +350,46 @@ parse_prim_or_instance(std::map<std::string, wrapped_hittable> primitives, std::
     return primitive;
 }
 
-World *build_scene(json scene)
+// wall clock time of each phase of loading a scene, printed once it's done
+class load_timer
 {
+public:
+    load_timer() : start(std::chrono::high_resolution_clock::now()), last(start) {}
+    void lap(std::string phase)
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        phases.emplace_back(phase, std::chrono::duration<double>(now - last).count());
+        last = now;
+    }
+    void print()
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << "scene loaded in " << std::chrono::duration<double>(last - start).count() * 1000 << " ms\n";
+        for (auto &phase : phases)
+        {
+            out << "    " << std::left << std::setw(22) << phase.first << std::right << std::setw(10) << phase.second * 1000 << " ms\n";
+        }
+        std::cout << out.str();
+    }
+
+private:
+    std::chrono::high_resolution_clock::time_point start, last;
+    std::vector<std::pair<std::string, double>> phases;
+};
+
+// textures are decoded on a pool of threads (one per hardware thread when threads is 0) while materials, primitives and the bvh are built,
+// since those only need to know where each texture will be. with a tile cache, png textures other than the background are read through it
+// instead of being loaded whole
+World *build_scene(json scene, texture_cache *tile_cache = nullptr, int threads = 0)
+{
+    load_timer timer;
+    thread_pool pool(threads);
+    std::vector<std::shared_future<void>> decoding;
+    std::atomic<long> decode_microseconds(0);
     std::vector<hittable *> list;
     std::vector<hittable *> lights;
+    std::vector<std::string> light_groups;
+    std::vector<instance_animation> animations;
     std::map<std::string, texture *> textures;
     std::map<std::string, wrapped_material> materials;
     std::map<std::string, wrapped_hittable> primitives;
@@ -255,7 +403,6 @@ World *build_scene(json scene)
         {
             continue;
         }
-        std::cout << element << '\n';
         // currently the only accepted asset type is a .obj or .png
         assert(element["type"].get<std::string>() == "object");
     }
@@ -266,7 +413,6 @@ World *build_scene(json scene)
         {
             continue;
         }
-        std::cout << element << '\n';
         // currently the only accepted asset type is a .png
         assert(element.contains("id"));
         std::string texture_id = element["id"].get<std::string>();
@@ -318,7 +464,48 @@ World *build_scene(json scene)
         case PNG:
         {
             std::string path = data["path"].get<std::string>();
-            textures.emplace(texture_id, decode_into_texture(path));
+            bool srgb = data.value("srgb", false);
+            texture_filter filter = get_texture_filter_for(data.value("filter", "trilinear"));
+            // the background stays in memory, since importance sampling it reads every texel up front
+            bool background = scene.contains("world") && scene["world"].value("texture", "") == texture_id;
+            if (tile_cache != nullptr && !background)
+            {
+                std::string tiled_path = path + TILED_TEXTURE_EXTENSION;
+                tiled_image_texture *tiled = new tiled_image_texture(tiled_path, tile_cache);
+                tiled->filter = filter;
+                textures.emplace(texture_id, tiled);
+                int tile_size = tile_cache->tile_size;
+                decoding.push_back(pool.submit([=, &decode_microseconds]() {
+                    auto decode_start = std::chrono::high_resolution_clock::now();
+                    if (!tiled_texture_is_current(path, tiled_path, tile_size, srgb))
+                    {
+                        std::cout << "converting " << path << " to tiles" << std::endl;
+                        image_texture *image = decode_into_texture(path, srgb);
+                        if (!write_tiled_texture(*image, tile_size, tiled_path))
+                        {
+                            std::cout << "could not write " << tiled_path << ", keeping " << path << " in memory" << std::endl;
+                            tiled->keep_resident(image);
+                            decode_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - decode_start).count();
+                            return;
+                        }
+                        delete image;
+                    }
+                    tiled->open();
+                    decode_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - decode_start).count();
+                }));
+                break;
+            }
+            // an empty texture for materials to point to, which the decoded image is moved into
+            image_texture *image = new image_texture(0, 0);
+            textures.emplace(texture_id, image);
+            decoding.push_back(pool.submit([=, &decode_microseconds]() {
+                auto decode_start = std::chrono::high_resolution_clock::now();
+                image_texture *decoded = decode_into_texture(path, srgb);
+                decoded->filter = filter;
+                *image = std::move(*decoded);
+                delete decoded;
+                decode_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - decode_start).count();
+            }));
             break;
         }
         default:
@@ -326,8 +513,8 @@ World *build_scene(json scene)
             textures.emplace(texture_id, error_texture());
         }
         }
-        std::cout << texture_id << std::endl;
     }
+    timer.lap("textures queued");
     // iterate through and construct materials
     for (auto &element : scene["materials"])
     {
@@ -342,15 +529,12 @@ World *build_scene(json scene)
             materials.emplace(mat_id, wrapped_error_material());
             continue;
         }
-        std::cout << element << '\n';
 
         json data = element["data"];
         switch (get_material_type_for(element["type"].get<std::string>()))
         {
         case LAMBERTIAN:
         {
-            std::cout << "found LAMBERTIAN" << '\n';
-
             if (data.contains("color"))
             {
                 materials.emplace(mat_id, wrapped_material(new lambertian(json_to_vec3(data["color"])), "lambertian"));
@@ -370,7 +554,6 @@ World *build_scene(json scene)
         }
         case METAL:
         {
-            std::cout << "found METAL" << '\n';
             vec3 color;
             if (data.contains("color"))
             {
@@ -388,7 +571,6 @@ World *build_scene(json scene)
         }
         case DIELECTRIC:
         {
-            std::cout << "found DIELECTRIC" << '\n';
             float ri = 1.450;
             if (data.contains("ior"))
             {
@@ -398,12 +580,11 @@ World *build_scene(json scene)
             {
                 std::cout << "colored dielectrics are currently unsupported\n";
             }
-            materials.emplace(mat_id, wrapped_material(new dielectric(ri), "dielectric"));
+            materials.emplace(mat_id, wrapped_material(new dielectric(ri, data.value("roughness", 0.0)), "dielectric"));
             break;
         }
         case DIFFUSE_LIGHT:
         {
-            std::cout << "found DIFFUSE_LIGHT" << '\n';
             float power;
             if (data.contains("power"))
             {
@@ -446,7 +627,26 @@ World *build_scene(json scene)
         }
     }
 
-    // iterate through primitives and instances. these are the non-instanced base prims that can be reused.
+    // added to the table here, in scene order, so that it's only read while primitives are parsed on several threads below and the
+    // material ids don't depend on which thread gets to a material first
+    material_id(error_material());
+    for (auto &element : scene["materials"])
+    {
+        auto found = materials.find(element.value("id", ""));
+        if (!element.value("skip", false) && found != materials.end())
+        {
+            material_id(found->second.unwrap());
+        }
+    }
+    timer.lap("materials");
+
+    // volumes with a texture density sample it to build their majorant grid, so those textures have to be decoded first
+    auto needs_textures = [](const json &element) {
+        return element.contains("density") && element["density"].is_object() && element["density"].contains("texture");
+    };
+    bool wait_for_textures = false;
+    // the base prims that can be reused, and the prims written directly into instances, which get replaced with references to a new id
+    std::vector<std::pair<std::string, const json *>> pending;
     for (auto &element : scene["primitives"])
     {
         std::string primitive_id;
@@ -458,9 +658,10 @@ World *build_scene(json scene)
         {
             primitive_id = element["id"].get<std::string>();
         }
-        primitives.emplace(primitive_id, parse_prim_or_instance(primitives, materials, element));
+        pending.emplace_back(primitive_id, &element);
+        wait_for_textures = wait_for_textures || needs_textures(element);
     }
-    std::cout << "finshed primitives read, scanning instances" << '\n';
+    std::vector<json> direct_primitives;
     for (auto &element : scene["instances"])
     {
         if (element["type"].get<std::string>() == "ref")
@@ -468,17 +669,64 @@ World *build_scene(json scene)
             // ignore refs
             continue;
         }
-
-        // replace directs with references to the primitive mapping
         std::string primitive_id = generate_new_id();
-        primitives.emplace(primitive_id, parse_prim_or_instance(primitives, materials, element["primitive"]));
+        direct_primitives.push_back(element["primitive"]);
         element["type"] = "ref";
         json new_prim_contents = {{"id", primitive_id}};
-        // json new_prim = {"primitive", new_prim_contents};
         element.erase("primitive");
         element.emplace("primitive", new_prim_contents);
+        pending.emplace_back(primitive_id, nullptr);
+    }
+    for (size_t i = 0, direct = 0; i < pending.size(); i++)
+    {
+        if (pending[i].second == nullptr)
+        {
+            pending[i].second = &direct_primitives[direct++];
+            wait_for_textures = wait_for_textures || needs_textures(*pending[i].second);
+        }
     }
-    std::cout << "finished instance scan, now constructing instances from primitives\n";
+    std::map<const json *, material *> phase_functions;
+    for (auto &p : pending)
+    {
+        if (get_primitive_type_for((*p.second)["type"].get<std::string>()) == VOLUME)
+        {
+            material *phase_function = volume_phase_function(*p.second);
+            material_id(phase_function);
+            phase_functions.emplace(p.second, phase_function);
+        }
+    }
+    if (wait_for_textures)
+    {
+        for (auto &d : decoding)
+        {
+            d.get();
+        }
+    }
+    // volumes refer to the primitive they fill, so prims are parsed in rounds: all the ones whose reference (if any) is already built
+    // go at once, which is every plain shape in the first round and the volumes around them in the second
+    while (!pending.empty())
+    {
+        std::vector<std::pair<std::string, const json *>> ready, blocked;
+        for (auto &p : pending)
+        {
+            const json &element = *p.second;
+            bool waiting = get_primitive_type_for(element["type"].get<std::string>()) == VOLUME && primitives.count(element.value("primitive", "")) == 0;
+            (waiting ? blocked : ready).push_back(p);
+        }
+        if (ready.empty())
+        {
+            // refers to something that doesn't exist or to each other. parsing warns about the missing primitive
+            ready.swap(blocked);
+        }
+        std::vector<wrapped_hittable> parsed(ready.size());
+        pool.parallel_for(ready.size(), [&](int i) { parsed[i] = parse_prim_or_instance(primitives, materials, textures, phase_functions, *ready[i].second); });
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            primitives.emplace(ready[i].first, parsed[i]);
+        }
+        pending.swap(blocked);
+    }
+    timer.lap("primitives");
     // iterate through normal instances, which are
     //      instanced primitives, i.e. primitives with a transform
     for (auto &element : scene["instances"])
@@ -488,51 +736,23 @@ World *build_scene(json scene)
             continue;
         }
 
-        std::cout << element << '\n';
-        transform3 transform;
-        if (!element.contains("transform"))
-        {
-            transform = transform3();
-        }
-        else
+        vec3 scale(1.0, 1.0, 1.0), rotate(0.0, 0.0, 0.0), translate(0.0, 0.0, 0.0);
+        if (element.contains("transform"))
         {
-            vec3 scale, rotate, translate;
-            json j_transform = element["transform"];
-            if (j_transform.contains("scale") && j_transform["scale"].is_array())
-            {
-                scale = json_to_vec3(j_transform["scale"]);
-            }
-            else
-            {
-                float fscale = j_transform.value("scale", 1.0);
-                scale = vec3(fscale, fscale, fscale);
-            }
-            if (j_transform.contains("rotate"))
-            {
-                rotate = json_to_vec3(j_transform["rotate"]);
-            }
-            else
-            {
-                rotate = vec3(0.0, 0.0, 0.0);
-            }
-            if (j_transform.contains("translate"))
-            {
-                translate = json_to_vec3(j_transform["translate"]);
-            }
-            else
-            {
-                translate = vec3(0.0, 0.0, 0.0);
-            }
-            transform = transform3(scale, rotate, translate);
+            parse_transform_parts(element["transform"], scale, rotate, translate);
         }
-        std::cout << "finished constructing transform for instance, now getting prim and creating instance for json\n";
-
+        transform3 transform(scale, rotate, translate);
         assert(element.contains("type") && element["type"].get<std::string>() == "ref");
 
         assert(element["primitive"].contains("id"));
         std::string primitive_id = element["primitive"]["id"].get<std::string>();
         assert(primitives.count(primitive_id) > 0);
         wrapped_hittable primitive = primitives[primitive_id];
+        if (primitive.unwrap() == nullptr)
+        {
+            // failed to parse, which was already warned about
+            continue;
+        }
 
         // assert(element["primitive"].contains("id"));
         // std::string primitive_id = element["primitive"]["id"].get<std::string>();
@@ -540,16 +760,45 @@ World *build_scene(json scene)
         // material *_material = materials[material_id];
         std::string mat_type = primitive.get_material()._type;
 
-        hittable *_instance = new instance(primitive.unwrap(), transform);
+        instance *_instance = new instance(primitive.unwrap(), transform);
         list.push_back(_instance);
+        // "keyframes" move the instance between frames of a sequence. each one is a frame number and any of scale, rotate and
+        // translate, with the ones it leaves out taken from "transform"
+        if (element.contains("keyframes") && !element["keyframes"].empty())
+        {
+            std::vector<keyframe> keys;
+            for (auto &key : element["keyframes"])
+            {
+                keyframe k = {key.value("frame", 0.0f), scale, rotate, translate};
+                parse_transform_parts(key, k.scale, k.rotate, k.translate);
+                keys.push_back(k);
+            }
+            std::sort(keys.begin(), keys.end(), [](const keyframe &a, const keyframe &b) { return a.frame < b.frame; });
+            animations.emplace_back(_instance, keys);
+        }
         if (mat_type == "diffuse_light")
         {
-            std::cout << "found diffuse light\n";
             lights.push_back(_instance);
+            light_groups.push_back(element.value("light_group", ""));
         }
     }
+    timer.lap("instances");
+
+    // built while the textures may still be decoding
+    std::cout << "constructing bvh with " << list.size() << " primitives and instances\n";
+    std::cout << "found " << lights.size() << " lights\n";
+    // the bvh is taken apart again when it's rebuilt between frames, so it gets a copy
+    std::vector<hittable *> objects = list;
+    bvh_node *bvh = new bvh_node(list.data(), list.size(), 0.0f, 0.0f);
+    timer.lap("bvh");
+    for (auto &d : decoding)
+    {
+        d.get();
+    }
+    timer.lap("waiting for textures");
 
     texture *background;
+    environment_map *environment = nullptr;
     if (scene.contains("world"))
     {
         if (scene["world"].contains("texture"))
@@ -557,6 +806,13 @@ World *build_scene(json scene)
             std::string texture_id = scene["world"]["texture"].get<std::string>();
             background = textures[texture_id];
             std::cout << "using referenced texture" << std::endl;
+            // image backgrounds get registered as a light so that NEE can importance sample them
+            image_texture *image = dynamic_cast<image_texture *>(background);
+            if (image != nullptr && image->width > 0 && image->height > 0 && scene["world"].value("importance_sample", true))
+            {
+                environment = new environment_map(image);
+                std::cout << "importance sampling world texture as a light" << std::endl;
+            }
         }
         else if (scene["world"].contains("color"))
         {
@@ -578,7 +834,7 @@ World *build_scene(json scene)
 
     // list.push_back(
     //     new instance(
-    //         new constant_medium(new box(165, 165, 165, error_material()), 0.01, vec3(0.9, 0.9, 0.9)),
+    //         new heterogeneous_medium(new box(165, 165, 165, error_material()), new constant_density(0.01), new isotropic(vec3(0.9, 0.9, 0.9))),
     //         transform3::from_rotate_and_translate(vec3(
     //                                                   0.0,
     //                                                   -0.1,
@@ -588,8 +844,17 @@ World *build_scene(json scene)
     //                                                   82.5,
     //                                                   147.5))));
 
-    // iterate through objects which are collections of instances
-    std::cout << "constructing bvh with " << list.size() << " primitives and instances\n";
-    std::cout << "found " << lights.size() << " lights\n";
-    return new World(new bvh_node(list.data(), list.size(), 0.0f, 0.0f), background, lights);
+    timer.lap("background");
+    timer.print();
+    std::cout << "    decoding " << decoding.size() << " textures took " << decode_microseconds / 1000 << " ms of work on " << pool.size() << " threads\n";
+    World *world = new World(bvh, background, lights, environment);
+    world->assign_light_groups(light_groups);
+    world->tile_cache = tile_cache;
+    world->objects = objects;
+    world->animations = animations;
+    if (!animations.empty())
+    {
+        std::cout << "found " << animations.size() << " keyframed instances\n";
+    }
+    return world;
 }
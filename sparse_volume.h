@@ -0,0 +1,250 @@
+#pragma once
+
+#include "volume.h"
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// sparse volumes for smoke and clouds that are mostly empty space.
+// the voxels are split into 8^3 bricks and only bricks with a nonzero voxel are stored. a top level index maps every brick position to
+// its stored brick or to -1 for empty space, and every stored brick keeps the min and max of its voxels.
+//
+// file layout, all little endian and 4 byte values. written by convert_volume.py
+//   header (64 bytes): "SVOL", version, nx, ny, nz, bricks_x, bricks_y, bricks_z, brick_count, data_offset, then padding
+//   index: bricks_x * bricks_y * bricks_z int32s, x fastest
+//   ranges: brick_count pairs of float32 min and max
+//   bricks: at data_offset, which is page aligned, brick_count * 512 float32s, x fastest within each brick
+//
+// the file is memory mapped, so bricks are only paged in once a ray gets close enough to read them
+
+#define SPARSE_VOLUME_MAGIC 0x4c4f5653 // "SVOL"
+#define SPARSE_VOLUME_VERSION 1
+#define BRICK_SIZE 8
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+struct sparse_volume_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nx, ny, nz;
+    uint32_t bricks_x, bricks_y, bricks_z;
+    uint32_t brick_count;
+    uint32_t data_offset;
+    uint32_t padding[6];
+};
+
+// stretched over bounds like grid_density, with the same trilinear interpolation between voxel centers
+class sparse_grid_density : public density_field
+{
+public:
+    sparse_grid_density(std::string path, aabb bounds, float scale = 1.0f) : path(path), bounds(bounds), scale(scale), mapping(nullptr), mapping_size(0)
+    {
+        if (!map_file(path))
+        {
+            std::cout << "could not load sparse volume " << path << ", using an empty one\n";
+            header = sparse_volume_header();
+            header.nx = header.ny = header.nz = 1;
+            header.bricks_x = header.bricks_y = header.bricks_z = 1;
+            empty_index = -1;
+            index = &empty_index;
+            ranges = nullptr;
+            bricks = nullptr;
+        }
+    }
+    ~sparse_grid_density()
+    {
+#ifndef _WIN32
+        if (mapping != nullptr)
+        {
+            munmap(mapping, mapping_size);
+        }
+#endif
+    }
+
+    // -1 for a brick position that's empty or outside the grid
+    inline int brick_at(int bx, int by, int bz) const
+    {
+        if (bx < 0 || by < 0 || bz < 0 || bx >= (int)header.bricks_x || by >= (int)header.bricks_y || bz >= (int)header.bricks_z)
+        {
+            return -1;
+        }
+        return index[(bz * header.bricks_y + by) * header.bricks_x + bx];
+    }
+    inline float voxel(int x, int y, int z) const
+    {
+        x = std::min(std::max(x, 0), (int)header.nx - 1);
+        y = std::min(std::max(y, 0), (int)header.ny - 1);
+        z = std::min(std::max(z, 0), (int)header.nz - 1);
+        int brick = brick_at(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE);
+        if (brick < 0)
+        {
+            return 0;
+        }
+        return bricks[(size_t)brick * BRICK_VOXELS + ((z % BRICK_SIZE) * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE + (x % BRICK_SIZE)];
+    }
+    vec3 to_grid(const vec3 &p) const
+    {
+        vec3 extent = bounds.max() - bounds.min();
+        vec3 local = p - bounds.min();
+        return vec3(local.x() / extent.x() * header.nx, local.y() / extent.y() * header.ny, local.z() / extent.z() * header.nz);
+    }
+    virtual float density(const vec3 &p) const
+    {
+        vec3 g = to_grid(p);
+        if (g.x() < 0 || g.y() < 0 || g.z() < 0 || g.x() > header.nx || g.y() > header.ny || g.z() > header.nz)
+        {
+            return 0;
+        }
+        g -= vec3(0.5, 0.5, 0.5);
+        int x = (int)floor(g.x());
+        int y = (int)floor(g.y());
+        int z = (int)floor(g.z());
+        float fx = g.x() - x;
+        float fy = g.y() - y;
+        float fz = g.z() - z;
+        float result = 0;
+        // most lookups have all 8 neighbours in one brick, which then only needs one trip through the index.
+        // at the last voxel of the grid the neighbour would be brick padding, so those go through voxel(), which clamps
+        if (x >= 0 && y >= 0 && z >= 0 && x % BRICK_SIZE != BRICK_SIZE - 1 && y % BRICK_SIZE != BRICK_SIZE - 1 && z % BRICK_SIZE != BRICK_SIZE - 1 &&
+            x + 1 < (int)header.nx && y + 1 < (int)header.ny && z + 1 < (int)header.nz)
+        {
+            int brick = brick_at(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE);
+            if (brick < 0)
+            {
+                return 0;
+            }
+            const float *corner = bricks + (size_t)brick * BRICK_VOXELS + ((z % BRICK_SIZE) * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE + (x % BRICK_SIZE);
+            for (int i = 0; i < 8; i++)
+            {
+                int dx = i & 1, dy = (i >> 1) & 1, dz = i >> 2;
+                float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+                result += w * corner[(dz * BRICK_SIZE + dy) * BRICK_SIZE + dx];
+            }
+            return scale * result;
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            int dx = i & 1, dy = (i >> 1) & 1, dz = i >> 2;
+            float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+            result += w * voxel(x + dx, y + dy, z + dz);
+        }
+        return scale * result;
+    }
+    // only reads the index and the per brick ranges, so building the majorant grid doesn't page in any voxels
+    virtual float max_density(const aabb &region) const
+    {
+        vec3 lo = to_grid(region.min());
+        vec3 hi = to_grid(region.max());
+        // one voxel of margin for interpolation, clamped to the grid the same way voxel() is
+        int x0 = std::max((int)floor(lo.x()) - 1, 0), x1 = std::min((int)floor(hi.x()) + 1, (int)header.nx - 1);
+        int y0 = std::max((int)floor(lo.y()) - 1, 0), y1 = std::min((int)floor(hi.y()) + 1, (int)header.ny - 1);
+        int z0 = std::max((int)floor(lo.z()) - 1, 0), z1 = std::min((int)floor(hi.z()) + 1, (int)header.nz - 1);
+        float result = 0;
+        for (int bz = z0 / BRICK_SIZE; bz <= z1 / BRICK_SIZE; bz++)
+        {
+            for (int by = y0 / BRICK_SIZE; by <= y1 / BRICK_SIZE; by++)
+            {
+                for (int bx = x0 / BRICK_SIZE; bx <= x1 / BRICK_SIZE; bx++)
+                {
+                    int brick = brick_at(bx, by, bz);
+                    if (brick >= 0)
+                    {
+                        result = ffmax(result, ranges[2 * brick + 1]);
+                    }
+                }
+            }
+        }
+        return scale * result;
+    }
+
+    std::string path;
+    sparse_volume_header header;
+    aabb bounds;
+    float scale;
+
+private:
+    bool map_file(std::string path)
+    {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(sparse_volume_header))
+        {
+            close(fd);
+            return false;
+        }
+        mapping_size = info.st_size;
+        mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            return false;
+        }
+        // bricks are read in whatever order rays visit them, and readahead would page in neighbouring bricks that may never be touched
+        madvise(mapping, mapping_size, MADV_RANDOM);
+        const char *base = (const char *)mapping;
+#else
+        // no mmap, so read the whole file instead
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            return false;
+        }
+        contents.resize((size_t)file.tellg());
+        file.seekg(0);
+        if (contents.size() < sizeof(sparse_volume_header) || !file.read(contents.data(), contents.size()))
+        {
+            return false;
+        }
+        mapping_size = contents.size();
+        const char *base = contents.data();
+#endif
+        header = *(const sparse_volume_header *)base;
+        size_t cells = (size_t)header.bricks_x * header.bricks_y * header.bricks_z;
+        size_t ranges_offset = sizeof(sparse_volume_header) + cells * sizeof(int32_t);
+        if (header.magic != SPARSE_VOLUME_MAGIC || header.version != SPARSE_VOLUME_VERSION || header.nx == 0 || header.ny == 0 || header.nz == 0 ||
+            header.bricks_x != (header.nx + BRICK_SIZE - 1) / BRICK_SIZE || header.bricks_y != (header.ny + BRICK_SIZE - 1) / BRICK_SIZE || header.bricks_z != (header.nz + BRICK_SIZE - 1) / BRICK_SIZE ||
+            ranges_offset + header.brick_count * 2 * sizeof(float) > header.data_offset ||
+            header.data_offset + (size_t)header.brick_count * BRICK_VOXELS * sizeof(float) > mapping_size)
+        {
+            std::cout << "sparse volume " << path << " has a bad header or is truncated\n";
+            return false;
+        }
+        index = (const int32_t *)(base + sizeof(sparse_volume_header));
+        ranges = (const float *)(base + ranges_offset);
+        bricks = (const float *)(base + header.data_offset);
+        for (size_t i = 0; i < cells; i++)
+        {
+            if (index[i] >= (int32_t)header.brick_count)
+            {
+                std::cout << "sparse volume " << path << " indexes past its last brick\n";
+                return false;
+            }
+        }
+        std::cout << "mapped sparse volume " << path << ", " << header.nx << "x" << header.ny << "x" << header.nz << " voxels in " << header.brick_count << " of " << cells << " bricks\n";
+        return true;
+    }
+
+    const int32_t *index;
+    const float *ranges;
+    const float *bricks;
+    int32_t empty_index;
+    void *mapping;
+    size_t mapping_size;
+#ifdef _WIN32
+    std::vector<char> contents;
+#endif
+};
@@ -4,7 +4,13 @@
 class texture
 {
 public:
+    virtual ~texture() {}
     virtual vec3 value(float u, float v, const vec3 &p) const = 0;
+    // value averaged over a footprint of width in uv space. only image textures filter, everything else is point sampled
+    virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+    {
+        return value(u, v, p);
+    }
     virtual float alpha(float u, float v, const vec3 &p) const
     {
         return 1.0;
@@ -51,6 +57,10 @@ public:
             return even->value(u, v, p);
         }
     }
+    virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+    {
+        return sines(p) > 0 ? odd->filtered_value(u, v, p, width) : even->filtered_value(u, v, p, width);
+    }
     virtual float alpha(float u, float v, const vec3 &p) const
     {
         // the alpha at the specified uv value
@@ -0,0 +1,481 @@
+#pragma once
+#include "image.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// image textures too big to keep in memory all at once.
+// each png is converted once into a tiled file next to it, with the whole mip pyramid split into square tiles, and tiles are read in
+// as lookups reach them through a cache that evicts the least recently used ones once it's over its memory budget.
+//
+// file layout, all little endian and 4 byte values. written by write_tiled_texture
+//   header (64 bytes): "TTEX", version, width, height, texel format, srgb, tile_size, level_count, data_offset, then padding
+//   levels: level_count entries of width, height, tiles_x, tiles_y, first_tile
+//   tiles: at data_offset, which is page aligned, tile_size^2 texels each in the texel format, x fastest. the tiles of a level are
+//   in rows, and tiles that stick out past the edge of their level are padded with zeros
+
+#define TILED_TEXTURE_MAGIC 0x58455454 // "TTEX"
+#define TILED_TEXTURE_VERSION 1
+#define TILED_TEXTURE_EXTENSION ".ttex"
+// striped like the reservoir buffer, so threads only contend when their tiles hash to the same shard
+#define TEXTURE_CACHE_SHARDS 16
+
+struct tiled_texture_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t format;
+    uint32_t srgb;
+    uint32_t tile_size;
+    uint32_t level_count;
+    uint32_t data_offset;
+    uint32_t padding[7];
+};
+
+struct tiled_level
+{
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    uint32_t first_tile;
+};
+
+bool write_tiled_texture(const image_texture &image, int tile_size, std::string path)
+{
+    const mip_level &base = image.levels[0];
+    tiled_texture_header header = {};
+    header.magic = TILED_TEXTURE_MAGIC;
+    header.version = TILED_TEXTURE_VERSION;
+    header.width = image.width;
+    header.height = image.height;
+    header.format = base.format;
+    header.srgb = base.decode == srgb_decode_table();
+    header.tile_size = tile_size;
+    header.level_count = image.levels.size();
+    std::vector<tiled_level> levels;
+    uint32_t tiles = 0;
+    for (const mip_level &mip : image.levels)
+    {
+        tiled_level level;
+        level.width = mip.width;
+        level.height = mip.height;
+        level.tiles_x = (mip.width + tile_size - 1) / tile_size;
+        level.tiles_y = (mip.height + tile_size - 1) / tile_size;
+        level.first_tile = tiles;
+        tiles += level.tiles_x * level.tiles_y;
+        levels.push_back(level);
+    }
+    size_t table_end = sizeof(header) + levels.size() * sizeof(tiled_level);
+    header.data_offset = (table_end + 4095) / 4096 * 4096;
+
+    // written aside and renamed into place like the scene cache, so an interrupted conversion never leaves a file that looks current
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)levels.data(), levels.size() * sizeof(tiled_level));
+    std::vector<char> zeros(header.data_offset - table_end, 0);
+    file.write(zeros.data(), zeros.size());
+
+    size_t bytes = texel_bytes(base.format);
+    std::vector<char> tile(tile_size * tile_size * bytes);
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        const mip_level &mip = image.levels[l];
+        const char *texels = (const char *)mip.bytes();
+        for (uint32_t ty = 0; ty < levels[l].tiles_y; ty++)
+        {
+            for (uint32_t tx = 0; tx < levels[l].tiles_x; tx++)
+            {
+                std::fill(tile.begin(), tile.end(), 0);
+                int x0 = tx * tile_size, y0 = ty * tile_size;
+                int columns = std::min(tile_size, mip.width - x0);
+                for (int y = 0; y < tile_size && y0 + y < mip.height; y++)
+                {
+                    memcpy(&tile[y * tile_size * bytes], texels + ((size_t)(y0 + y) * mip.width + x0) * bytes, columns * bytes);
+                }
+                file.write(tile.data(), tile.size());
+            }
+        }
+    }
+    file.close();
+    if (!file || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// tiles are stored as mip levels of tile_size^2 texels, so they decode the same way whole images do
+typedef std::shared_ptr<const mip_level> texture_tile;
+
+class texture_cache
+{
+public:
+    texture_cache(size_t budget_bytes, int tile_size) : tile_size(tile_size), budget_bytes(budget_bytes), hits(0), misses(0), evictions(0), bytes_read(0), resident_bytes(0), peak_bytes(0) {}
+
+    // the tile for key, calling load to read it in on a miss. loading happens outside the lock, so a slow read only holds up the threads
+    // that wait for that same tile
+    template <typename Load>
+    texture_tile get(uint64_t key, Load load)
+    {
+        shard &s = shards[key % TEXTURE_CACHE_SHARDS];
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            auto found = s.entries.find(key);
+            if (found != s.entries.end())
+            {
+                // move to the front of the lru list
+                s.order.splice(s.order.begin(), s.order, found->second.position);
+                hits++;
+                return found->second.tile;
+            }
+        }
+        misses++;
+        std::shared_ptr<mip_level> loaded = std::make_shared<mip_level>();
+        load(*loaded);
+        size_t size = loaded->memory_bytes();
+        bytes_read += size;
+
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto found = s.entries.find(key);
+        if (found != s.entries.end())
+        {
+            // another thread read it in first
+            return found->second.tile;
+        }
+        s.order.push_front(key);
+        s.entries[key] = {loaded, s.order.begin()};
+        s.bytes += size;
+        size_t resident = resident_bytes += size;
+        size_t peak = peak_bytes;
+        while (resident > peak && !peak_bytes.compare_exchange_weak(peak, resident))
+        {
+        }
+        // each shard gets an equal part of the budget, but always keeps the tile it just read
+        while (s.bytes > budget_bytes / TEXTURE_CACHE_SHARDS && s.order.size() > 1)
+        {
+            auto evicted = s.entries.find(s.order.back());
+            size_t evicted_size = evicted->second.tile->memory_bytes();
+            s.bytes -= evicted_size;
+            resident_bytes -= evicted_size;
+            // threads that still hold the tile keep it alive until they're done with it
+            s.entries.erase(evicted);
+            s.order.pop_back();
+            evictions++;
+        }
+        return loaded;
+    }
+
+    void print_stats() const
+    {
+        long lookups = hits + misses;
+        std::cout << "texture cache: " << lookups << " tile lookups, " << hits << " hits, " << misses << " misses (hit rate "
+                  << (lookups > 0 ? 100.0 * hits / lookups : 0.0) << "%), " << evictions << " evictions, "
+                  << bytes_read / (1024 * 1024) << " MiB read, peak " << peak_bytes / (1024 * 1024) << " of " << budget_bytes / (1024 * 1024) << " MiB budget\n";
+    }
+
+    int tile_size;
+    size_t budget_bytes;
+    std::atomic<long> hits, misses, evictions;
+    std::atomic<size_t> bytes_read, resident_bytes, peak_bytes;
+
+private:
+    struct entry
+    {
+        texture_tile tile;
+        std::list<uint64_t>::iterator position;
+    };
+    struct shard
+    {
+        shard() : bytes(0) {}
+        std::mutex lock;
+        // most recently used first
+        std::list<uint64_t> order;
+        std::unordered_map<uint64_t, entry> entries;
+        size_t bytes;
+    };
+    shard shards[TEXTURE_CACHE_SHARDS];
+};
+
+// filters the same way image_texture does, with texels fetched tile by tile through the cache
+class tiled_image_texture : public texture
+{
+public:
+    // reads nothing until open, so materials can point to it while the file is still being written
+    tiled_image_texture(std::string path, texture_cache *cache) : width(0), height(0), filter(FILTER_TRILINEAR), path(path), cache(cache)
+    {
+        static std::atomic<uint32_t> next_id(0);
+        id = next_id++;
+    }
+    ~tiled_image_texture()
+    {
+#ifndef _WIN32
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    // x and y have to be inside the level
+    vec3 texel(int level, int x, int y) const
+    {
+        int ts = header.tile_size;
+        const tiled_level &l = levels[level];
+        texture_tile t = tile(l.first_tile + (y / ts) * l.tiles_x + x / ts);
+        return t->fetch((y % ts) * ts + x % ts);
+    }
+    // u and v have to be in [0, 1)
+    vec3 bilinear(int level, float u, float v) const
+    {
+        const tiled_level &l = levels[level];
+        int w = l.width, h = l.height;
+        float x = u * w - 0.5f;
+        float y = v * h - 0.5f;
+        int x0 = (int)floor(x);
+        int y0 = (int)floor(y);
+        float fx = x - x0;
+        float fy = y - y0;
+        int x1 = x0 + 1 == w ? 0 : x0 + 1;
+        int y1 = y0 + 1 == h ? 0 : y0 + 1;
+        x0 = x0 < 0 ? w - 1 : x0;
+        y0 = y0 < 0 ? h - 1 : y0;
+        int ts = header.tile_size;
+        vec3 c00, c10, c01, c11;
+        if (x0 / ts == x1 / ts && y0 / ts == y1 / ts)
+        {
+            // all four in one tile, which is almost always the case
+            texture_tile t = tile(l.first_tile + (y0 / ts) * l.tiles_x + x0 / ts);
+            int row0 = (y0 % ts) * ts, row1 = (y1 % ts) * ts;
+            c00 = t->fetch(row0 + x0 % ts);
+            c10 = t->fetch(row0 + x1 % ts);
+            c01 = t->fetch(row1 + x0 % ts);
+            c11 = t->fetch(row1 + x1 % ts);
+        }
+        else
+        {
+            c00 = texel(level, x0, y0);
+            c10 = texel(level, x1, y0);
+            c01 = texel(level, x0, y1);
+            c11 = texel(level, x1, y1);
+        }
+        return (1 - fx) * (1 - fy) * c00 + fx * (1 - fy) * c10 + (1 - fx) * fy * c01 + fx * fy * c11;
+    }
+    virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+    {
+        if (resident)
+        {
+            return resident->filtered_value(u, v, p, width);
+        }
+        if (filter == FILTER_NEAREST || levels.size() <= 1)
+        {
+            return value(u, v, p);
+        }
+        u -= floor(u);
+        v -= floor(v);
+        int count = levels.size();
+        float level = count - 1 + log2(std::max(width, 1e-8f));
+        if (filter == FILTER_BILINEAR || level <= 0)
+        {
+            return bilinear(0, u, v);
+        }
+        if (level >= count - 1)
+        {
+            return texel(count - 1, 0, 0);
+        }
+        int fine = (int)level;
+        float t = level - fine;
+        return (1 - t) * bilinear(fine, u, v) + t * bilinear(fine + 1, u, v);
+    }
+    vec3 value(float u, float v, const vec3 &p) const
+    {
+        if (resident)
+        {
+            return resident->value(u, v, p);
+        }
+        if (levels.empty())
+        {
+            return vec3(0, 0, 0);
+        }
+        int x, y;
+        nearest(u, v, x, y);
+        return texel(0, x, y);
+    }
+    float alpha(float u, float v, const vec3 &p) const
+    {
+        if (resident)
+        {
+            return resident->alpha(u, v, p);
+        }
+        if (levels.empty())
+        {
+            return 1;
+        }
+        int x, y;
+        nearest(u, v, x, y);
+        int ts = header.tile_size;
+        texture_tile t = tile((y / ts) * levels[0].tiles_x + x / ts);
+        return t->fetch_alpha((y % ts) * ts + x % ts);
+    }
+
+    // reads the header and level table. lookups return black until this succeeds
+    bool open()
+    {
+        if (!open_file())
+        {
+            std::cout << "could not open tiled texture " << path << "\n";
+            levels.clear();
+            return false;
+        }
+        return true;
+    }
+    // for when the tiled file couldn't be written. takes image and looks everything up in it instead of in tiles
+    void keep_resident(image_texture *image)
+    {
+        image->filter = filter;
+        width = image->width;
+        height = image->height;
+        levels.clear();
+        resident.reset(image);
+    }
+
+    int width, height;
+    texture_filter filter;
+    // the .ttex file
+    std::string path;
+    // the whole image, only set by keep_resident
+    std::unique_ptr<image_texture> resident;
+
+private:
+    texture_tile tile(uint32_t index) const
+    {
+        // consecutive lookups from a thread mostly land in the same tile, so each thread keeps its last one and only goes through the
+        // cache, with its lock, when it moves on to another
+        thread_local uint64_t last_key = ~(uint64_t)0;
+        thread_local texture_tile last_tile;
+        uint64_t key = ((uint64_t)id << 32) | index;
+        if (key != last_key)
+        {
+            last_tile = cache->get(key, [&](mip_level &out) { read_tile(index, out); });
+            last_key = key;
+        }
+        return last_tile;
+    }
+    void read_tile(uint32_t index, mip_level &out) const
+    {
+        out.width = out.height = header.tile_size;
+        out.format = (texel_format)header.format;
+        out.decode = header.srgb ? srgb_decode_table() : linear_decode_table();
+        out.allocate();
+        char *destination = (char *)out.writable_bytes();
+        size_t size = out.memory_bytes();
+        size_t offset = header.data_offset + (size_t)index * size;
+#ifndef _WIN32
+        // pread doesn't move a shared file position, so threads can read tiles at the same time
+        bool ok = pread(fd, destination, size, offset) == (ssize_t)size;
+#else
+        std::lock_guard<std::mutex> guard(file_lock);
+        file.seekg(offset);
+        bool ok = (bool)file.read(destination, size);
+#endif
+        if (!ok)
+        {
+            std::cout << "failed to read tile " << index << " of " << path << "\n";
+        }
+    }
+    void nearest(float u, float v, int &x, int &y) const
+    {
+        v -= int(v);
+        if (v < 0)
+        {
+            v += 1;
+        }
+        u -= int(u);
+        if (u < 0)
+        {
+            u += 1;
+        }
+        y = std::min(int(v * height), height - 1);
+        x = std::min(int(u * width), width - 1);
+    }
+    bool open_file()
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+        {
+            return false;
+        }
+        size_t file_size = in.tellg();
+        in.seekg(0);
+        if (!in.read((char *)&header, sizeof(header)) || header.magic != TILED_TEXTURE_MAGIC || header.version != TILED_TEXTURE_VERSION ||
+            header.level_count == 0 || header.tile_size == 0 || header.format > TEXEL_RGBA16F)
+        {
+            return false;
+        }
+        levels.resize(header.level_count);
+        if (!in.read((char *)levels.data(), levels.size() * sizeof(tiled_level)))
+        {
+            return false;
+        }
+        const tiled_level &last = levels.back();
+        size_t tiles = last.first_tile + last.tiles_x * last.tiles_y;
+        if (header.data_offset + tiles * header.tile_size * header.tile_size * texel_bytes((texel_format)header.format) > file_size)
+        {
+            std::cout << "tiled texture " << path << " is truncated\n";
+            return false;
+        }
+        width = header.width;
+        height = header.height;
+#ifndef _WIN32
+        fd = ::open(path.c_str(), O_RDONLY);
+        return fd >= 0;
+#else
+        file.open(path, std::ios::binary);
+        return (bool)file;
+#endif
+    }
+
+    texture_cache *cache;
+    uint32_t id;
+    tiled_texture_header header;
+    std::vector<tiled_level> levels;
+#ifndef _WIN32
+    int fd = -1;
+#else
+    mutable std::ifstream file;
+    mutable std::mutex file_lock;
+#endif
+};
+
+// true when the tiled file exists, is at least as new as the png and was written with the same tile size and decoding
+bool tiled_texture_is_current(std::string png_path, std::string tiled_path, int tile_size, bool srgb)
+{
+    struct stat png_info, tiled_info;
+    if (stat(tiled_path.c_str(), &tiled_info) != 0 || (stat(png_path.c_str(), &png_info) == 0 && png_info.st_mtime > tiled_info.st_mtime))
+    {
+        return false;
+    }
+    std::ifstream in(tiled_path, std::ios::binary);
+    tiled_texture_header header;
+    return in.read((char *)&header, sizeof(header)) && header.magic == TILED_TEXTURE_MAGIC && header.version == TILED_TEXTURE_VERSION &&
+           (int)header.tile_size == tile_size && (bool)header.srgb == srgb;
+}
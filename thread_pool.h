@@ -0,0 +1,122 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads that run queued jobs in the order they were submitted.
+// used while loading scenes, so that textures decode while the rest of the scene is built
+class thread_pool
+{
+public:
+    // 0 threads means one per hardware thread
+    thread_pool(int threads = 0) : stopping(false)
+    {
+        if (threads <= 0)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+    // finishes the jobs that are still queued before returning
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // the future becomes ready once job has run, and rethrows anything it threw
+    std::shared_future<void> submit(std::function<void()> job)
+    {
+        auto task = std::make_shared<std::packaged_task<void()>>(job);
+        std::shared_future<void> done = task->get_future().share();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back([task]() { (*task)(); });
+        }
+        wakeup.notify_one();
+        return done;
+    }
+
+    // runs job(i) for i in [0, count) on the workers and the calling thread, and returns once all of them ran.
+    // the caller takes indices too, so this doesn't wait behind jobs that were queued earlier, like textures that are still decoding
+    void parallel_for(int count, std::function<void(int)> job)
+    {
+        struct shared_state
+        {
+            std::function<void(int)> job;
+            int count;
+            std::atomic<int> next;
+            std::atomic<int> finished;
+        };
+        auto state = std::make_shared<shared_state>();
+        state->job = job;
+        state->count = count;
+        state->next = 0;
+        state->finished = 0;
+        auto run = [state]() {
+            int i;
+            while ((i = state->next++) < state->count)
+            {
+                state->job(i);
+                state->finished++;
+            }
+        };
+        for (int i = 0; i < std::min(count, size()); i++)
+        {
+            // helpers that only start once everything is taken return right away
+            submit(run);
+        }
+        run();
+        while (state->finished < count)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+private:
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeup.wait(guard, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stopping;
+};
@@ -15,13 +15,14 @@ class transform3
 {
 public:
     // transform3() {}
-    transform3(Eigen::Affine3f transform) : _transform(transform) {}
+    transform3(Eigen::Affine3f transform) : _transform(transform) { cache(); }
     transform3(vec3 scale = ONE, vec3 rotate = ZERO, vec3 translate = ZERO)
     {
         auto t_scale = Eigen::Scaling(scale.x(), scale.y(), scale.z());
         auto t_rotate = Eigen::AngleAxisf(rotate.x() * M_PI, Vector3f::UnitX()) * Eigen::AngleAxisf(rotate.y() * M_PI, Vector3f::UnitY()) * Eigen::AngleAxisf(rotate.z() * M_PI, Vector3f::UnitZ());
         auto t_translate = Eigen::Translation<float, 3>(translate.as_eigen_vector3());
         _transform = t_translate * t_rotate * t_scale;
+        cache();
     }
     static transform3 from_rotate_and_translate(vec3 rotate, vec3 translate)
     {
@@ -59,7 +60,12 @@ public:
     }
     vec3 apply_normal(vec3 v) const
     {
-        return vec3((Vector3f)((_transform.linear().inverse().transpose() * v.as_eigen_vector3()).normalized()));
+        return vec3((Vector3f)((_normal_matrix * v.as_eigen_vector3()).normalized()));
+    }
+    // factor by which a surface element with unit normal n grows in area under this transform
+    float area_scale(vec3 n) const
+    {
+        return fabs(_determinant) * (_normal_matrix * n.as_eigen_vector3()).norm();
     }
 
     inline vec3 operator*(vec3 vec) const
@@ -67,4 +73,13 @@ public:
         return vec3(_transform * vec.as_eigen_vector3());
     }
     Eigen::Affine3f _transform;
+    Matrix3f _normal_matrix;
+    float _determinant;
+
+private:
+    void cache()
+    {
+        _normal_matrix = _transform.linear().inverse().transpose();
+        _determinant = _transform.linear().determinant();
+    }
 };
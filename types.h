@@ -30,3 +30,18 @@ T **array_2d(int width, int height)
     }
     return data;
 }
+
+// frees what array_2d allocated
+template <typename T>
+void delete_2d(T **data, int height)
+{
+    if (data == nullptr)
+    {
+        return;
+    }
+    for (int i = 0; i < height; i++)
+    {
+        delete[] data[i];
+    }
+    delete[] data;
+}
@@ -3,91 +3,338 @@
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
+#include <fstream>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
 
-class constant_medium : public hittable
+// participating media with spatially varying density.
+// free flights are sampled with delta tracking and shadow rays use ratio tracking (Novák et al. 2014),
+// both against a coarse grid of majorants so that thin or empty parts of a volume are crossed in a few big steps.
+
+class density_field
 {
 public:
-    constant_medium(hittable *b, float d, texture *a) : boundary(b), density(d)
+    virtual float density(const vec3 &p) const = 0;
+    // an upper bound on density() inside region, used to build the majorant grid
+    virtual float max_density(const aabb &region) const = 0;
+};
+
+class constant_density : public density_field
+{
+public:
+    constant_density(float d) : d(d) {}
+    virtual float density(const vec3 &p) const
     {
-        phase_function = new isotropic(a);
+        return d;
     }
-    constant_medium(hittable *b, float d, vec3 a) : boundary(b), density(d)
+    virtual float max_density(const aabb &region) const
     {
-        phase_function = new isotropic(a);
+        return d;
     }
-    virtual bool hit(
-        const ray &r, float t_min, float t_max, hit_record &rec) const;
-    virtual bool bounding_box(float t0, float t1, aabb &box) const
+    float d;
+};
+
+// density from the luminance of a (usually procedural) texture at p. luminance is clamped to 1, so scale bounds it everywhere
+class texture_density : public density_field
+{
+public:
+    texture_density(texture *tex, float scale) : tex(tex), scale(scale) {}
+    virtual float density(const vec3 &p) const
     {
-        return boundary->bounding_box(t0, t1, box);
+        return scale * ffmin(ffmax(luminance(tex->value(0, 0, p)), 0.0f), 1.0f);
     }
-    hittable *boundary;
-    float density;
-    material *phase_function;
+    virtual float max_density(const aabb &region) const
+    {
+        return scale;
+    }
+    texture *tex;
+    float scale;
 };
 
-bool constant_medium::hit(const ray &r, float t_min, float t_max, hit_record &rec)
-    const
+// a dense grid of densities stretched over bounds, x fastest, trilinearly interpolated between voxel centers
+class grid_density : public density_field
 {
+public:
+    grid_density(int nx, int ny, int nz, std::vector<float> values, aabb bounds, float scale = 1.0f) : nx(nx), ny(ny), nz(nz), values(values), bounds(bounds), scale(scale) {}
 
-    // Print occasional samples when debugging. To enable, set enableDebug true.
-    const bool enableDebug = false;
-    bool debugging = enableDebug && random_double() < 0.00001;
+    float voxel(int x, int y, int z) const
+    {
+        x = std::min(std::max(x, 0), nx - 1);
+        y = std::min(std::max(y, 0), ny - 1);
+        z = std::min(std::max(z, 0), nz - 1);
+        return values[(z * ny + y) * nx + x];
+    }
+    // position in voxel units, where voxel i covers [i, i + 1)
+    vec3 to_grid(const vec3 &p) const
+    {
+        vec3 extent = bounds.max() - bounds.min();
+        vec3 local = p - bounds.min();
+        return vec3(local.x() / extent.x() * nx, local.y() / extent.y() * ny, local.z() / extent.z() * nz);
+    }
+    virtual float density(const vec3 &p) const
+    {
+        vec3 g = to_grid(p);
+        if (g.x() < 0 || g.y() < 0 || g.z() < 0 || g.x() > nx || g.y() > ny || g.z() > nz)
+        {
+            return 0;
+        }
+        g -= vec3(0.5, 0.5, 0.5);
+        int x = (int)floor(g.x());
+        int y = (int)floor(g.y());
+        int z = (int)floor(g.z());
+        float fx = g.x() - x;
+        float fy = g.y() - y;
+        float fz = g.z() - z;
+        float result = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            int dx = i & 1, dy = (i >> 1) & 1, dz = i >> 2;
+            float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+            result += w * voxel(x + dx, y + dy, z + dz);
+        }
+        return scale * result;
+    }
+    // interpolation only mixes neighbouring voxels, so the max over every voxel touching the region is a bound
+    virtual float max_density(const aabb &region) const
+    {
+        vec3 lo = to_grid(region.min());
+        vec3 hi = to_grid(region.max());
+        float result = 0;
+        for (int z = (int)floor(lo.z()) - 1; z <= (int)floor(hi.z()) + 1; z++)
+        {
+            for (int y = (int)floor(lo.y()) - 1; y <= (int)floor(hi.y()) + 1; y++)
+            {
+                for (int x = (int)floor(lo.x()) - 1; x <= (int)floor(hi.x()) + 1; x++)
+                {
+                    result = ffmax(result, voxel(x, y, z));
+                }
+            }
+        }
+        return scale * result;
+    }
 
-    hit_record rec1, rec2;
+    int nx, ny, nz;
+    std::vector<float> values;
+    aabb bounds;
+    float scale;
+};
 
-    if (boundary->hit(r, -FLT_MAX, FLT_MAX, rec1))
+// reads nx * ny * nz little endian float32s, x fastest. returns an empty vector if the file is missing or too short
+std::vector<float> read_raw_grid(std::string path, int nx, int ny, int nz)
+{
+    std::vector<float> values((size_t)nx * ny * nz);
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read((char *)values.data(), values.size() * sizeof(float)))
     {
-        if (boundary->hit(r, rec1.t + 0.0001, FLT_MAX, rec2))
-        {
+        std::cout << "could not read " << values.size() << " densities from " << path << '\n';
+        values.clear();
+    }
+    return values;
+}
 
-            if (debugging)
+// max density over each cell of a coarse grid covering the volume's bounding box
+class majorant_grid
+{
+public:
+    majorant_grid(const density_field *field, aabb bounds, int resolution) : bounds(bounds), resolution(resolution), cells(resolution * resolution * resolution)
+    {
+        vec3 cell_size = (bounds.max() - bounds.min()) / resolution;
+        for (int z = 0; z < resolution; z++)
+        {
+            for (int y = 0; y < resolution; y++)
             {
-                std::cerr << "\nt0 t1 " << rec1.t << " " << rec2.t << '\n';
+                for (int x = 0; x < resolution; x++)
+                {
+                    vec3 lo = bounds.min() + vec3(x * cell_size.x(), y * cell_size.y(), z * cell_size.z());
+                    cells[(z * resolution + y) * resolution + x] = field->max_density(aabb(lo, lo + cell_size));
+                }
             }
+        }
+    }
+
+    // cells that were already computed, like the ones stored in a scene cache
+    majorant_grid(aabb bounds, int resolution, std::vector<float> cells) : bounds(bounds), resolution(resolution), cells(cells) {}
 
-            if (rec1.t < t_min)
+    // walks the cells r passes through between t0 and t1 (Amanatides and Woo 1987), calling segment(t_enter, t_exit, majorant) for each.
+    // stops early when segment returns false
+    template <typename Segment>
+    void traverse(const ray &r, float t0, float t1, Segment segment) const
+    {
+        vec3 extent = bounds.max() - bounds.min();
+        vec3 start = r.point_at_parameter(t0) - bounds.min();
+        int cell[3], step[3];
+        float next_t[3], delta_t[3];
+        for (int a = 0; a < 3; a++)
+        {
+            float cell_size = extent[a] / resolution;
+            cell[a] = std::min(std::max((int)floor(start[a] / cell_size), 0), resolution - 1);
+            float d = r.direction()[a];
+            if (d > 0)
             {
-                rec1.t = t_min;
+                step[a] = 1;
+                next_t[a] = t0 + ((cell[a] + 1) * cell_size - start[a]) / d;
+                delta_t[a] = cell_size / d;
             }
-
-            if (rec2.t > t_max)
+            else if (d < 0)
             {
-                rec2.t = t_max;
+                step[a] = -1;
+                next_t[a] = t0 + (cell[a] * cell_size - start[a]) / d;
+                delta_t[a] = -cell_size / d;
             }
-
-            if (rec1.t >= rec2.t)
+            else
             {
-                return false;
+                step[a] = 0;
+                next_t[a] = FLT_MAX;
+                delta_t[a] = FLT_MAX;
             }
-
-            if (rec1.t < 0)
+        }
+        float t = t0;
+        while (t < t1)
+        {
+            int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+            float t_exit = ffmax(ffmin(next_t[axis], t1), t);
+            if (!segment(t, t_exit, cells[(cell[2] * resolution + cell[1]) * resolution + cell[0]]))
             {
-                rec1.t = 0;
+                return;
             }
-
-            float distance_inside_boundary = (rec2.t - rec1.t) * r.direction().length();
-            float hit_distance = -(1 / density) * log(random_double());
-
-            if (hit_distance < distance_inside_boundary)
+            t = t_exit;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= resolution)
             {
+                return;
+            }
+            next_t[axis] += delta_t[axis];
+        }
+    }
 
-                rec.t = rec1.t + hit_distance / r.direction().length();
-                rec.p = r.point_at_parameter(rec.t);
+    aabb bounds;
+    int resolution;
+    std::vector<float> cells;
+};
 
-                if (debugging)
-                {
-                    std::cerr << "hit_distance = " << hit_distance << '\n'
-                              << "rec.t = " << rec.t << '\n'
-                              << "rec.p = " << rec.p << '\n';
-                }
+// random numbers for tracking, seeded from the bits of the ray itself.
+// this keeps hit() a pure function of its arguments, safe to call from any thread and repeatable
+struct ray_rng
+{
+    ray_rng(const ray &r)
+    {
+        float components[6] = {r.origin().x(), r.origin().y(), r.origin().z(), r.direction().x(), r.direction().y(), r.direction().z()};
+        state = 0x9e3779b9u;
+        for (int i = 0; i < 6; i++)
+        {
+            uint32_t bits;
+            memcpy(&bits, &components[i], sizeof(bits));
+            state = (state ^ bits) * 0x85ebca6bu;
+            state ^= state >> 13;
+        }
+    }
+    // pcg32 style step, returns a float in [0, 1)
+    float next()
+    {
+        state = state * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        word = (word >> 22u) ^ word;
+        return (word >> 8) / 16777216.0f;
+    }
+    uint32_t state;
+};
 
-                rec.normal = vec3(1, 0, 0); // arbitrary
-                rec.mat_ptr = phase_function;
-                rec.primitive = (hittable *)this;
+class heterogeneous_medium : public hittable
+{
+public:
+    // the majorant grid has majorant_resolution cells along each axis of the boundary's bounding box
+    heterogeneous_medium(hittable *boundary, density_field *field, material *phase_function, int majorant_resolution = 16) : boundary(boundary), field(field), phase_function(material_id(phase_function))
+    {
+        aabb bounds;
+        boundary->bounding_box(0, 1, bounds);
+        majorants = new majorant_grid(field, bounds, majorant_resolution);
+    }
+    heterogeneous_medium(hittable *boundary, density_field *field, int phase_function, majorant_grid *majorants) : boundary(boundary), field(field), majorants(majorants), phase_function(phase_function) {}
+    // delta tracking: tentative collisions are sampled against the majorant and accepted with probability density / majorant
+    virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+    {
+        float t0, t1;
+        if (!boundary->hit_interval(r, t_min, t_max, t0, t1))
+        {
+            return false;
+        }
+        ray_rng rng(r);
+        float length = r.direction().length();
+        float t_hit = -1;
+        majorants->traverse(r, t0, t1, [&](float t_enter, float t_exit, float majorant) {
+            if (majorant <= 0)
+            {
                 return true;
             }
+            float t = t_enter;
+            while (true)
+            {
+                t -= log(1 - rng.next()) / (majorant * length);
+                if (t >= t_exit)
+                {
+                    return true;
+                }
+                if (rng.next() * majorant < field->density(r.point_at_parameter(t)))
+                {
+                    t_hit = t;
+                    return false;
+                }
+            }
+        });
+        if (t_hit < 0)
+        {
+            return false;
         }
+        rec.t = t_hit;
+        rec.p = r.point_at_parameter(t_hit);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.u = 0;
+        rec.v = 0;
+        rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+        rec.material_id = phase_function;
+        rec.primitive = (hittable *)this;
+        return true;
     }
-    return false;
-}
+    // ratio tracking: the same tentative collisions, but each one scales the transmittance instead of ending the walk
+    virtual float transmittance(const ray &r, float t_min, float t_max) const
+    {
+        float t0, t1;
+        if (!boundary->hit_interval(r, t_min, t_max, t0, t1))
+        {
+            return 1.0f;
+        }
+        ray_rng rng(r);
+        float length = r.direction().length();
+        float result = 1.0f;
+        majorants->traverse(r, t0, t1, [&](float t_enter, float t_exit, float majorant) {
+            if (majorant <= 0)
+            {
+                return true;
+            }
+            float t = t_enter;
+            while (true)
+            {
+                t -= log(1 - rng.next()) / (majorant * length);
+                if (t >= t_exit)
+                {
+                    return true;
+                }
+                result *= 1 - ffmin(field->density(r.point_at_parameter(t)) / majorant, 1.0f);
+                if (result <= 0)
+                {
+                    return false;
+                }
+            }
+        });
+        return result;
+    }
+    virtual bool bounding_box(float t0, float t1, aabb &box) const
+    {
+        return boundary->bounding_box(t0, t1, box);
+    }
+    hittable *boundary;
+    density_field *field;
+    majorant_grid *majorants;
+    int phase_function;
+};
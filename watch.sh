@@ -1,3 +0,0 @@
-#!/usr/bin/env bash
-
-(python3 watch_and_convert_ppm.py 2>&1 1>/dev/null &)
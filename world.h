@@ -1,23 +1,37 @@
 #pragma once
+#include "animation.h"
+#include "bvh.h"
 #include "config.h"
+#include "environment.h"
 #include "hittable.h"
+#include "primitive.h"
 #include "texture.h"
+#include "texture_cache.h"
 #include "thirdparty/json.hpp"
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 using json = nlohmann::json;
 
 class World : public hittable
 {
 public:
-    World(bvh_node *ptr, texture *background, std::vector<hittable *> lights) : ptr(ptr), background(background), lights(lights)
+    World(bvh_node *ptr, texture *background, std::vector<hittable *> lights, environment_map *environment = nullptr) : ptr(ptr), background(background), lights(lights), environment(environment)
     {
         // search through bvh and find lights
         // ptr->find_lights(&lights);
+        assign_light_groups(std::vector<std::string>());
     }
     virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const
     {
         return ptr->hit(r, tmin, tmax, rec);
     }
+    virtual float transmittance(const ray &r, float t_min, float t_max) const
+    {
+        return ptr->transmittance(r, t_min, t_max);
+    }
     virtual bool bounding_box(float t0, float t1, aabb &box) const
     {
         return ptr->bounding_box(t0, t1, box);
@@ -28,14 +42,130 @@ public:
         return background->value(u, v, p);
     }
 
+    // radiance arriving from the background along `direction`
+    vec3 background_value(const vec3 &direction)
+    {
+        float u, v;
+        vec3 unit_direction = unit_vector(direction);
+        direction_to_uv(unit_direction, u, v);
+        return background->value(u, v, unit_direction);
+    }
+
     hittable *get_random_light()
     {
         int idx = (int)(random_double() * lights.size());
         return lights[idx];
     }
 
+    // the importance sampled background, if any, counts as one more light to pick from.
+    int num_lights() const
+    {
+        return lights.size() + (environment != nullptr);
+    }
+
+    float light_pick_pdf() const
+    {
+        return num_lights() > 0 ? 1.0f / num_lights() : 0.0f;
+    }
+
+    // picks uniformly between the area lights and the background. returns nullptr when the background was picked.
+    hittable *pick_light(float u)
+    {
+        int idx = min((int)(u * num_lights()), num_lights() - 1);
+        if (idx == (int)lights.size())
+        {
+            return nullptr;
+        }
+        return lights[idx];
+    }
+
+    // groups[k] names the light group of lights[k], from "light_group" on its instance. lights without one are a group of their own.
+    // the background and emitters that aren't in lights (glowing media) are the last two groups
+    void assign_light_groups(const std::vector<std::string> &groups)
+    {
+        light_group_labels = groups;
+        light_group_labels.resize(lights.size());
+        light_group_names.clear();
+        light_group_index.clear();
+        std::map<std::string, int> by_name;
+        for (size_t k = 0; k < lights.size(); k++)
+        {
+            std::string name = light_group_labels[k].empty() ? "light" + std::to_string(k) : light_group_labels[k];
+            auto found = by_name.find(name);
+            if (found == by_name.end())
+            {
+                found = by_name.emplace(name, (int)light_group_names.size()).first;
+                light_group_names.push_back(name);
+            }
+            light_group_index[lights[k]] = found->second;
+        }
+        light_group_names.push_back("background");
+        light_group_names.push_back("other");
+    }
+    // the group of a light that was hit or sampled, with nullptr for the background
+    int light_group_of(const hittable *light) const
+    {
+        int groups = light_group_names.size();
+        if (light == nullptr)
+        {
+            return groups - 2;
+        }
+        auto found = light_group_index.find(light);
+        return found != light_group_index.end() ? found->second : groups - 1;
+    }
+
+    // moves the keyframed instances to where they are at frame, or has them move from there over config.shutter frames while the
+    // shutter is open for motion blur. then refits the bvh around them, or rebuilds it when refitting left it
+    // config.bvh_rebuild_threshold times as costly to traverse as it was when it was built. returns true when it was rebuilt
+    bool set_frame(float frame)
+    {
+        if (built_cost <= 0)
+        {
+            built_cost = tree_cost(ptr->refit());
+        }
+        for (const instance_animation &animation : animations)
+        {
+            if (config.shutter > 0)
+            {
+                animation.target->set_motion(animation.key_at(frame), animation.key_at(frame + config.shutter), config.swept_motion_bounds);
+            }
+            else
+            {
+                animation.target->set_transform(animation.at(frame));
+            }
+        }
+        cost = tree_cost(ptr->refit());
+        if (cost <= config.bvh_rebuild_threshold * built_cost)
+        {
+            return false;
+        }
+        bvh_node *old = ptr;
+        ptr = new bvh_node(objects.data(), objects.size(), 0.0f, 0.0f);
+        free_bvh(old);
+        cost = built_cost = tree_cost(ptr->refit());
+        return true;
+    }
+    // the surface area of all nodes over the root's, which is how many nodes a ray that hits the root visits on average
+    float tree_cost(float area) const
+    {
+        return ptr->area() > 0 ? area / ptr->area() : 1.0f;
+    }
+
     Config config;
     bvh_node *ptr;
+    // what the bvh is built over, to rebuild it from
+    std::vector<hittable *> objects;
+    std::vector<instance_animation> animations;
+    // of the bvh after the last set_frame, and after it was last built
+    float cost = 0;
+    float built_cost = 0;
     std::vector<hittable *> lights;
     texture *background;
+    environment_map *environment;
+    // png textures are paged in through this when it's set
+    texture_cache *tile_cache = nullptr;
+    // what assign_light_groups was given, and the groups that came out of it
+    std::vector<std::string> light_group_labels;
+    std::vector<std::string> light_group_names;
+    std::unordered_map<const hittable *, int> light_group_index;
 };